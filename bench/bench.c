@@ -0,0 +1,438 @@
+// bench.c
+//
+// Microbenchmarks for the sysfs and /proc paths against a synthetic root,
+// plus an end-to-end freeze/thaw harness on real child processes and a
+// check of the nut power source against the stand-in UPS server.
+// Results are printed as JSON.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "battery_monitor.h"
+#include "process_monitor.h"
+#include "backend.h"
+#include "paths.h"
+
+#define MAX_SIZES 16
+#define MAX_IGNORES 200
+
+static FILE *json_out = NULL;
+static int first_result = 1;
+static char bench_root[PATH_MAX];
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_file(const char *path, const char *content) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fputs(content, file);
+    fclose(file);
+}
+
+static void make_dirs(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+    mkdir(dir, 0755);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+static void remove_tree(const char *path) {
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Fake battery, backlight and config file under the bench root
+static void build_sysfs_tree() {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/sys/class/power_supply/BAT0", bench_root);
+    make_dirs(path);
+    snprintf(path, sizeof(path), "%s/sys/class/power_supply/BAT0/capacity", bench_root);
+    write_file(path, "42\n");
+    snprintf(path, sizeof(path), "%s/sys/class/power_supply/BAT0/status", bench_root);
+    write_file(path, "Discharging\n");
+
+    snprintf(path, sizeof(path), "%s/home/.config/battery_monitor", bench_root);
+    make_dirs(path);
+    snprintf(path, sizeof(path), "%s/home/.config/battery_monitor/config.conf", bench_root);
+    write_file(path, "ignore_processes_for_sleep=vi,neovim,vim,emacs,tmux,screen,ssh-agent,gpg-agent\n"
+                     "ignore_processes_for_kill=firefox,code,chromium\n");
+
+    snprintf(path, sizeof(path), "%s/home", bench_root);
+    setenv("HOME", path, 1);
+}
+
+// Replace the fake /proc with `count` user-owned, terminal-less processes
+static void build_proc_tree(int count) {
+    char path[PATH_MAX];
+    char content[256];
+    uid_t uid = getuid();
+
+    snprintf(path, sizeof(path), "%s/proc", bench_root);
+    remove_tree(path);
+    make_dirs(path);
+
+    for (int i = 0; i < count; i++) {
+        int pid = 100000 + i;
+        snprintf(path, sizeof(path), "%s/proc/%d", bench_root, pid);
+        mkdir(path, 0755);
+
+        snprintf(path, sizeof(path), "%s/proc/%d/stat", bench_root, pid);
+        snprintf(content, sizeof(content), "%d (worker%d) S %d %d %d 0 -1 4194560 0 0 0 0 0 0 0 0 20 0 1 0\n",
+                 pid, i % 97, i == 0 ? 1 : 100000 + (i - 1) / 8, pid, pid);
+        write_file(path, content);
+
+        snprintf(path, sizeof(path), "%s/proc/%d/status", bench_root, pid);
+        snprintf(content, sizeof(content), "Name:\tworker%d\nState:\tS (sleeping)\nPPid:\t1\nUid:\t%u\t%u\t%u\t%u\n",
+                 i % 97, uid, uid, uid, uid);
+        write_file(path, content);
+    }
+}
+
+static void report(const char *name, const char *params, long iterations, double seconds) {
+    fprintf(json_out, "%s\n    {\"name\": \"%s\"%s%s, \"iterations\": %ld, \"total_seconds\": %.6f, \"ns_per_op\": %.1f}",
+            first_result ? "" : ",", name, params[0] ? ", " : "", params, iterations, seconds,
+            seconds * 1e9 / iterations);
+    first_result = 0;
+}
+
+static void bench_battery_reads(long iterations) {
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        get_battery_level();
+    }
+    report("get_battery_level", "", iterations, now_seconds() - start);
+
+    start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        is_charging();
+    }
+    report("is_charging", "", iterations, now_seconds() - start);
+}
+
+static void bench_ignore_lists(long iterations) {
+    char *ignore_list[MAX_IGNORES];
+    int ignore_count = 0;
+
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        ignore_count = get_ignore_processes(ignore_list, MAX_IGNORES, "ignore_processes_for_sleep");
+        for (int j = 0; j < ignore_count; j++) {
+            free(ignore_list[j]);
+        }
+    }
+    report("get_ignore_processes", "", iterations, now_seconds() - start);
+
+    ignore_count = get_ignore_processes(ignore_list, MAX_IGNORES, "ignore_processes_for_sleep");
+    const char *names[] = { "systemd", "volumeicon", "worker17", "Firefox", "tmux" };
+    int name_count = sizeof(names) / sizeof(names[0]);
+
+    volatile int critical = 0;
+    start = now_seconds();
+    for (long i = 0; i < iterations * 10; i++) {
+        critical += is_process_critical(names[i % name_count], ignore_list, ignore_count);
+    }
+    char params[64];
+    snprintf(params, sizeof(params), "\"ignore_count\": %d", ignore_count);
+    report("is_process_critical", params, iterations * 10, now_seconds() - start);
+
+    for (int j = 0; j < ignore_count; j++) {
+        free(ignore_list[j]);
+    }
+}
+
+static void bench_suspend_user_daemons(const int *sizes, int size_count) {
+    for (int s = 0; s < size_count; s++) {
+        build_proc_tree(sizes[s]);
+
+        // Keep the scan cheap relative to tree creation, but average a few runs on small trees
+        int runs = sizes[s] <= 1000 ? 20 : 3;
+        double start = now_seconds();
+        for (int r = 0; r < runs; r++) {
+            suspend_user_daemons();
+        }
+        double elapsed = now_seconds() - start;
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"processes\": %d", sizes[s]);
+        report("suspend_user_daemons", params, runs, elapsed);
+    }
+}
+
+// Freeze and thaw `count` spinning children through the daemon's own
+// suspend and resume paths, waiting until the kernel confirms each transition
+static void bench_freeze_thaw(int count) {
+    pid_t *children = calloc(count, sizeof(pid_t));
+    if (children == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("Failed to fork spinner");
+            count = i;
+            break;
+        }
+        if (pid == 0) {
+            // A job of its own, so it is not frozen together with the bench
+            setpgid(0, 0);
+            for (;;) {
+                // Spin
+            }
+        }
+        children[i] = pid;
+    }
+
+    // Let the children get scheduled and show up in ps as CPU hogs
+    usleep(300000);
+
+    // Real /proc and real signals, limited to our children
+    char saved_proc_root[PATH_MAX];
+    snprintf(saved_proc_root, sizeof(saved_proc_root), "%s", procfs_root);
+    set_root_prefixes(NULL, "");
+    set_test_scope(getpid());
+    dry_run = false;
+
+    int status;
+    double start = now_seconds();
+    run_battery_saving_mode(getpid());
+    double signalled = now_seconds();
+
+    // Wait for whatever the daemon chose to stop
+    int frozen_count = suspended_high_cpu_count;
+    pid_t *frozen_pids = calloc(frozen_count > 0 ? frozen_count : 1, sizeof(pid_t));
+    if (frozen_pids == NULL) {
+        frozen_count = 0;
+    }
+    for (int i = 0; i < frozen_count; i++) {
+        frozen_pids[i] = suspended_high_cpu_pids[i];
+        waitpid(frozen_pids[i], &status, WUNTRACED);
+    }
+    double frozen = now_seconds();
+
+    resume_high_cpu_processes();
+    double thaw_signalled = now_seconds();
+    for (int i = 0; i < frozen_count; i++) {
+        waitpid(frozen_pids[i], &status, WCONTINUED);
+    }
+    double thawed = now_seconds();
+    free(frozen_pids);
+
+    dry_run = true;
+    set_test_scope(0);
+    set_root_prefixes(NULL, saved_proc_root);
+
+    for (int i = 0; i < count; i++) {
+        kill(children[i], SIGKILL);
+        waitpid(children[i], &status, 0);
+    }
+    free(children);
+
+    fprintf(json_out, "%s\n    {\"name\": \"freeze_thaw\", \"processes\": %d, \"frozen\": %d, "
+                      "\"freeze_scan_seconds\": %.6f, \"freeze_seconds\": %.6f, "
+                      "\"thaw_signal_seconds\": %.6f, \"thaw_seconds\": %.6f}",
+            first_result ? "" : ",", count, frozen_count, signalled - start, frozen - start,
+            thaw_signalled - frozen, thawed - frozen);
+    first_result = 0;
+}
+
+// What the nut power source must report for each UPS state
+static const struct {
+    const char *status;
+    const char *charge;
+    int charging;
+    int level;
+} ups_steps[] = {
+    { "OL", "100", 1, 100 },
+    { "OB DISCHRG", "80", 0, 80 },
+    { "OB DISCHRG LB", "10", 0, 10 },
+};
+#define UPS_STEP_COUNT ((int)(sizeof(ups_steps) / sizeof(ups_steps[0])))
+
+// Drive the stand-in UPS server from line power to battery to low battery
+// and check what nut_power_source reads at each step. Returns 0 when every
+// step matched or the server is not built.
+static int bench_nut_client(const char *server) {
+    if (server[0] == '\0' || access(server, X_OK) == -1) {
+        fprintf(stderr, "UPS server %s not found, skipping the nut client check\n", server);
+        return 0;
+    }
+
+    char socket_path[PATH_MAX];
+    snprintf(socket_path, sizeof(socket_path), "%s/ups.sock", bench_root);
+
+    int input[2];
+    if (pipe(input) == -1) {
+        perror("pipe failed");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Failed to fork the UPS server");
+        close(input[0]);
+        close(input[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(input[0], STDIN_FILENO);
+        close(input[0]);
+        close(input[1]);
+        execl(server, server, "--socket", socket_path, (char *)NULL);
+        _exit(127);
+    }
+    close(input[0]);
+    // A server that died must fail the check, not kill the bench
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < 200 && access(socket_path, F_OK) == -1; i++) {
+        usleep(10000);
+    }
+
+    char address[PATH_MAX + 8];
+    snprintf(address, sizeof(address), "ups@%s", socket_path);
+    int passed = nut_power_source.open(address) == 0;
+
+    double read_seconds = 0;
+    for (int i = 0; i < UPS_STEP_COUNT; i++) {
+        dprintf(input[1], "ups.status=%s\nbattery.charge=%s\n", ups_steps[i].status, ups_steps[i].charge);
+        // Past the client's one second cache
+        usleep(1100000);
+
+        double start = now_seconds();
+        int level = nut_power_source.get_battery_level();
+        int charging = nut_power_source.is_charging();
+        read_seconds += now_seconds() - start;
+
+        if (level != ups_steps[i].level || charging != ups_steps[i].charging) {
+            fprintf(stderr, "UPS %s: read level %d, charging %d, expected %d, %d\n", ups_steps[i].status,
+                    level, charging, ups_steps[i].level, ups_steps[i].charging);
+            passed = 0;
+        }
+    }
+
+    close(input[1]);
+    kill(pid, SIGTERM);
+    int status;
+    waitpid(pid, &status, 0);
+
+    fprintf(json_out, "%s\n    {\"name\": \"nut_client\", \"steps\": %d, \"passed\": %s, \"ns_per_sample\": %.1f}",
+            first_result ? "" : ",", UPS_STEP_COUNT, passed ? "true" : "false",
+            read_seconds * 1e9 / UPS_STEP_COUNT);
+    first_result = 0;
+    return passed ? 0 : -1;
+}
+
+static int parse_sizes(const char *spec, int *sizes) {
+    int count = 0;
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    for (char *token = strtok(buffer, ","); token != NULL && count < MAX_SIZES; token = strtok(NULL, ",")) {
+        sizes[count++] = atoi(token);
+    }
+    return count;
+}
+
+static void print_usage() {
+    printf("Usage: battery_bench [options]\n"
+           "  --sizes N,N,...   Synthetic /proc sizes (default 100,1000,10000,50000)\n"
+           "  --spinners N      Children for the freeze/thaw harness, 0 to skip (default 64)\n"
+           "  --iterations N    Iterations for the microbenchmarks (default 20000)\n"
+           "  --ups-server PATH Stand-in UPS server for the nut client check, empty to skip\n"
+           "                    (default ./battery_ups_server)\n"
+           "  --root DIR        Directory for the synthetic tree (default a fresh /tmp directory)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[MAX_SIZES] = { 100, 1000, 10000, 50000 };
+    int size_count = 4;
+    int spinners = 64;
+    long iterations = 20000;
+    const char *root = NULL;
+    const char *ups_server = "./battery_ups_server";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            size_count = parse_sizes(argv[++i], sizes);
+        } else if (strcmp(argv[i], "--spinners") == 0 && i + 1 < argc) {
+            spinners = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) {
+            root = argv[++i];
+        } else if (strcmp(argv[i], "--ups-server") == 0 && i + 1 < argc) {
+            ups_server = argv[++i];
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (root != NULL) {
+        snprintf(bench_root, sizeof(bench_root), "%s", root);
+        make_dirs(bench_root);
+    } else {
+        snprintf(bench_root, sizeof(bench_root), "/tmp/battery_bench.XXXXXX");
+        if (mkdtemp(bench_root) == NULL) {
+            perror("Failed to create bench root");
+            return 1;
+        }
+    }
+
+    // Results go to the real stdout, the dry-run chatter of the code under test does not
+    fflush(stdout);
+    json_out = fdopen(dup(STDOUT_FILENO), "w");
+    if (json_out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Failed to redirect output");
+        return 1;
+    }
+
+    // Never send real signals from the synthetic scans
+    dry_run = true;
+    set_root_prefixes(bench_root, bench_root);
+    build_sysfs_tree();
+
+    fprintf(json_out, "{\n  \"root\": \"%s\",\n  \"results\": [", bench_root);
+
+    bench_battery_reads(iterations);
+    bench_ignore_lists(iterations / 10 > 0 ? iterations / 10 : 1);
+    bench_suspend_user_daemons(sizes, size_count);
+    if (spinners > 0) {
+        bench_freeze_thaw(spinners);
+    }
+    int result = bench_nut_client(ups_server) == 0 ? 0 : 1;
+
+    fprintf(json_out, "\n  ]\n}\n");
+    fclose(json_out);
+
+    if (root == NULL) {
+        remove_tree(bench_root);
+    }
+    return result;
+}
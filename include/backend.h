@@ -0,0 +1,52 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <time.h>
+
+// Where battery readings come from
+typedef struct {
+    const char *name;
+    int (*get_battery_level)(void);   // Percentage, -1 on failure
+    int (*is_charging)(void);         // 1 charging, 0 discharging, -1 on failure
+    long (*get_battery_energy)(void); // uWh, -1 if unavailable
+    long (*get_battery_power)(void);  // uW, -1 if unavailable
+    // Connect to the device at address (NULL for the default), -1 on failure
+    int (*open)(const char *address);
+    // Register whatever wakes the monitor when the device changes with the
+    // event loop, -1 on failure. Only the daemon, which runs the loop, calls it.
+    int (*watch)(void);
+} power_source_backend_t;
+
+// How the monitor tells and waits for time
+typedef struct {
+    const char *name;
+    time_t (*now)(void);
+    void (*sleep)(int seconds);
+} clock_backend_t;
+
+// Responses a notification can produce
+typedef enum {
+    NOTIFY_RESPONSE_NONE,    // Dismissed without a choice, e.g. AC came back
+    NOTIFY_RESPONSE_OK,
+    NOTIFY_RESPONSE_SAVING,  // User asked for battery saving mode
+    NOTIFY_RESPONSE_SLEEP    // User asked to suspend
+} notify_response_t;
+
+// How the monitor reaches the user
+typedef struct {
+    const char *name;
+    notify_response_t (*notify)(const char *message, const char *title);
+} notifier_backend_t;
+
+// Backends used by the monitor loop, set up by main() or a simulator
+extern const power_source_backend_t *power_source;
+extern const clock_backend_t *clock_backend;
+extern const notifier_backend_t *notifier;
+
+// Real implementations
+extern const power_source_backend_t sysfs_power_source;
+extern const power_source_backend_t nut_power_source;
+extern const clock_backend_t system_clock;
+extern const notifier_backend_t gtk_notifier;
+
+#endif // BACKEND_H
@@ -1,13 +1,18 @@
 #ifndef BATTERY_MONITOR_H
 #define BATTERY_MONITOR_H
 
-void show_notification(const char *message, const char *title);
+#include "backend.h"
+
+notify_response_t show_notification(const char *message, const char *title);
 int get_battery_level();
 int is_charging();
+long get_battery_energy();
+long get_battery_power();
 int activate_battery_saving_mode();
 int enter_sleep_mode();
 int kill_processes(const char *filename);
 int set_brightness(int brightness);
+int get_brightness();
 void log_message(const char *message);
 
 // New function declaration for process monitoring
@@ -0,0 +1,31 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+// Who asked for the display to be downshifted; it is restored once none does
+#define DISPLAY_HOLDER_SAVING_MODE 0x01
+#define DISPLAY_HOLDER_POLICY      0x02
+
+typedef struct {
+    int refresh_downshift;   // Drop the internal panel to its lowest refresh rate
+    char panel_output[64];   // XRandR output of the panel, empty to look for eDP, LVDS or DSI
+    char compositor[64];     // Process name of the compositor to signal, empty for none
+    int saving_signal;       // Sent to the compositor when downshifting, 0 for none
+    int restore_signal;      // Sent to the compositor when restoring, 0 for none
+} display_config_t;
+
+void display_init(const display_config_t *config);
+
+// Signal number for a name such as "USR1" or "SIGUSR1", -1 if unknown
+int display_parse_signal(const char *name);
+
+// Switch the panel to its lowest refresh rate and signal the compositor,
+// remembering what to restore. A dry run only logs what would change.
+int display_downshift(int holder);
+
+// Undo display_downshift() once the last holder lets go
+int display_restore(int holder);
+
+// `battery_monitor display` subcommand
+int display_command(int argc, char *argv[]);
+
+#endif // DISPLAY_H
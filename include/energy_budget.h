@@ -0,0 +1,31 @@
+#ifndef ENERGY_BUDGET_H
+#define ENERGY_BUDGET_H
+
+#include <time.h>
+#include <sys/types.h>
+
+// Runtime (minutes) to guarantee from every unplug, 0 to disable
+void energy_budget_set_runtime(int minutes);
+
+// Absolute deadline the battery has to last until, 0 to disable
+void energy_budget_set_deadline(time_t deadline);
+
+// Follow deadlines written by `battery_monitor budget` (daemon only)
+void energy_budget_watch_file(int enabled);
+
+// System mode: follow the budget files of these users instead of the daemon's own
+void energy_budget_watch_users(const uid_t *uids, int count);
+
+// Run one controller step; called once per sampling period
+void energy_budget_update(int charging);
+
+// Undo every measure the controller applied
+void energy_budget_release();
+
+// Current escalation stage, 0 when nothing is applied
+int energy_budget_stage();
+
+// `battery_monitor budget MINUTES|off` subcommand
+int budget_command(int argc, char *argv[]);
+
+#endif // ENERGY_BUDGET_H
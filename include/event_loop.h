@@ -0,0 +1,26 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+typedef void (*event_loop_callback)(int fd, void *data);
+
+// Watch a file descriptor for readability while the daemon is waiting
+int event_loop_add_fd(int fd, event_loop_callback callback, void *data);
+void event_loop_remove_fd(int fd);
+
+// Like event_loop_add_fd(), but activity on fd does not count as a daemon
+// wakeup, e.g. the daemon's own metrics being scraped
+int event_loop_add_quiet_fd(int fd, event_loop_callback callback, void *data);
+
+// Wait for the given number of seconds, dispatching fd events meanwhile
+void event_loop_sleep(int seconds);
+
+// Called from a callback: end the current wait so the monitor samples right away
+void event_loop_interrupt(void);
+
+// Netlink socket receiving kernel uevents, -1 on failure. With prefixes
+// such as "change@/devices/virtual/thermal/", a socket filter drops every
+// uevent that starts with none of them in the kernel, so unrelated devices
+// never wake the daemon. No prefixes receives every uevent.
+int event_loop_open_uevents(const char *const prefixes[], int prefix_count);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,45 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+#define HISTORY_MAGIC "BATHIST1"
+#define HISTORY_VERSION 1
+#define HISTORY_DEFAULT_CAPACITY 262144  // ~6 months at one sample per minute, 2.5 MB
+
+#define HISTORY_FLAG_CHARGING 0x01
+#define HISTORY_FLAG_SAVING   0x02
+#define HISTORY_FLAG_UNKNOWN  0x04  // Charging state could not be read
+
+#define HISTORY_UNAVAILABLE 0xFFFF  // Energy or power not reported by the battery
+
+// One packed 10-byte sample
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp;  // Seconds since the epoch
+    uint16_t energy;     // Remaining energy in units of 10 mWh
+    uint16_t power;      // Power draw in units of 10 mW
+    uint8_t level;       // Battery percentage
+    uint8_t flags;       // HISTORY_FLAG_*
+} history_record_t;
+
+// On-disk header, followed by `capacity` records
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t head;   // Index of the next record to write
+    uint32_t count;  // Number of valid records
+    uint32_t reserved[9];
+} history_header_t;
+
+char *get_history_file_path();
+int history_open(const char *path, uint32_t capacity);
+void history_append(int level, long energy_uwh, long power_uw, int charging, int saving);
+void history_close();
+
+// `battery_monitor history ...` subcommand. default_path is the file the
+// daemon would record to, empty for the per-user default.
+int history_command(int argc, char *argv[], const char *default_path);
+
+#endif // HISTORY_H
@@ -0,0 +1,34 @@
+#ifndef HOLDERS_H
+#define HOLDERS_H
+
+// Who asked for processes to be frozen or throttled, or for the screen to
+// be dimmed. Each action is taken for the first holder and only undone
+// once the last holder lets go, so one subsystem's restore never undoes
+// another's action.
+#define HOLDER_SAVING_MODE 0x01
+#define HOLDER_POLICY      0x02
+#define HOLDER_BUDGET      0x04
+#define HOLDER_IDLE        0x08
+#define HOLDER_THERMAL     0x10
+#define HOLDER_USAGE_MODEL 0x20
+#define HOLDER_COUNT       6
+
+// Suspend high CPU processes and user daemons. Every hold scans again, so
+// processes that started since are caught; frozen ones are skipped.
+int hold_freeze(int holder);
+int release_freeze(int holder);
+
+// Renice high CPU processes
+int hold_throttle(int holder);
+int release_throttle(int holder);
+
+// Dim to at most percent. The dimmest holder wins, and the brightness from
+// before the first hold comes back after the last release.
+int hold_brightness(int holder, int percent);
+int release_brightness(int holder);
+
+// Whether anyone holds the action
+int freeze_held();
+int throttle_held();
+
+#endif // HOLDERS_H
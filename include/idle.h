@@ -0,0 +1,24 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+// Seconds of user inactivity before each stage engages, 0 disables a stage
+typedef struct {
+    int dim_seconds;
+    int dim_percent;
+    int throttle_seconds;
+    int freeze_seconds;
+    int suspend_seconds;
+} idle_config_t;
+
+// Arm X server idle alarms and watch the display connection on the event
+// loop. Returns -1 when no display or IDLETIME counter is available.
+int idle_init(const idle_config_t *config);
+
+// Engage the stages whose timeout passed while on AC power, once the
+// charger is unplugged without any input since. Called every sample.
+void idle_update(int charging);
+
+// Undo every idle measure, as if input had just returned
+void idle_restore();
+
+#endif // IDLE_H
@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Latency histograms (all values in seconds)
+typedef enum {
+    METRIC_SAMPLE_LATENCY,      // one sysfs battery read
+    METRIC_PROC_SCAN_DURATION,  // one full /proc walk
+    METRIC_FREEZE_LATENCY,      // SIGSTOP until the process is seen stopped
+    METRIC_THAW_LATENCY,        // SIGCONT until the process is seen running
+    METRIC_SLEEP_TRANSITION,    // entering and leaving sleep, time asleep excluded
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+// Monotonic counters
+typedef enum {
+    METRIC_WAKEUPS,
+    METRIC_LOG_BYTES,
+    METRIC_PROCESSES_SCANNED,
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+// Point-in-time values
+typedef enum {
+    METRIC_SUSPENDED_TASKS,
+    METRIC_LAST_SCAN_PROCESSES,
+    METRIC_TEMPERATURE,
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+double metrics_now();
+void metrics_observe(metric_histogram_t histogram, double seconds);
+void metrics_add(metric_counter_t counter, unsigned long amount);
+void metrics_set(metric_gauge_t gauge, double value);
+
+// Render all metrics in OpenMetrics text format; caller frees the result
+char *metrics_render();
+
+// Start serving metrics on a Unix socket path and/or a loopback TCP port.
+// Either may be disabled by passing NULL/empty or 0.
+int metrics_init(const char *socket_path, int port);
+
+#endif // METRICS_H
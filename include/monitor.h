@@ -0,0 +1,21 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include "backend.h"
+
+// What a single monitor iteration observed
+typedef struct {
+    int level;     // Battery percentage, -1 if it could not be read
+    int charging;  // As returned by is_charging(), -1 leaves the tick without acting
+} battery_sample_t;
+
+// Run one iteration of the threshold, notification and resume logic
+// against the configured backends. Returns the seconds to wait before
+// the next iteration.
+int monitor_tick(battery_sample_t *sample);
+
+// Act on a notification response, including ones that arrive later from
+// a session's notification helper
+void monitor_handle_response(notify_response_t response);
+
+#endif // MONITOR_H
@@ -0,0 +1,17 @@
+#ifndef PATHS_H
+#define PATHS_H
+
+#include <limits.h>
+
+// Prefixes prepended to /sys and /proc paths. Both are empty on a real
+// system; benchmarks point them at a synthetic tree.
+extern char sysfs_root[PATH_MAX];
+extern char procfs_root[PATH_MAX];
+
+void set_root_prefixes(const char *sys_root, const char *proc_root);
+
+// Read BATTERY_MONITOR_SYSFS_ROOT and BATTERY_MONITOR_PROC_ROOT. Only test
+// builds (make TESTING=1) honour them, so a real daemon cannot be misled.
+void load_root_prefixes_from_env();
+
+#endif // PATHS_H
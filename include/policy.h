@@ -0,0 +1,46 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include "backend.h"
+
+#define POLICY_MAX_TIERS 8
+
+// Actions a tier applies while it is engaged
+#define POLICY_ACTION_NOTIFY   0x01  // Show a notification when entering the tier
+#define POLICY_ACTION_THROTTLE 0x02  // Renice high CPU processes
+#define POLICY_ACTION_FREEZE   0x04  // Suspend high CPU processes and user daemons
+#define POLICY_ACTION_DIM      0x08  // Dim the backlight to dim_percent
+#define POLICY_ACTION_EPP      0x10  // Switch the CPU energy performance preference
+#define POLICY_ACTION_SUSPEND  0x20  // Put the machine to sleep when entering the tier
+#define POLICY_ACTION_REFRESH  0x40  // Drop the panel to its lowest refresh rate
+
+typedef struct {
+    char name[32];
+    int threshold;     // Engages at or below this battery level
+    int hysteresis;    // Releases only above threshold + hysteresis
+    unsigned int actions;
+    int dim_percent;
+    char epp[32];
+} policy_tier_t;
+
+// Parse "name:threshold:hysteresis:action,action,..." where an action is
+// notify, throttle, freeze, dim=PERCENT, epp=PROFILE, refresh or suspend
+int policy_add_tier(const char *spec);
+
+// Sort the tiers and build the transition tables. Falls back to the
+// classic low/critical notifications when no tier was configured.
+void policy_compile();
+
+// Feed one battery sample; returns the response of any notification shown
+notify_response_t policy_update(int battery_level);
+
+// Release every tier, e.g. when AC power returns
+void policy_reset();
+
+// Index of the engaged tier, -1 when none is
+int policy_state();
+
+const policy_tier_t *policy_tier(int index);
+int policy_tier_count();
+
+#endif // POLICY_H
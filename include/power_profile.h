@@ -0,0 +1,13 @@
+#ifndef POWER_PROFILE_H
+#define POWER_PROFILE_H
+
+#include <stddef.h>
+
+// Write an energy_performance_preference (e.g. "power", "balance_power")
+// to every CPU that supports it
+int set_epp_profile(const char *profile);
+
+// Read the current preference of the first CPU
+int get_epp_profile(char *buffer, size_t size);
+
+#endif // POWER_PROFILE_H
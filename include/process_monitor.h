@@ -12,10 +12,24 @@ extern int suspended_high_cpu_count;
 
 int run_battery_saving_mode(pid_t current_pid);
 int get_ignore_processes(char *ignore_list[], int max_ignores, const char *config_key);
+int get_user_ignore_processes(uid_t uid, char *ignore_list[], int max_ignores, const char *config_key);
 int is_process_critical(const char *process_name, char *ignore_list[], int ignore_count);
 
 int suspend_user_daemons();
 int resume_user_daemons();
 int resume_high_cpu_processes();
+int throttle_high_cpu_processes(pid_t current_pid);
+int unthrottle_processes();
+
+// System mode: manage the processes of these users, each with their own
+// ignore lists. Until this is called only the current user is managed;
+// afterwards an empty list manages nobody.
+void set_managed_users(const uid_t *uids, int count);
+
+#ifdef BATTERY_MONITOR_TESTING
+// Only act on children of this process, so tests can drive the real
+// suspend and resume paths without touching anything else (0 to stop)
+void set_test_scope(pid_t parent);
+#endif
 
 #endif // PROCESS_MONITOR_H
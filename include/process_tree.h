@@ -0,0 +1,53 @@
+#ifndef PROCESS_TREE_H
+#define PROCESS_TREE_H
+
+#include <sys/types.h>
+
+// One process from /proc, linked to its parent and children by index
+typedef struct {
+    pid_t pid;
+    pid_t ppid;
+    pid_t pgrp;
+    pid_t session;
+    unsigned int tty_nr;
+    uid_t uid;
+    char state;
+    char comm[64];
+    int parent;        // Index of the parent, -1 when it is not in the table
+    int first_child;
+    int next_sibling;
+    int keep;          // Must keep running
+    int frozen;        // Stopped during this scan
+} process_node_t;
+
+typedef struct {
+    process_node_t *nodes;
+    int count;
+    int capacity;
+    int *buckets;      // pid -> index, open addressing
+    int bucket_count;
+} process_tree_t;
+
+// Snapshot every process under /proc and link parents and children
+int process_tree_scan(process_tree_t *tree);
+void process_tree_free(process_tree_t *tree);
+
+// Index of a pid, -1 when it is not in the snapshot
+int process_tree_find(const process_tree_t *tree, pid_t pid);
+
+// Spread the keep flags set by the caller until they are consistent: a
+// kept process keeps its ancestors running, and a kept member of a
+// terminal job keeps the whole process group running.
+void process_tree_protect(process_tree_t *tree);
+
+// Pids of a process and its descendants, leaves before their parents,
+// skipping processes that are already stopped. Returns how many were stored.
+int process_tree_collect(process_tree_t *tree, int index, pid_t *pids, int max);
+
+// Like process_tree_collect(), for every member of a terminal job
+int process_tree_collect_group(process_tree_t *tree, pid_t pgrp, pid_t *pids, int max);
+
+// Whether a process belongs to a job of an interactive shell
+int process_tree_is_job(const process_node_t *node);
+
+#endif // PROCESS_TREE_H
@@ -0,0 +1,21 @@
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "backend.h"
+
+// Read the logind session list and keep following it on the event loop.
+// Every user with a session becomes a managed user of process_monitor.
+int sessions_init();
+
+// Unix socket the per-user notification helper listens on
+void get_notify_socket_path(uid_t uid, char *buffer, size_t size);
+
+// Notifier that forwards alerts to the helper of every active graphical session
+extern const notifier_backend_t session_notifier;
+
+// `battery_monitor notify-helper`, run inside each user's graphical session
+int notify_helper_command(int argc, char *argv[]);
+
+#endif // SESSIONS_H
@@ -0,0 +1,30 @@
+#ifndef SLEEP_H
+#define SLEEP_H
+
+typedef enum {
+    SLEEP_SUSPEND,    // Suspend to RAM
+    SLEEP_HYBRID,     // Write a hibernation image, then suspend to RAM
+    SLEEP_HIBERNATE,  // Suspend to disk
+    SLEEP_MODE_COUNT
+} sleep_mode_t;
+
+// Hours RAM sleep has to last before hybrid sleep or hibernation is used
+void sleep_set_horizon(double hours);
+
+// Always use one sleep state, or -1 to choose from the remaining energy
+void sleep_set_mode(int mode);
+
+// "auto" gives -1, "suspend", "hybrid-sleep" and "hibernate" their mode, -2 if unknown
+int sleep_parse_mode(const char *name);
+
+// Sleep state for the hours RAM sleep would last, -1 if that is unknown
+sleep_mode_t sleep_choose_mode(double hours);
+
+// Feed one battery sample, energy in uWh or -1. Notices when the machine
+// slept, whoever put it to sleep, and learns how fast RAM sleep drains the
+// battery. After
+// enter_sleep_mode() the next sample is ignored, since it may have been
+// taken before the sleep; the level read on resume is used instead.
+void sleep_update(int level, long energy, int charging);
+
+#endif // SLEEP_H
@@ -0,0 +1,15 @@
+#ifndef THERMAL_H
+#define THERMAL_H
+
+// Discover thermal zones and cooling devices, keep their attribute files
+// open and listen for kernel thermal uevents on the event loop.
+// hot_celsius is the temperature above which the machine counts as hot.
+int thermal_init(int hot_celsius);
+
+// Sample every zone and throttle the top CPU consumers while the machine is
+// on battery and hot. If a zone stays past its passive trip point anyway,
+// freeze them as battery saving mode does. Undo both once it cools down or
+// is plugged in.
+void thermal_update(int charging);
+
+#endif // THERMAL_H
@@ -0,0 +1,44 @@
+#ifndef USAGE_MODEL_H
+#define USAGE_MODEL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define USAGE_MODEL_MAGIC "BATUSE01"
+#define USAGE_MODEL_VERSION 1
+#define USAGE_MODEL_SLOTS (7 * 24)  // One slot per weekday and hour
+
+// What the model learned about one hour of the week, as decayed sums
+typedef struct {
+    float drain;          // Battery percent lost while discharging
+    float battery_hours;  // Hours spent on battery
+    float plug_ins;       // Times a charger was connected
+    float charger_hours;  // Hours spent on a charger
+} usage_slot_t;
+
+// On-disk layout, a few KB
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    usage_slot_t slots[USAGE_MODEL_SLOTS];
+} usage_model_t;
+
+// Build the model path under $XDG_DATA_HOME or ~/.local/share; caller frees the result
+char *get_usage_model_path();
+
+// Map the model file, creating it if needed. A NULL path keeps the model in memory.
+int usage_model_open(const char *path);
+void usage_model_close();
+
+#define USAGE_MODEL_STAGES 4  // Pre-emptive saving stages, see usage_model_update()
+
+// Learn from one sample, O(1). Returns 0 while the model expects the battery
+// to last until the usual charge time, otherwise a stage from 1 to
+// USAGE_MODEL_STAGES that grows with the predicted shortfall.
+int usage_model_update(time_t now, int level, int charging);
+
+// `battery_monitor model` subcommand
+int usage_model_command(int argc, char *argv[]);
+
+#endif // USAGE_MODEL_H
@@ -0,0 +1,28 @@
+#ifndef WAKEUPS_H
+#define WAKEUPS_H
+
+#include <sys/types.h>
+
+// Sample interrupts, wakeup sources, C-state residency and context
+// switches at most every interval_seconds while on battery (0 disables),
+// and rank the processes that wake the CPU most. Processes waking more
+// than victim_rate times per second are treated like CPU hogs (0 disables).
+void wakeups_init(int interval_seconds, int victim_rate);
+
+// Call once per battery sample
+void wakeups_update(int charging);
+
+// Wakeups per second of a process over the last interval, 0 when unknown.
+// comm must match the name it had then, so a reused pid starts from 0.
+double wakeups_process_rate(pid_t pid, const char *comm);
+
+// Whether a process wakes up often enough to be suspended in saving mode.
+// Rates older than half a minute are re-sampled first. Only processes are
+// judged: interrupts and wakeup sources are ranked and logged but cannot be
+// tied to one.
+int wakeups_is_victim(pid_t pid, const char *comm);
+
+// `battery_monitor wakeups` subcommand
+int wakeups_command(int argc, char *argv[]);
+
+#endif // WAKEUPS_H
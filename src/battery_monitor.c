@@ -6,14 +6,65 @@
 #include "battery_monitor.h"
 #include "process_monitor.h"
 #include "version.h"
+#include "metrics.h"
+#include "event_loop.h"
+#include "history.h"
+#include "monitor.h"
+#include "backend.h"
+#include "paths.h"
+#include "policy.h"
+#include "energy_budget.h"
+#include "idle.h"
+#include "sessions.h"
+#include "usage_model.h"
+#include "thermal.h"
+#include "sleep.h"
+#include "display.h"
+#include "wakeups.h"
 #include <ctype.h>  
 #include <string.h>  
 #include <limits.h>
 
-// Global Variables for Thresholds
-int THRESHOLD_LOW = 15;       // Default values
-int THRESHOLD_CRITICAL = 5;
-int THRESHOLD_HIGH = 70;
+#define SYSTEM_CONFIG_FILE "/etc/battery_monitor/config.conf"
+#define SYSTEM_HISTORY_FILE "/var/lib/battery_monitor/history.bin"
+#define SYSTEM_USAGE_MODEL_FILE "/var/lib/battery_monitor/usage_model.bin"
+
+// Config file, defaults to ~/.config/battery_monitor/config.conf
+char CONFIG_FILE_PATH[PATH_MAX] = "";
+
+// Metrics endpoint, disabled unless configured
+char METRICS_SOCKET[PATH_MAX] = "";
+int METRICS_PORT = 0;
+
+// Battery history ring, defaults to ~/.local/share/battery_monitor/history.bin
+char HISTORY_FILE_PATH[PATH_MAX] = "";
+int HISTORY_CAPACITY = HISTORY_DEFAULT_CAPACITY;
+int HISTORY_ENABLED = 1;
+
+// Learned usage pattern, defaults to ~/.local/share/battery_monitor/usage_model.bin
+char USAGE_MODEL_PATH[PATH_MAX] = "";
+int USAGE_LEARNING = 1;
+
+// Temperature (Celsius) above which the machine counts as hot, 0 disables thermal throttling
+int THERMAL_HOT = 75;
+
+// Display stage of saving mode; the compositor is only signalled when configured
+display_config_t DISPLAY_CONFIG = { 1, "", "", 0, 0 };
+
+// Where readings come from: "sysfs" for a battery or UPS under /sys/class/power_supply,
+// "nut" for a UPS behind a NUT server. Empty addresses pick the default device.
+char POWER_SOURCE[16] = "sysfs";
+char POWER_SUPPLY[64] = "";
+char NUT_SERVER[256] = "";
+
+// Seconds between wakeup samples on battery, and wakeups per second that make
+// a process a saving mode victim regardless of its CPU usage; 0 disables
+// either. Browsers and media players pass any fixed rate, so victims are opt-in.
+int WAKEUP_INTERVAL = 300;
+int WAKEUP_VICTIM_RATE = 0;
+
+// Idle stages in seconds of inactivity, all disabled by default
+idle_config_t IDLE_CONFIG = { 0, 30, 0, 0, 0 };
 
 // Function to trim leading and trailing whitespace
 static char *trim_whitespace(char *str) {
@@ -35,14 +86,18 @@ static char *trim_whitespace(char *str) {
 }
 
 void load_thresholds_from_config() {
-    char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        log_message("Failed to get HOME environment variable");
-        return;
-    }
-
     char config_file_path[PATH_MAX];
-    snprintf(config_file_path, sizeof(config_file_path), "%s/.config/battery_monitor/config.config", home_dir);
+
+    if (CONFIG_FILE_PATH[0] != '\0') {
+        snprintf(config_file_path, sizeof(config_file_path), "%s", CONFIG_FILE_PATH);
+    } else {
+        char *home_dir = getenv("HOME");
+        if (home_dir == NULL) {
+            log_message("Failed to get HOME environment variable");
+            return;
+        }
+        snprintf(config_file_path, sizeof(config_file_path), "%s/.config/battery_monitor/config.conf", home_dir);
+    }
 
     FILE *config_file = fopen(config_file_path, "r");
     if (config_file == NULL) {
@@ -61,15 +116,73 @@ void load_thresholds_from_config() {
         }
 
         char key[64];
-        char value[64];
+        char value[256];
 
-        if (sscanf(line, "%63[^=]=%63s", key, value) == 2) {
+        if (sscanf(line, "%63[^=]=%255s", key, value) == 2) {
             if (strcmp(key, "threshold_low") == 0) {
                 THRESHOLD_LOW = atoi(value);
             } else if (strcmp(key, "threshold_critical") == 0) {
                 THRESHOLD_CRITICAL = atoi(value);
             } else if (strcmp(key, "threshold_high") == 0) {
                 THRESHOLD_HIGH = atoi(value);
+            } else if (strcmp(key, "metrics_socket") == 0) {
+                snprintf(METRICS_SOCKET, sizeof(METRICS_SOCKET), "%s", value);
+            } else if (strcmp(key, "metrics_port") == 0) {
+                METRICS_PORT = atoi(value);
+            } else if (strcmp(key, "history_file") == 0) {
+                snprintf(HISTORY_FILE_PATH, sizeof(HISTORY_FILE_PATH), "%s", value);
+            } else if (strcmp(key, "history_capacity") == 0) {
+                HISTORY_CAPACITY = atoi(value);
+            } else if (strcmp(key, "history_enabled") == 0) {
+                HISTORY_ENABLED = atoi(value);
+            } else if (strcmp(key, "tier") == 0) {
+                policy_add_tier(value);
+            } else if (strcmp(key, "target_runtime") == 0) {
+                energy_budget_set_runtime(atoi(value));
+            } else if (strcmp(key, "usage_model_file") == 0) {
+                snprintf(USAGE_MODEL_PATH, sizeof(USAGE_MODEL_PATH), "%s", value);
+            } else if (strcmp(key, "usage_learning") == 0) {
+                USAGE_LEARNING = atoi(value);
+            } else if (strcmp(key, "thermal_hot") == 0) {
+                THERMAL_HOT = atoi(value);
+            } else if (strcmp(key, "sleep_mode") == 0) {
+                int mode = sleep_parse_mode(value);
+                if (mode == -2) {
+                    log_message("Unknown sleep_mode, choosing automatically");
+                }
+                sleep_set_mode(mode);
+            } else if (strcmp(key, "sleep_horizon") == 0) {
+                sleep_set_horizon(atof(value));
+            } else if (strcmp(key, "refresh_downshift") == 0) {
+                DISPLAY_CONFIG.refresh_downshift = atoi(value);
+            } else if (strcmp(key, "panel_output") == 0) {
+                snprintf(DISPLAY_CONFIG.panel_output, sizeof(DISPLAY_CONFIG.panel_output), "%s", value);
+            } else if (strcmp(key, "compositor") == 0) {
+                snprintf(DISPLAY_CONFIG.compositor, sizeof(DISPLAY_CONFIG.compositor), "%s", value);
+            } else if (strcmp(key, "compositor_saving_signal") == 0) {
+                DISPLAY_CONFIG.saving_signal = display_parse_signal(value);
+            } else if (strcmp(key, "compositor_restore_signal") == 0) {
+                DISPLAY_CONFIG.restore_signal = display_parse_signal(value);
+            } else if (strcmp(key, "power_source") == 0) {
+                snprintf(POWER_SOURCE, sizeof(POWER_SOURCE), "%s", value);
+            } else if (strcmp(key, "power_supply") == 0) {
+                snprintf(POWER_SUPPLY, sizeof(POWER_SUPPLY), "%s", value);
+            } else if (strcmp(key, "nut_server") == 0) {
+                snprintf(NUT_SERVER, sizeof(NUT_SERVER), "%s", value);
+            } else if (strcmp(key, "wakeup_interval") == 0) {
+                WAKEUP_INTERVAL = atoi(value);
+            } else if (strcmp(key, "wakeup_victim_rate") == 0) {
+                WAKEUP_VICTIM_RATE = atoi(value);
+            } else if (strcmp(key, "idle_dim") == 0) {
+                IDLE_CONFIG.dim_seconds = atoi(value);
+            } else if (strcmp(key, "idle_dim_percent") == 0) {
+                IDLE_CONFIG.dim_percent = atoi(value);
+            } else if (strcmp(key, "idle_throttle") == 0) {
+                IDLE_CONFIG.throttle_seconds = atoi(value);
+            } else if (strcmp(key, "idle_freeze") == 0) {
+                IDLE_CONFIG.freeze_seconds = atoi(value);
+            } else if (strcmp(key, "idle_suspend") == 0) {
+                IDLE_CONFIG.suspend_seconds = atoi(value);
             }
         }
     }
@@ -83,86 +196,156 @@ void load_thresholds_from_config() {
     log_message(message);
 }
 
-// Track if notifications have been sent
-int notified_low = 0;
-int notified_critical = 0;
-int battery_saving_mode_active = 0;  // 0: inactive, 1: active
+// Config, history and usage model of the system-wide daemon
+static void use_system_paths() {
+    snprintf(CONFIG_FILE_PATH, sizeof(CONFIG_FILE_PATH), "%s", SYSTEM_CONFIG_FILE);
+    snprintf(HISTORY_FILE_PATH, sizeof(HISTORY_FILE_PATH), "%s", SYSTEM_HISTORY_FILE);
+    snprintf(USAGE_MODEL_PATH, sizeof(USAGE_MODEL_PATH), "%s", SYSTEM_USAGE_MODEL_FILE);
+}
 
-int main(int argc, char *argv[]) {
-    if (argc > 1 && strcmp(argv[1], "--version") == 0) {
-        printf("Battery Monitor version %s\n", VERSION);
-        return 0;
+// Open the history ring configured in the config file
+static void open_history() {
+    if (!HISTORY_ENABLED || HISTORY_CAPACITY <= 0) {
+        return;
     }
-    log_message("Battery monitor started");
 
-    load_thresholds_from_config();
+    if (HISTORY_FILE_PATH[0] != '\0') {
+        history_open(HISTORY_FILE_PATH, HISTORY_CAPACITY);
+        return;
+    }
 
-    while (1) {
-        if (is_charging()) {
-            // Reset notifications if the battery is charging
-            log_message("Battery is charging, notifications reset");
-            notified_low = 0;
-            notified_critical = 0;
-
-            if (battery_saving_mode_active) {
-                // Resume suspended processes
-                log_message("Battery is charging, resuming suspended processes");
-                resume_high_cpu_processes();
-                resume_user_daemons();
-                battery_saving_mode_active = 0;
-            }
+    char *path = get_history_file_path();
+    if (path != NULL) {
+        history_open(path, HISTORY_CAPACITY);
+        free(path);
+    }
+}
 
-            sleep(300); // Sleep for 5 minutes while charging
-            continue;
-        }
+// Open the learned usage model unless learning was switched off
+static void open_usage_model() {
+    if (!USAGE_LEARNING) {
+        return;
+    }
 
-        int battery_level = get_battery_level();
-        if (battery_level == -1) {
-            log_message("Battery level read failed, retrying in 1 minute");
-            sleep(60);
-            continue;
-        }
+    if (USAGE_MODEL_PATH[0] != '\0') {
+        usage_model_open(USAGE_MODEL_PATH);
+        return;
+    }
 
-        // Dynamic sleep interval based on battery level
-        int sleep_duration = 60; // Default 1 minute
+    char *path = get_usage_model_path();
+    if (path != NULL) {
+        usage_model_open(path);
+        free(path);
+    }
+}
 
-        if (battery_level > THRESHOLD_HIGH) {
-            sleep_duration = 300; // Sleep for 5 minutes
-        } else if (battery_level <= THRESHOLD_CRITICAL) {
-            sleep_duration = 30; // Sleep for 30 seconds when critically low
-        } else if (battery_level <= THRESHOLD_LOW) {
-            sleep_duration = 60; // Sleep for 1 minute when low
+// Watching is left to the daemon; a notify helper never runs the event loop
+static void open_power_source(int watch) {
+    const char *address = POWER_SUPPLY;
+    if (strcmp(POWER_SOURCE, "nut") == 0) {
+        power_source = &nut_power_source;
+        address = NUT_SERVER;
+    } else {
+        if (strcmp(POWER_SOURCE, "sysfs") != 0) {
+            log_message("Unknown power_source, using sysfs");
         }
+        power_source = &sysfs_power_source;
+    }
 
-        // Check if battery-saving mode is active and battery level has surpassed THRESHOLD_LOW
-        if (battery_saving_mode_active && battery_level > THRESHOLD_LOW) {
-            log_message("Battery level above threshold, resuming suspended processes");
-            resume_high_cpu_processes();
-            resume_user_daemons();
-            battery_saving_mode_active = 0;
-        }
+    power_source->open(address);
+    if (watch) {
+        power_source->watch();
+    }
+}
 
-        // Check if the battery level is below the critical threshold
-        if (battery_level <= THRESHOLD_CRITICAL && !notified_critical) {
-            log_message("Battery critically low, showing notification");
-            show_notification("Battery is critically low, below 5%", "Critical Battery Warning");
-            notified_critical = 1;
-        } else if (battery_level <= THRESHOLD_LOW && !notified_low) {
-            log_message("Battery low, showing notification");
-            show_notification("Battery is low, below 15%", "Low Battery Warning");
-            notified_low = 1;
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--version") == 0) {
+        printf("Battery Monitor version %s\n", VERSION);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "history") == 0) {
+        // Read the file the daemon records to, the system one with --system
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--system") == 0) {
+                use_system_paths();
+            }
         }
+        load_thresholds_from_config();
+        return history_command(argc - 1, argv + 1, HISTORY_FILE_PATH);
+    }
+    if (argc > 1 && strcmp(argv[1], "budget") == 0) {
+        return budget_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "model") == 0) {
+        return usage_model_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "display") == 0) {
+        load_thresholds_from_config();
+        display_init(&DISPLAY_CONFIG);
+        return display_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "wakeups") == 0) {
+        load_root_prefixes_from_env();
+        return wakeups_command(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "notify-helper") == 0) {
+        // Helpers serve the system daemon, so they read the same power source
+        snprintf(CONFIG_FILE_PATH, sizeof(CONFIG_FILE_PATH), "%s", SYSTEM_CONFIG_FILE);
+        load_thresholds_from_config();
+        open_power_source(0);
+        return notify_helper_command(argc - 1, argv + 1);
+    }
 
-        // Reset notifications if battery level goes back up
-        if (battery_level > THRESHOLD_LOW) {
-            notified_low = 0;
-        }
-        if (battery_level > THRESHOLD_CRITICAL) {
-            notified_critical = 0;
+    // One daemon for every logind session on the machine
+    int system_mode = argc > 1 && strcmp(argv[1], "--system") == 0;
+    if (system_mode) {
+        use_system_paths();
+    }
+    log_message(system_mode ? "Battery monitor started in system mode" : "Battery monitor started");
+
+    load_root_prefixes_from_env();
+    load_thresholds_from_config();
+    metrics_init(METRICS_SOCKET, METRICS_PORT);
+    open_history();
+    open_usage_model();
+    policy_compile();
+    energy_budget_watch_file(1);
+    display_init(&DISPLAY_CONFIG);
+    wakeups_init(WAKEUP_INTERVAL, WAKEUP_VICTIM_RATE);
+
+    open_power_source(1);
+    clock_backend = &system_clock;
+    notifier = &gtk_notifier;
+
+    if (THERMAL_HOT > 0) {
+        thermal_init(THERMAL_HOT);
+    }
+
+    if (system_mode) {
+        // Alerts go to each session's helper; idle detection stays per session
+        sessions_init();
+        notifier = &session_notifier;
+    } else {
+        // Idle alarms need the power source to tell battery from AC
+        idle_init(&IDLE_CONFIG);
+    }
+
+    while (1) {
+        battery_sample_t sample;
+        int sleep_duration = monitor_tick(&sample);
+        thermal_update(sample.charging);
+        idle_update(sample.charging);
+        long energy = power_source->get_battery_energy();
+        sleep_update(sample.level, energy, sample.charging);
+        wakeups_update(sample.charging);
+
+        if (sample.level != -1) {
+            history_append(sample.level, energy, power_source->get_battery_power(),
+                           sample.charging, battery_saving_mode_active);
         }
 
         // Wait for the dynamically determined duration before checking again
-        sleep(sleep_duration);
+        clock_backend->sleep(sleep_duration);
     }
 
     return 0;
@@ -0,0 +1,425 @@
+// display.c
+//
+// Display stage of battery saving. On high refresh laptop panels the
+// refresh rate costs more than a brightness step, so the internal panel is
+// switched through XRandR to the lowest rate it offers at its current
+// resolution, and the compositor can be signalled to drop vsync-heavy
+// effects. The original mode is remembered and put back once nobody holds
+// the downshift any more, unless the user changed the mode in between.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+#include "display.h"
+#include "process_monitor.h"
+#include "log_message.h"
+#include "paths.h"
+
+// Output name prefixes of built-in panels
+static const char *panel_prefixes[] = { "eDP", "LVDS", "DSI", NULL };
+
+typedef struct {
+    Display *display;
+    XRRScreenResources *resources;
+    XRROutputInfo *output;
+    XRRCrtcInfo *crtc;
+    RROutput output_id;
+    RRCrtc crtc_id;
+} panel_t;
+
+static display_config_t config = { 1, "", "", 0, 0 };
+static int holders = 0;
+static int lone_output_is_panel = 0;  // Only for `display --test` on Xvfb or Xephyr
+
+// What display_downshift() changed
+static int refresh_changed = 0;
+static char saved_output[64] = "";
+static RRMode saved_mode = None;
+static RRMode applied_mode = None;
+
+static int x_error = 0;
+
+static int ignore_x_error(Display *display, XErrorEvent *event) {
+    (void)display;
+    (void)event;
+    x_error = 1;
+    return 0;
+}
+
+void display_init(const display_config_t *new_config) {
+    config = *new_config;
+}
+
+int display_parse_signal(const char *name) {
+    static const struct { const char *name; int number; } signals[] = {
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "HUP", SIGHUP }, { NULL, 0 }
+    };
+
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int i = 0; signals[i].name != NULL; i++) {
+        if (strcmp(name, signals[i].name) == 0) {
+            return signals[i].number;
+        }
+    }
+    return -1;
+}
+
+static const XRRModeInfo *find_mode(const XRRScreenResources *resources, RRMode id) {
+    for (int i = 0; i < resources->nmode; i++) {
+        if (resources->modes[i].id == id) {
+            return &resources->modes[i];
+        }
+    }
+    return NULL;
+}
+
+static double refresh_rate(const XRRModeInfo *mode) {
+    if (mode->hTotal == 0 || mode->vTotal == 0) {
+        return 0;
+    }
+    double rate = (double)mode->dotClock / ((double)mode->hTotal * mode->vTotal);
+    if (mode->modeFlags & RR_DoubleScan) {
+        rate /= 2;
+    }
+    if (mode->modeFlags & RR_Interlace) {
+        rate *= 2;
+    }
+    return rate;
+}
+
+static int is_panel_name(const char *name) {
+    for (int i = 0; panel_prefixes[i] != NULL; i++) {
+        if (strncmp(name, panel_prefixes[i], strlen(panel_prefixes[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void close_panel(panel_t *panel) {
+    if (panel->crtc != NULL) XRRFreeCrtcInfo(panel->crtc);
+    if (panel->output != NULL) XRRFreeOutputInfo(panel->output);
+    if (panel->resources != NULL) XRRFreeScreenResources(panel->resources);
+    if (panel->display != NULL) XCloseDisplay(panel->display);
+    memset(panel, 0, sizeof(*panel));
+}
+
+// Find the output by name, or the built-in panel. Under `display --test`
+// a lone lit output, as on Xvfb or Xephyr, counts as the panel; otherwise
+// an external monitor could be downshifted.
+static int open_panel(panel_t *panel, const char *name) {
+    memset(panel, 0, sizeof(*panel));
+
+    panel->display = XOpenDisplay(NULL);
+    if (panel->display == NULL) {
+        return -1;
+    }
+
+    int event_base, error_base, major, minor;
+    if (!XRRQueryExtension(panel->display, &event_base, &error_base) ||
+        !XRRQueryVersion(panel->display, &major, &minor) || (major == 1 && minor < 2)) {
+        log_message("X server lacks RandR 1.2, refresh rate left alone");
+        close_panel(panel);
+        return -1;
+    }
+
+    panel->resources = XRRGetScreenResourcesCurrent(panel->display, DefaultRootWindow(panel->display));
+    if (panel->resources == NULL) {
+        close_panel(panel);
+        return -1;
+    }
+
+    int lit = 0;
+    RROutput lone = None;
+    for (int i = 0; i < panel->resources->noutput; i++) {
+        XRROutputInfo *output = XRRGetOutputInfo(panel->display, panel->resources, panel->resources->outputs[i]);
+        if (output == NULL) {
+            continue;
+        }
+        int active = output->connection == RR_Connected && output->crtc != None;
+        int match = name != NULL ? strcmp(output->name, name) == 0 : is_panel_name(output->name);
+        if (active) {
+            lit++;
+            lone = panel->resources->outputs[i];
+        }
+        if (active && match) {
+            panel->output = output;
+            panel->output_id = panel->resources->outputs[i];
+            break;
+        }
+        XRRFreeOutputInfo(output);
+    }
+
+    if (panel->output == NULL && name == NULL && lone_output_is_panel && lit == 1) {
+        panel->output = XRRGetOutputInfo(panel->display, panel->resources, lone);
+        panel->output_id = lone;
+    }
+    if (panel->output == NULL) {
+        close_panel(panel);
+        return -1;
+    }
+
+    panel->crtc_id = panel->output->crtc;
+    panel->crtc = XRRGetCrtcInfo(panel->display, panel->resources, panel->crtc_id);
+    if (panel->crtc == NULL || panel->crtc->mode == None) {
+        close_panel(panel);
+        return -1;
+    }
+    return 0;
+}
+
+// Lowest refresh mode of the panel at its current resolution
+static const XRRModeInfo *lowest_refresh_mode(const panel_t *panel) {
+    const XRRModeInfo *current = find_mode(panel->resources, panel->crtc->mode);
+    if (current == NULL) {
+        return NULL;
+    }
+
+    const XRRModeInfo *lowest = current;
+    for (int i = 0; i < panel->output->nmode; i++) {
+        const XRRModeInfo *mode = find_mode(panel->resources, panel->output->modes[i]);
+        if (mode == NULL || mode->width != current->width || mode->height != current->height ||
+            (mode->modeFlags & RR_Interlace) != (current->modeFlags & RR_Interlace)) {
+            continue;
+        }
+        double rate = refresh_rate(mode);
+        if (rate > 0 && rate < refresh_rate(lowest)) {
+            lowest = mode;
+        }
+    }
+    return lowest;
+}
+
+static int set_panel_mode(panel_t *panel, RRMode mode) {
+    x_error = 0;
+    int (*previous)(Display *, XErrorEvent *) = XSetErrorHandler(ignore_x_error);
+    Status status = XRRSetCrtcConfig(panel->display, panel->resources, panel->crtc_id, CurrentTime,
+                                     panel->crtc->x, panel->crtc->y, mode, panel->crtc->rotation,
+                                     panel->crtc->outputs, panel->crtc->noutput);
+    XSync(panel->display, False);
+    XSetErrorHandler(previous);
+    return status == RRSetConfigSuccess && !x_error ? 0 : -1;
+}
+
+static int downshift_refresh() {
+    panel_t panel;
+    if (open_panel(&panel, config.panel_output[0] != '\0' ? config.panel_output : NULL) == -1) {
+        log_message("No built-in panel found, refresh rate left alone");
+        return -1;
+    }
+
+    char message[256];
+    const XRRModeInfo *current = find_mode(panel.resources, panel.crtc->mode);
+    const XRRModeInfo *lowest = lowest_refresh_mode(&panel);
+    if (current == NULL || lowest == NULL || lowest->id == current->id) {
+        snprintf(message, sizeof(message), "Panel %s already runs at its lowest refresh rate", panel.output->name);
+        log_message(message);
+        close_panel(&panel);
+        return 0;
+    }
+
+    if (dry_run) {
+        snprintf(message, sizeof(message), "Dry run: would switch panel %s from %.2f Hz to %.2f Hz",
+                 panel.output->name, refresh_rate(current), refresh_rate(lowest));
+        log_message(message);
+        close_panel(&panel);
+        return 0;
+    }
+
+    if (set_panel_mode(&panel, lowest->id) == -1) {
+        snprintf(message, sizeof(message), "Failed to switch panel %s to %.2f Hz", panel.output->name, refresh_rate(lowest));
+        log_message(message);
+        close_panel(&panel);
+        return -1;
+    }
+
+    snprintf(saved_output, sizeof(saved_output), "%s", panel.output->name);
+    saved_mode = current->id;
+    applied_mode = lowest->id;
+    refresh_changed = 1;
+
+    snprintf(message, sizeof(message), "Panel %s refresh %.2f Hz -> %.2f Hz", panel.output->name,
+             refresh_rate(current), refresh_rate(lowest));
+    log_message(message);
+    close_panel(&panel);
+    return 0;
+}
+
+static int restore_refresh() {
+    if (!refresh_changed) {
+        return 0;
+    }
+    refresh_changed = 0;
+
+    panel_t panel;
+    if (open_panel(&panel, saved_output) == -1) {
+        log_message("Panel is gone, refresh rate not restored");
+        return -1;
+    }
+
+    char message[256];
+    int result = 0;
+    if (panel.crtc->mode != applied_mode) {
+        snprintf(message, sizeof(message), "Panel %s mode was changed meanwhile, leaving it", saved_output);
+    } else if (set_panel_mode(&panel, saved_mode) == -1) {
+        snprintf(message, sizeof(message), "Failed to restore the refresh rate of panel %s", saved_output);
+        result = -1;
+    } else {
+        const XRRModeInfo *mode = find_mode(panel.resources, saved_mode);
+        snprintf(message, sizeof(message), "Panel %s refresh restored to %.2f Hz", saved_output,
+                 mode != NULL ? refresh_rate(mode) : 0);
+    }
+    log_message(message);
+    close_panel(&panel);
+    return result;
+}
+
+// Send a signal to every compositor process of ours
+static void signal_compositor(int sig) {
+    char path[PATH_MAX];
+    char message[128];
+
+    if (dry_run) {
+        snprintf(message, sizeof(message), "Dry run: would send signal %d to %s", sig, config.compositor);
+        log_message(message);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/proc", procfs_root);
+
+    DIR *proc_dir = opendir(path);
+    if (proc_dir == NULL) {
+        return;
+    }
+
+    int signalled = 0;
+    struct dirent *entry;
+    while ((entry = readdir(proc_dir)) != NULL) {
+        if (!isdigit((unsigned char)entry->d_name[0])) {
+            continue;
+        }
+
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/proc/%s", procfs_root, entry->d_name);
+        if (stat(path, &st) == -1 || (getuid() != 0 && st.st_uid != getuid())) {
+            continue;
+        }
+
+        char comm[64] = "";
+        snprintf(path, sizeof(path), "%s/proc/%s/comm", procfs_root, entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        if (fgets(comm, sizeof(comm), file) != NULL) {
+            comm[strcspn(comm, "\n")] = '\0';
+        }
+        fclose(file);
+
+        // comm holds at most 15 characters of the name
+        if (comm[0] != '\0' && strncmp(comm, config.compositor, 15) == 0 && kill(atoi(entry->d_name), sig) == 0) {
+            signalled++;
+        }
+    }
+    closedir(proc_dir);
+
+    snprintf(message, sizeof(message), "Sent signal %d to %d %s process(es)", sig, signalled, config.compositor);
+    log_message(message);
+}
+
+int display_downshift(int holder) {
+    int was_held = holders != 0;
+    holders |= holder;
+    if (was_held) {
+        return 0;
+    }
+
+    int result = 0;
+    if (config.refresh_downshift) {
+        result = downshift_refresh();
+    }
+    if (config.compositor[0] != '\0' && config.saving_signal > 0) {
+        signal_compositor(config.saving_signal);
+    }
+    return result;
+}
+
+int display_restore(int holder) {
+    if (!(holders & holder)) {
+        return 0;
+    }
+    holders &= ~holder;
+    if (holders != 0) {
+        return 0;
+    }
+
+    int result = restore_refresh();
+    if (config.compositor[0] != '\0' && config.restore_signal > 0) {
+        signal_compositor(config.restore_signal);
+    }
+    return result;
+}
+
+int display_command(int argc, char *argv[]) {
+    int test_seconds = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--test") == 0 && i + 1 < argc) {
+            test_seconds = atoi(argv[++i]);
+        } else {
+            printf("Usage: battery_monitor display [--test SECONDS]\n"
+                   "  Show the panel and the refresh rate saving mode would switch it to.\n"
+                   "  --test downshifts for SECONDS and restores, e.g. against Xvfb or Xephyr.\n");
+            return 1;
+        }
+    }
+
+    // A headless test server has no built-in panel, only one output
+    lone_output_is_panel = test_seconds > 0;
+
+    panel_t panel;
+    if (open_panel(&panel, config.panel_output[0] != '\0' ? config.panel_output : NULL) == -1) {
+        fprintf(stderr, "No X display or no built-in panel found\n");
+        return 1;
+    }
+
+    const XRRModeInfo *current = find_mode(panel.resources, panel.crtc->mode);
+    const XRRModeInfo *lowest = lowest_refresh_mode(&panel);
+    printf("panel %s: %ux%u\n", panel.output->name, panel.crtc->width, panel.crtc->height);
+    for (int i = 0; i < panel.output->nmode; i++) {
+        const XRRModeInfo *mode = find_mode(panel.resources, panel.output->modes[i]);
+        if (mode == NULL || current == NULL || mode->width != current->width || mode->height != current->height) {
+            continue;
+        }
+        printf("  %-16s %7.2f Hz%s%s\n", mode->name, refresh_rate(mode),
+               mode->id == current->id ? "  current" : "",
+               lowest != NULL && mode->id == lowest->id ? "  saving" : "");
+    }
+    close_panel(&panel);
+
+    if (test_seconds > 0) {
+        // The test is asked for explicitly, so it switches even in a dry run build
+        dry_run = false;
+        if (display_downshift(DISPLAY_HOLDER_SAVING_MODE) == -1) {
+            fprintf(stderr, "Downshift failed\n");
+            return 1;
+        }
+        sleep(test_seconds);
+        if (display_restore(DISPLAY_HOLDER_SAVING_MODE) == -1) {
+            fprintf(stderr, "Restore failed\n");
+            return 1;
+        }
+        printf("downshift and restore done, see the log for details\n");
+    }
+    return 0;
+}
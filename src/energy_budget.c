@@ -0,0 +1,348 @@
+// energy_budget.c
+//
+// Closed-loop "make the battery last until X" controller. Each sampling
+// period compares the measured power draw with the draw the remaining
+// energy can sustain until the deadline, and a PI controller walks an
+// escalation ladder of brightness, throttling and freezing one stage at a
+// time, only as far as needed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "energy_budget.h"
+#include "backend.h"
+#include "battery_monitor.h"
+#include "holders.h"
+#include "log_message.h"
+
+#define BUDGET_KP 2.0          // Stages per unit of relative overconsumption
+#define BUDGET_KI 0.1          // Stages per unit of error sustained for a minute
+#define BUDGET_SMOOTHING 0.3   // Weight of the newest power sample
+#define BUDGET_DEADBAND 0.05   // Ignore errors within 5% of the target draw
+#define BUDGET_HYSTERESIS 1.0  // Output margin below a stage before stepping back
+
+typedef struct {
+    int brightness;  // Percent, -1 to leave the backlight alone
+    int throttle;
+    int freeze;
+} budget_stage_t;
+
+// Escalation ladder, cheapest and least disruptive measures first
+static const budget_stage_t stages[] = {
+    { -1, 0, 0 },
+    { 70, 0, 0 },
+    { 50, 0, 0 },
+    { 50, 1, 0 },
+    { 30, 1, 0 },
+    { 30, 1, 1 },
+};
+#define STAGE_MAX ((int)(sizeof(stages) / sizeof(stages[0])) - 1)
+
+static int runtime_minutes = 0;
+static time_t deadline = 0;
+static int deadline_from_cli = 0;
+static int watch_budget_file = 0;
+static struct timespec budget_file_mtime;
+
+// Session users whose budget files the system daemon follows, -1 outside system mode
+#define MAX_BUDGET_USERS 64
+
+typedef struct {
+    uid_t uid;
+    struct timespec mtime;
+} budget_user_t;
+
+static budget_user_t budget_users[MAX_BUDGET_USERS];
+static int budget_user_count = -1;
+
+static int stage = 0;
+static double smoothed_power = -1;
+static double integral = 0;
+static time_t last_update = 0;
+static int was_charging = 1;
+
+void energy_budget_set_runtime(int minutes) {
+    runtime_minutes = minutes > 0 ? minutes : 0;
+}
+
+void energy_budget_watch_file(int enabled) {
+    watch_budget_file = enabled;
+}
+
+void energy_budget_set_deadline(time_t new_deadline) {
+    deadline = new_deadline;
+    integral = 0;
+}
+
+int energy_budget_stage() {
+    return stage;
+}
+
+// Runtime file shared by the `budget` subcommand and the daemon; caller frees the result.
+// It lives in the user's private runtime directory, never in a shared one like /tmp.
+static char *get_budget_file_path() {
+    char path[PATH_MAX];
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/battery_monitor.budget", runtime_dir);
+    } else {
+        snprintf(path, sizeof(path), "/run/user/%u/battery_monitor.budget", (unsigned int)getuid());
+    }
+    return strdup(path);
+}
+
+void energy_budget_watch_users(const uid_t *uids, int count) {
+    budget_user_t previous[MAX_BUDGET_USERS];
+    int previous_count = budget_user_count > 0 ? budget_user_count : 0;
+    memcpy(previous, budget_users, previous_count * sizeof(budget_user_t));
+
+    budget_user_count = 0;
+    for (int i = 0; i < count && budget_user_count < MAX_BUDGET_USERS; i++) {
+        budget_user_t *user = &budget_users[budget_user_count++];
+        user->uid = uids[i];
+        user->mtime = (struct timespec){ 0, 0 };
+
+        // Users who stay logged in keep their last seen change
+        for (int j = 0; j < previous_count; j++) {
+            if (previous[j].uid == uids[i]) {
+                user->mtime = previous[j].mtime;
+            }
+        }
+    }
+}
+
+// Pick up a deadline written to path, only when the file changed since *mtime.
+// With a uid, the file has to be a regular file owned by that user.
+static void check_budget_file(const char *path, struct timespec *mtime, uid_t owner) {
+    struct stat st;
+    if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+        (st.st_mtim.tv_sec == mtime->tv_sec && st.st_mtim.tv_nsec == mtime->tv_nsec)) {
+        return;
+    }
+    *mtime = st.st_mtim;
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+                     (owner != (uid_t)-1 && st.st_uid != owner))) {
+        close(fd);
+        fd = -1;
+    }
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "r");
+    if (file == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    long value = 0;
+    if (fscanf(file, "%ld", &value) == 1) {
+        energy_budget_set_deadline((time_t)value);
+        deadline_from_cli = value > 0;
+
+        char message[128];
+        if (value > 0) {
+            snprintf(message, sizeof(message), "Energy budget: battery has to last %ld more minutes",
+                     (long)(value - clock_backend->now()) / 60);
+        } else {
+            snprintf(message, sizeof(message), "Energy budget disabled");
+        }
+        log_message(message);
+    }
+    fclose(file);
+}
+
+// Follow the daemon user's own budget file, or in system mode the one in
+// every session user's runtime directory. Any user's change applies to the
+// whole machine, just as the saving mode they choose does.
+static void check_budget_files() {
+    if (budget_user_count < 0) {
+        char *path = get_budget_file_path();
+        if (path != NULL) {
+            check_budget_file(path, &budget_file_mtime, (uid_t)-1);
+            free(path);
+        }
+        return;
+    }
+
+    for (int i = 0; i < budget_user_count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/run/user/%u/battery_monitor.budget", (unsigned int)budget_users[i].uid);
+        check_budget_file(path, &budget_users[i].mtime, budget_users[i].uid);
+    }
+}
+
+static void apply_stage(int new_stage) {
+    const budget_stage_t *from = &stages[stage];
+    const budget_stage_t *to = &stages[new_stage];
+
+    // Releases only take effect once no policy tier, idle stage or saving mode holds the measure
+    if (to->freeze != from->freeze) {
+        if (to->freeze) {
+            hold_freeze(HOLDER_BUDGET);
+        } else {
+            release_freeze(HOLDER_BUDGET);
+        }
+    }
+
+    if (to->throttle != from->throttle) {
+        if (to->throttle) {
+            hold_throttle(HOLDER_BUDGET);
+        } else {
+            release_throttle(HOLDER_BUDGET);
+        }
+    }
+
+    if (to->brightness != from->brightness) {
+        if (to->brightness >= 0) {
+            hold_brightness(HOLDER_BUDGET, to->brightness);
+        } else {
+            release_brightness(HOLDER_BUDGET);
+        }
+    }
+
+    stage = new_stage;
+}
+
+void energy_budget_release() {
+    if (stage != 0) {
+        log_message("Energy budget: releasing all measures");
+        apply_stage(0);
+    }
+    integral = 0;
+    smoothed_power = -1;
+}
+
+void energy_budget_update(int charging) {
+    if (watch_budget_file) {
+        check_budget_files();
+    }
+    time_t now = clock_backend->now();
+
+    if (charging) {
+        energy_budget_release();
+        was_charging = 1;
+        last_update = now;
+        return;
+    }
+
+    // A configured runtime starts counting at every unplug
+    if (was_charging && runtime_minutes > 0 && !deadline_from_cli) {
+        energy_budget_set_deadline(now + (time_t)runtime_minutes * 60);
+    }
+    was_charging = 0;
+
+    if (deadline == 0 || now >= deadline) {
+        if (deadline != 0) {
+            log_message("Energy budget: deadline reached");
+            deadline = 0;
+            deadline_from_cli = 0;
+        }
+        energy_budget_release();
+        last_update = now;
+        return;
+    }
+
+    long energy = power_source->get_battery_energy();
+    long power = power_source->get_battery_power();
+    if (energy <= 0 || power <= 0) {
+        return;  // The battery does not report what the controller needs
+    }
+
+    smoothed_power = smoothed_power < 0 ? power : BUDGET_SMOOTHING * power + (1 - BUDGET_SMOOTHING) * smoothed_power;
+
+    // Highest average draw (uW) that still reaches the deadline
+    double required_power = energy * 3600.0 / (double)(deadline - now);
+    double error = (smoothed_power - required_power) / required_power;
+    if (error > -BUDGET_DEADBAND && error < BUDGET_DEADBAND) {
+        error = 0;
+    }
+
+    double minutes = last_update > 0 ? (now - last_update) / 60.0 : 0;
+    last_update = now;
+
+    // Integrate with anti-windup so backing off is never delayed by old history
+    integral += error * minutes;
+    if (integral < 0) integral = 0;
+    if (integral > STAGE_MAX / BUDGET_KI) integral = STAGE_MAX / BUDGET_KI;
+
+    double output = BUDGET_KP * error + BUDGET_KI * integral;
+
+    // Move at most one stage per sampling period, backing off only once the
+    // output is clearly below the current stage so noisy readings cannot chatter
+    int new_stage = stage;
+    if (output > stage + 0.5 && stage < STAGE_MAX) {
+        new_stage = stage + 1;
+    } else if (output < stage - BUDGET_HYSTERESIS && stage > 0) {
+        new_stage = stage - 1;
+    }
+
+    if (new_stage != stage) {
+        char message[192];
+        snprintf(message, sizeof(message),
+                 "Energy budget: drawing %.2f W, %.2f W lasts %ld more minutes, stage %d -> %d",
+                 smoothed_power / 1e6, required_power / 1e6, (long)(deadline - now) / 60, stage, new_stage);
+        log_message(message);
+        apply_stage(new_stage);
+    }
+}
+
+int budget_command(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: battery_monitor budget MINUTES|off\n"
+               "  Keep the battery alive for MINUTES from now, throttling as much as needed\n");
+        return 1;
+    }
+
+    long value = 0;
+    if (strcmp(argv[1], "off") != 0) {
+        int minutes = atoi(argv[1]);
+        if (minutes <= 0) {
+            fprintf(stderr, "Invalid runtime '%s'\n", argv[1]);
+            return 1;
+        }
+        value = (long)time(NULL) + minutes * 60L;
+    }
+
+    char *path = get_budget_file_path();
+    if (path == NULL) {
+        return 1;
+    }
+
+    // Write a private temporary file and rename it over the old one, so a
+    // planted symlink is replaced rather than followed
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(temp_path);
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+        perror("Failed to write energy budget");
+        if (fd != -1) {
+            close(fd);
+            unlink(temp_path);
+        }
+        free(path);
+        return 1;
+    }
+    fprintf(file, "%ld\n", value);
+    if (fclose(file) != 0 || rename(temp_path, path) == -1) {
+        perror("Failed to write energy budget");
+        unlink(temp_path);
+        free(path);
+        return 1;
+    }
+    free(path);
+
+    if (value > 0) {
+        time_t until = value;
+        printf("Battery has to last until %s", ctime(&until));
+    } else {
+        printf("Energy budget disabled\n");
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+// event_loop.c
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/filter.h>
+#include "event_loop.h"
+#include "backend.h"
+#include "metrics.h"
+#include "log_message.h"
+
+#define MAX_WATCHES 64
+#define MAX_UEVENT_PREFIX 192   // Long enough for ACPI device paths
+#define MAX_UEVENT_PREFIXES 8
+
+typedef struct {
+    int fd;
+    event_loop_callback callback;
+    void *data;
+    int quiet;  // Not counted in METRIC_WAKEUPS
+} watch_t;
+
+static watch_t watches[MAX_WATCHES];
+static int watch_count = 0;
+static int interrupted = 0;
+
+static int add_watch(int fd, event_loop_callback callback, void *data, int quiet) {
+    if (watch_count >= MAX_WATCHES) {
+        log_message("Maximum event loop watches reached");
+        return -1;
+    }
+
+    watches[watch_count].fd = fd;
+    watches[watch_count].callback = callback;
+    watches[watch_count].data = data;
+    watches[watch_count].quiet = quiet;
+    watch_count++;
+    return 0;
+}
+
+int event_loop_add_fd(int fd, event_loop_callback callback, void *data) {
+    return add_watch(fd, callback, data, 0);
+}
+
+int event_loop_add_quiet_fd(int fd, event_loop_callback callback, void *data) {
+    return add_watch(fd, callback, data, 1);
+}
+
+void event_loop_remove_fd(int fd) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].fd == fd) {
+            watches[i] = watches[--watch_count];
+            return;
+        }
+    }
+}
+
+void event_loop_interrupt(void) {
+    interrupted = 1;
+}
+
+void event_loop_sleep(int seconds) {
+    double deadline = metrics_now() + seconds;
+
+    interrupted = 0;
+    while (!interrupted) {
+        double remaining = deadline - metrics_now();
+        if (remaining <= 0) {
+            break;
+        }
+
+        // Snapshot the watches, callbacks may add or remove entries
+        watch_t active[MAX_WATCHES];
+        struct pollfd fds[MAX_WATCHES];
+        int count = watch_count;
+        for (int i = 0; i < count; i++) {
+            active[i] = watches[i];
+            fds[i].fd = watches[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        int ready = poll(fds, count, (int)(remaining * 1000) + 1);
+
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            log_message("Event loop poll failed");
+            break;
+        }
+
+        // Timeouts and anything but quiet watches count as wakeups
+        int counted = ready == 0;
+        for (int i = 0; i < count && ready > 0; i++) {
+            if (fds[i].revents != 0) {
+                counted |= !active[i].quiet;
+                active[i].callback(active[i].fd, active[i].data);
+                ready--;
+            }
+        }
+        if (counted) {
+            metrics_add(METRIC_WAKEUPS, 1);
+        }
+    }
+}
+
+// Classic BPF program accepting only messages that start with one of the
+// prefixes, compared four bytes at a time. Each prefix is one block ending
+// in an accept, and any mismatch jumps to the next block. Returns the
+// instruction count.
+static int build_prefix_filter(const char *const prefixes[], int prefix_count, struct sock_filter *program) {
+    int count = 0;
+
+    for (int p = 0; p < prefix_count; p++) {
+        const char *prefix = prefixes[p];
+        int length = strlen(prefix);
+        int block_start = count;
+
+        for (int offset = 0; offset < length; ) {
+            int size = length - offset >= 4 ? 4 : (length - offset >= 2 ? 2 : 1);
+            unsigned int value = 0;
+            for (int i = 0; i < size; i++) {
+                value = value << 8 | (unsigned char)prefix[offset + i];
+            }
+            unsigned short load = BPF_LD | BPF_ABS | (size == 4 ? BPF_W : (size == 2 ? BPF_H : BPF_B));
+            program[count++] = (struct sock_filter)BPF_STMT(load, offset);
+            program[count++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0);
+            offset += size;
+        }
+        program[count++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+        // Every mismatch jumps past the accept, to the next block or the final reject
+        for (int i = block_start + 1; i < count - 1; i += 2) {
+            program[i].jf = count - 1 - i;
+        }
+    }
+    program[count++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    return count;
+}
+
+int event_loop_open_uevents(const char *const prefixes[], int prefix_count) {
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;  // Kernel uevents
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1) {
+        return -1;
+    }
+    if (prefix_count > 0) {
+        // Two instructions per compared chunk of at most four bytes, plus an accept per prefix
+        struct sock_filter program[MAX_UEVENT_PREFIXES * (MAX_UEVENT_PREFIX + 1) + 1];
+        struct sock_fprog filter = { 0, program };
+        if (prefix_count > MAX_UEVENT_PREFIXES) {
+            close(fd);
+            return -1;
+        }
+        for (int i = 0; i < prefix_count; i++) {
+            if (strlen(prefixes[i]) > MAX_UEVENT_PREFIX) {
+                close(fd);
+                return -1;
+            }
+        }
+        filter.len = build_prefix_filter(prefixes, prefix_count, program);
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static time_t system_now(void) {
+    return time(NULL);
+}
+
+// Wall clock with waits serviced by the event loop
+const clock_backend_t system_clock = {
+    "system",
+    system_now,
+    event_loop_sleep,
+};
@@ -0,0 +1,398 @@
+// history.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+#include "log_message.h"
+
+#define HISTORY_FILE "/battery_monitor/history.bin"
+
+static history_header_t *history_map = NULL;
+static size_t history_map_size = 0;
+
+static history_record_t *history_records(history_header_t *header) {
+    return (history_record_t *)(header + 1);
+}
+
+// Build the history path under $XDG_DATA_HOME or ~/.local/share; caller frees the result
+char *get_history_file_path() {
+    char path[PATH_MAX];
+    const char *data_home = getenv("XDG_DATA_HOME");
+
+    if (data_home != NULL && data_home[0] != '\0') {
+        snprintf(path, sizeof(path), "%s%s", data_home, HISTORY_FILE);
+    } else {
+        const char *home_dir = getenv("HOME");
+        if (home_dir == NULL) {
+            log_message("Failed to get HOME environment variable");
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "%s/.local/share%s", home_dir, HISTORY_FILE);
+    }
+
+    return strdup(path);
+}
+
+// Create the parent directories of a file path
+static void make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+static int header_is_valid(const history_header_t *header, size_t file_size) {
+    return memcmp(header->magic, HISTORY_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == HISTORY_VERSION &&
+           header->record_size == sizeof(history_record_t) &&
+           header->capacity > 0 &&
+           header->head < header->capacity &&
+           header->count <= header->capacity &&
+           file_size >= sizeof(history_header_t) + (size_t)header->capacity * sizeof(history_record_t);
+}
+
+// Map the history ring, creating it with the given capacity if it does not exist
+int history_open(const char *path, uint32_t capacity) {
+    if (history_map != NULL) {
+        return 0;
+    }
+
+    make_parent_dirs(path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Failed to open history file");
+        log_message("Failed to open history file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    int fresh = (st.st_size == 0);
+    size_t size;
+
+    if (fresh) {
+        size = sizeof(history_header_t) + (size_t)capacity * sizeof(history_record_t);
+        if (ftruncate(fd, size) == -1) {
+            perror("Failed to size history file");
+            log_message("Failed to size history file");
+            close(fd);
+            return -1;
+        }
+    } else {
+        size = st.st_size;
+        if (size < sizeof(history_header_t)) {
+            log_message("History file is truncated, not recording history");
+            close(fd);
+            return -1;
+        }
+    }
+
+    history_header_t *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        perror("Failed to map history file");
+        log_message("Failed to map history file");
+        return -1;
+    }
+
+    if (fresh) {
+        memcpy(header->magic, HISTORY_MAGIC, sizeof(header->magic));
+        header->version = HISTORY_VERSION;
+        header->record_size = sizeof(history_record_t);
+        header->capacity = capacity;
+        header->head = 0;
+        header->count = 0;
+    } else if (!header_is_valid(header, size)) {
+        // Never clobber a file we do not understand
+        log_message("History file has an unknown format, not recording history");
+        munmap(header, size);
+        return -1;
+    }
+
+    history_map = header;
+    history_map_size = size;
+    return 0;
+}
+
+static uint16_t pack_units(long micro_value) {
+    if (micro_value < 0) {
+        return HISTORY_UNAVAILABLE;
+    }
+    long units = micro_value / 10000;  // uWh -> 10 mWh, uW -> 10 mW
+    return units >= HISTORY_UNAVAILABLE ? HISTORY_UNAVAILABLE - 1 : (uint16_t)units;
+}
+
+// Append one sample; the page cache takes care of writing it back
+void history_append(int level, long energy_uwh, long power_uw, int charging, int saving) {
+    if (history_map == NULL) {
+        return;
+    }
+
+    history_record_t record;
+    record.timestamp = (uint32_t)time(NULL);
+    record.energy = pack_units(energy_uwh);
+    record.power = pack_units(power_uw);
+    record.level = level < 0 ? 0 : (level > 100 ? 100 : level);
+    record.flags = 0;
+    if (charging == 1) {
+        record.flags |= HISTORY_FLAG_CHARGING;
+    } else if (charging == -1) {
+        record.flags |= HISTORY_FLAG_UNKNOWN;
+    }
+    if (saving) {
+        record.flags |= HISTORY_FLAG_SAVING;
+    }
+
+    // A reader may map the file at any time. A full ring first drops the
+    // slot about to be overwritten, then the record is written, and only
+    // then do head and count move to publish it. Each step is a release
+    // store, and readers load count before head, so they never see a
+    // header that points at a half-written record.
+    uint32_t head = history_map->head;
+    uint32_t count = history_map->count;
+    if (count == history_map->capacity) {
+        __atomic_store_n(&history_map->count, --count, __ATOMIC_RELEASE);
+    }
+    history_records(history_map)[head] = record;
+    __atomic_store_n(&history_map->head, (head + 1) % history_map->capacity, __ATOMIC_RELEASE);
+    __atomic_store_n(&history_map->count, count + 1, __ATOMIC_RELEASE);
+}
+
+void history_close() {
+    if (history_map != NULL) {
+        munmap(history_map, history_map_size);
+        history_map = NULL;
+        history_map_size = 0;
+    }
+}
+
+// Subcommand helpers
+
+static void format_time(uint32_t timestamp, char *buffer, size_t size) {
+    time_t t = timestamp;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buffer, size, "%Y-%m-%dT%H:%M:%S", &tm);
+}
+
+static void print_units(uint16_t value) {
+    if (value == HISTORY_UNAVAILABLE) {
+        printf(",");
+    } else {
+        printf(",%.2f", value / 100.0);
+    }
+}
+
+static const char *status_name(uint8_t flags) {
+    if (flags & HISTORY_FLAG_UNKNOWN) {
+        return "unknown";
+    }
+    return (flags & HISTORY_FLAG_CHARGING) ? "charging" : "discharging";
+}
+
+typedef struct {
+    uint32_t first, last;
+    unsigned long samples;
+    unsigned long level_sum;
+    int level_min, level_max;
+    double energy_sum, power_sum;
+    unsigned long energy_samples, power_samples;
+    unsigned long charging, saving;
+    uint8_t last_flags;
+} history_bucket_t;
+
+static void bucket_reset(history_bucket_t *b) {
+    memset(b, 0, sizeof(*b));
+    b->level_min = 101;
+    b->level_max = -1;
+}
+
+static void bucket_add(history_bucket_t *b, const history_record_t *r) {
+    if (b->samples == 0) {
+        b->first = r->timestamp;
+    }
+    b->last = r->timestamp;
+    b->samples++;
+    b->level_sum += r->level;
+    if (r->level < b->level_min) b->level_min = r->level;
+    if (r->level > b->level_max) b->level_max = r->level;
+    if (r->energy != HISTORY_UNAVAILABLE) {
+        b->energy_sum += r->energy / 100.0;
+        b->energy_samples++;
+    }
+    if (r->power != HISTORY_UNAVAILABLE) {
+        b->power_sum += r->power / 100.0;
+        b->power_samples++;
+    }
+    if (r->flags & HISTORY_FLAG_CHARGING) b->charging++;
+    if (r->flags & HISTORY_FLAG_SAVING) b->saving++;
+    b->last_flags = r->flags;
+}
+
+static void bucket_print(const history_bucket_t *b) {
+    char when[32];
+    format_time(b->first, when, sizeof(when));
+    printf("%s,%.1f", when, (double)b->level_sum / b->samples);
+    if (b->energy_samples > 0) printf(",%.2f", b->energy_sum / b->energy_samples); else printf(",");
+    if (b->power_samples > 0) printf(",%.2f", b->power_sum / b->power_samples); else printf(",");
+    printf(",%s,%.2f,%lu\n", status_name(b->last_flags), (double)b->saving / b->samples, b->samples);
+}
+
+static void print_history_usage() {
+    printf("Usage: battery_monitor history [options]\n"
+           "  --system         Read the history of the system-wide daemon\n"
+           "  --file PATH      Read PATH instead of the default history file\n"
+           "  --since SECONDS  Only include samples from the last SECONDS\n"
+           "  --step SECONDS   Downsample to averages over SECONDS-long buckets\n"
+           "  --summary        Print aggregate statistics only\n");
+}
+
+int history_command(int argc, char *argv[], const char *default_path) {
+    char *path = NULL;
+    long since = 0;
+    long step = 0;
+    int summary = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            path = strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+            since = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+            step = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--summary") == 0) {
+            summary = 1;
+        } else if (strcmp(argv[i], "--system") == 0) {
+            // Already reflected in default_path
+        } else {
+            print_history_usage();
+            free(path);
+            return 1;
+        }
+    }
+
+    if (path == NULL) {
+        path = default_path[0] != '\0' ? strdup(default_path) : get_history_file_path();
+        if (path == NULL) {
+            return 1;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+    free(path);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(history_header_t)) {
+        fprintf(stderr, "History file is empty or truncated\n");
+        close(fd);
+        return 1;
+    }
+
+    history_header_t *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        perror("Failed to map history file");
+        return 1;
+    }
+
+    if (!header_is_valid(header, st.st_size)) {
+        fprintf(stderr, "History file has an unknown format\n");
+        munmap(header, st.st_size);
+        return 1;
+    }
+
+    // Count before head, the reverse of the order history_append() publishes them in
+    uint32_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    uint32_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    history_record_t *records = history_records(header);
+    uint32_t start = (head + header->capacity - count) % header->capacity;
+    uint32_t cutoff = since > 0 ? (uint32_t)(time(NULL) - since) : 0;
+
+    history_bucket_t bucket;
+    history_bucket_t total;
+    bucket_reset(&bucket);
+    bucket_reset(&total);
+
+    if (!summary) {
+        printf(step > 0 ? "time,level,energy_wh,power_w,status,saving_fraction,samples\n"
+                        : "time,level,energy_wh,power_w,status,saving\n");
+    }
+
+    for (uint32_t n = 0; n < count; n++) {
+        const history_record_t *r = &records[(start + n) % header->capacity];
+        if (r->timestamp < cutoff) {
+            continue;
+        }
+
+        bucket_add(&total, r);
+
+        if (summary) {
+            continue;
+        }
+
+        if (step > 0) {
+            if (bucket.samples > 0 && r->timestamp >= bucket.first + step) {
+                bucket_print(&bucket);
+                bucket_reset(&bucket);
+            }
+            bucket_add(&bucket, r);
+        } else {
+            char when[32];
+            format_time(r->timestamp, when, sizeof(when));
+            printf("%s,%u", when, r->level);
+            print_units(r->energy);
+            print_units(r->power);
+            printf(",%s,%d\n", status_name(r->flags), (r->flags & HISTORY_FLAG_SAVING) ? 1 : 0);
+        }
+    }
+
+    if (!summary && step > 0 && bucket.samples > 0) {
+        bucket_print(&bucket);
+    }
+
+    if (summary) {
+        if (total.samples == 0) {
+            printf("No samples\n");
+        } else {
+            char first[32], last[32];
+            format_time(total.first, first, sizeof(first));
+            format_time(total.last, last, sizeof(last));
+            printf("Samples:        %lu (capacity %u)\n", total.samples, header->capacity);
+            printf("Span:           %s .. %s\n", first, last);
+            printf("Level:          min %d%%, max %d%%, avg %.1f%%\n",
+                   total.level_min, total.level_max, (double)total.level_sum / total.samples);
+            if (total.power_samples > 0) {
+                printf("Average power:  %.2f W\n", total.power_sum / total.power_samples);
+            }
+            printf("Charging:       %.1f%% of samples\n", 100.0 * total.charging / total.samples);
+            printf("Saving mode:    %.1f%% of samples\n", 100.0 * total.saving / total.samples);
+        }
+    }
+
+    munmap(header, st.st_size);
+    return 0;
+}
@@ -0,0 +1,97 @@
+// holders.c
+
+#include <unistd.h>
+#include "holders.h"
+#include "battery_monitor.h"
+#include "process_monitor.h"
+
+static int freeze_holders = 0;
+static int throttle_holders = 0;
+static int brightness_holders = 0;
+static int brightness_percent[HOLDER_COUNT];
+static int saved_brightness = -1;
+
+int hold_freeze(int holder) {
+    freeze_holders |= holder;
+    int result = run_battery_saving_mode(getpid());
+    if (suspend_user_daemons() == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+int release_freeze(int holder) {
+    if (!(freeze_holders & holder)) {
+        return 0;
+    }
+    freeze_holders &= ~holder;
+    if (freeze_holders != 0) {
+        return 0;
+    }
+
+    resume_high_cpu_processes();
+    return resume_user_daemons();
+}
+
+int hold_throttle(int holder) {
+    throttle_holders |= holder;
+    return throttle_high_cpu_processes(getpid());
+}
+
+int release_throttle(int holder) {
+    if (!(throttle_holders & holder)) {
+        return 0;
+    }
+    throttle_holders &= ~holder;
+    if (throttle_holders != 0) {
+        return 0;
+    }
+    return unthrottle_processes();
+}
+
+// Dimmest level any holder asks for
+static int apply_brightness() {
+    int target = -1;
+    for (int i = 0; i < HOLDER_COUNT; i++) {
+        if ((brightness_holders & (1 << i)) && (target < 0 || brightness_percent[i] < target)) {
+            target = brightness_percent[i];
+        }
+    }
+    // Never brighten a screen the user already dimmed further
+    return set_brightness(saved_brightness >= 0 && saved_brightness < target ? saved_brightness : target);
+}
+
+int hold_brightness(int holder, int percent) {
+    if (brightness_holders == 0) {
+        saved_brightness = get_brightness();
+    }
+    brightness_holders |= holder;
+    for (int i = 0; i < HOLDER_COUNT; i++) {
+        if (holder & (1 << i)) {
+            brightness_percent[i] = percent;
+        }
+    }
+    return apply_brightness();
+}
+
+int release_brightness(int holder) {
+    if (!(brightness_holders & holder)) {
+        return 0;
+    }
+    brightness_holders &= ~holder;
+    if (brightness_holders != 0) {
+        return apply_brightness();
+    }
+
+    int result = saved_brightness >= 0 ? set_brightness(saved_brightness) : 0;
+    saved_brightness = -1;
+    return result;
+}
+
+int freeze_held() {
+    return freeze_holders != 0;
+}
+
+int throttle_held() {
+    return throttle_holders != 0;
+}
@@ -0,0 +1,212 @@
+// idle.c
+//
+// Idle-aware power saving. The X server's IDLETIME sync counter counts the
+// milliseconds since the last input; alarms on it turn inactivity into
+// events on the display connection, so nothing is polled. Each configured
+// stage (dim, throttle, freeze, suspend) gets an alarm at its timeout and
+// a single reset alarm fires the moment the counter drops back to zero.
+
+#include <stdio.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/sync.h>
+#include "idle.h"
+#include "backend.h"
+#include "battery_monitor.h"
+#include "holders.h"
+#include "event_loop.h"
+#include "log_message.h"
+
+enum {
+    IDLE_STAGE_DIM,
+    IDLE_STAGE_THROTTLE,
+    IDLE_STAGE_FREEZE,
+    IDLE_STAGE_SUSPEND,
+    IDLE_STAGE_COUNT
+};
+
+static const char *stage_names[IDLE_STAGE_COUNT] = { "dim", "throttle", "freeze", "suspend" };
+
+static Display *display = NULL;
+static int sync_event_base = 0;
+static XSyncCounter idle_counter = None;
+static XSyncAlarm stage_alarms[IDLE_STAGE_COUNT];
+static XSyncAlarm reset_alarm = None;
+
+static int dim_percent = 30;
+static int applied[IDLE_STAGE_COUNT];
+static int deferred[IDLE_STAGE_COUNT];  // Reached while on AC power
+
+static XSyncAlarm create_alarm(long milliseconds, XSyncTestType test_type) {
+    XSyncAlarmAttributes attributes;
+    XSyncValue delta;
+
+    XSyncIntToValue(&delta, 0);
+    XSyncIntToValue(&attributes.trigger.wait_value, milliseconds);
+    attributes.trigger.counter = idle_counter;
+    attributes.trigger.value_type = XSyncAbsolute;
+    attributes.trigger.test_type = test_type;
+    attributes.delta = delta;
+    attributes.events = True;
+
+    return XSyncCreateAlarm(display,
+                            XSyncCACounter | XSyncCAValueType | XSyncCATestType |
+                            XSyncCAValue | XSyncCADelta | XSyncCAEvents,
+                            &attributes);
+}
+
+static void apply_stage(int stage) {
+    char message[128];
+
+    switch (stage) {
+        case IDLE_STAGE_DIM:
+            hold_brightness(HOLDER_IDLE, dim_percent);
+            break;
+        case IDLE_STAGE_THROTTLE:
+            hold_throttle(HOLDER_IDLE);
+            break;
+        case IDLE_STAGE_FREEZE:
+            hold_freeze(HOLDER_IDLE);
+            break;
+        case IDLE_STAGE_SUSPEND:
+            log_message("User idle, suspending");
+            enter_sleep_mode();
+            break;
+    }
+
+    applied[stage] = 1;
+    deferred[stage] = 0;
+    snprintf(message, sizeof(message), "User idle, applied stage %s", stage_names[stage]);
+    log_message(message);
+}
+
+void idle_restore() {
+    // Only the idle holds go; a tier, the budget or saving mode keeps its own
+    release_freeze(HOLDER_IDLE);
+    release_throttle(HOLDER_IDLE);
+    release_brightness(HOLDER_IDLE);
+
+    int any = 0;
+    for (int i = 0; i < IDLE_STAGE_COUNT; i++) {
+        any |= applied[i];
+        applied[i] = 0;
+        deferred[i] = 0;
+    }
+
+    if (any) {
+        log_message("User active, idle measures restored");
+    }
+}
+
+static void handle_alarm(XSyncAlarm alarm) {
+    if (alarm == reset_alarm) {
+        idle_restore();
+        return;
+    }
+
+    for (int stage = 0; stage < IDLE_STAGE_COUNT; stage++) {
+        if (alarm != stage_alarms[stage] || applied[stage]) {
+            continue;
+        }
+        // Idle time alone never justifies degrading a machine on AC power;
+        // the stage engages if the charger is unplugged before input returns
+        if (power_source->is_charging()) {
+            deferred[stage] = 1;
+            continue;
+        }
+        apply_stage(stage);
+    }
+}
+
+void idle_update(int charging) {
+    if (charging) {
+        return;
+    }
+    for (int stage = 0; stage < IDLE_STAGE_COUNT; stage++) {
+        if (deferred[stage]) {
+            apply_stage(stage);
+        }
+    }
+}
+
+static void handle_display(int fd, void *data) {
+    (void)fd;
+    (void)data;
+
+    while (XPending(display) > 0) {
+        XEvent event;
+        XNextEvent(display, &event);
+        if (event.type == sync_event_base + XSyncAlarmNotify) {
+            handle_alarm(((XSyncAlarmNotifyEvent *)&event)->alarm);
+        }
+    }
+}
+
+static XSyncCounter find_idle_counter() {
+    int count = 0;
+    XSyncSystemCounter *counters = XSyncListSystemCounters(display, &count);
+    XSyncCounter counter = None;
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(counters[i].name, "IDLETIME") == 0) {
+            counter = counters[i].counter;
+            break;
+        }
+    }
+    if (counters != NULL) {
+        XSyncFreeSystemCounterList(counters);
+    }
+    return counter;
+}
+
+int idle_init(const idle_config_t *config) {
+    int timeouts[IDLE_STAGE_COUNT] = {
+        config->dim_seconds, config->throttle_seconds, config->freeze_seconds, config->suspend_seconds
+    };
+
+    int shortest = 0;
+    for (int i = 0; i < IDLE_STAGE_COUNT; i++) {
+        if (timeouts[i] > 0 && (shortest == 0 || timeouts[i] < shortest)) {
+            shortest = timeouts[i];
+        }
+    }
+    if (shortest == 0) {
+        return 0;  // Idle detection not configured
+    }
+
+    display = XOpenDisplay(NULL);
+    if (display == NULL) {
+        log_message("No X display, idle detection disabled");
+        return -1;
+    }
+
+    int error_base, major, minor;
+    if (!XSyncQueryExtension(display, &sync_event_base, &error_base) ||
+        !XSyncInitialize(display, &major, &minor) ||
+        (idle_counter = find_idle_counter()) == None) {
+        log_message("X server has no IDLETIME counter, idle detection disabled");
+        XCloseDisplay(display);
+        display = NULL;
+        return -1;
+    }
+
+    if (config->dim_percent >= 0) {
+        dim_percent = config->dim_percent;
+    }
+
+    char message[128];
+    for (int i = 0; i < IDLE_STAGE_COUNT; i++) {
+        stage_alarms[i] = None;
+        if (timeouts[i] > 0) {
+            stage_alarms[i] = create_alarm(timeouts[i] * 1000L, XSyncPositiveTransition);
+            snprintf(message, sizeof(message), "Idle stage %s after %d seconds", stage_names[i], timeouts[i]);
+            log_message(message);
+        }
+    }
+
+    // Any input drops the counter back below the shortest timeout
+    reset_alarm = create_alarm(shortest * 1000L, XSyncNegativeTransition);
+    XFlush(display);
+
+    return event_loop_add_fd(ConnectionNumber(display), handle_display, NULL);
+}
@@ -0,0 +1,36 @@
+// log_message.c
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "log_message.h"
+#include "metrics.h"
+
+#define USER_LOG_FILE "/tmp/battery_monitor.log"
+#define SYSTEM_LOG_FILE "/var/log/battery_monitor.log"
+
+// Function to log messages to a file
+void log_message(const char *message) {
+    // Root never writes below the world-writable /tmp, and nobody follows a
+    // symlink planted at the log path
+    const char *log_file = geteuid() == 0 ? SYSTEM_LOG_FILE : USER_LOG_FILE;
+
+    int fd = open(log_file, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("Failed to open log file");
+        return;
+    }
+
+    char line[1024];
+    int length = snprintf(line, sizeof(line), "%s\n", message);
+    if (length >= (int)sizeof(line)) {
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+    if (write(fd, line, length) == length) {
+        metrics_add(METRIC_LOG_BYTES, length);
+    }
+    close(fd);
+}
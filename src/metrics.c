@@ -0,0 +1,350 @@
+// metrics.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "event_loop.h"
+#include "log_message.h"
+
+#define BUCKET_COUNT 12
+
+// Upper bounds of the latency buckets in seconds, the last one is +Inf
+static const double bucket_bounds[BUCKET_COUNT - 1] = {
+    0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0
+};
+
+typedef struct {
+    const char *name;
+    const char *help;
+    unsigned long buckets[BUCKET_COUNT];
+    unsigned long count;
+    double sum;
+} histogram_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    unsigned long value;
+} counter_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    double value;
+} gauge_t;
+
+static histogram_t histograms[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_SAMPLE_LATENCY] = { "battery_monitor_sample_latency_seconds", "Latency of a single sysfs battery read" },
+    [METRIC_PROC_SCAN_DURATION] = { "battery_monitor_proc_scan_duration_seconds", "Duration of a full /proc scan" },
+    [METRIC_FREEZE_LATENCY] = { "battery_monitor_freeze_seconds", "Time from SIGSTOP until the process is seen stopped" },
+    [METRIC_THAW_LATENCY] = { "battery_monitor_thaw_seconds", "Time from SIGCONT until the process is seen running" },
+    [METRIC_SLEEP_TRANSITION] = { "battery_monitor_sleep_transition_seconds", "Time to enter and leave sleep, excluding the time asleep" },
+};
+
+static counter_t counters[METRIC_COUNTER_COUNT] = {
+    [METRIC_WAKEUPS] = { "battery_monitor_wakeups", "Number of times the daemon woke up" },
+    [METRIC_LOG_BYTES] = { "battery_monitor_log_bytes", "Bytes written to the log file" },
+    [METRIC_PROCESSES_SCANNED] = { "battery_monitor_processes_scanned", "Processes inspected during /proc scans" },
+};
+
+static gauge_t gauges[METRIC_GAUGE_COUNT] = {
+    [METRIC_SUSPENDED_TASKS] = { "battery_monitor_suspended_tasks", "Processes currently suspended by the daemon" },
+    [METRIC_LAST_SCAN_PROCESSES] = { "battery_monitor_last_scan_processes", "Processes seen by the most recent /proc scan" },
+    [METRIC_TEMPERATURE] = { "battery_monitor_temperature_celsius", "Hottest thermal zone at the last sample" },
+};
+
+static double start_time = -1;
+
+// Monotonic clock in seconds
+double metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void metrics_observe(metric_histogram_t histogram, double seconds) {
+    histogram_t *h = &histograms[histogram];
+    int i = 0;
+    while (i < BUCKET_COUNT - 1 && seconds > bucket_bounds[i]) {
+        i++;
+    }
+    h->buckets[i]++;
+    h->count++;
+    h->sum += seconds;
+}
+
+void metrics_add(metric_counter_t counter, unsigned long amount) {
+    counters[counter].value += amount;
+}
+
+void metrics_set(metric_gauge_t gauge, double value) {
+    gauges[gauge].value = value;
+}
+
+// Resident set size of the daemon in bytes
+static long get_rss_bytes() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    long pages = 0;
+    if (fscanf(file, "%*s %ld", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(file);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+char *metrics_render() {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buffer, &size);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        histogram_t *h = &histograms[i];
+        fprintf(out, "# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n", h->name, h->name, h->name, h->help);
+
+        unsigned long cumulative = 0;
+        for (int b = 0; b < BUCKET_COUNT; b++) {
+            cumulative += h->buckets[b];
+            if (b < BUCKET_COUNT - 1) {
+                fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", h->name, bucket_bounds[b], cumulative);
+            } else {
+                fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", h->name, cumulative);
+            }
+        }
+        fprintf(out, "%s_sum %.9f\n%s_count %lu\n", h->name, h->sum, h->name, h->count);
+    }
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        counter_t *c = &counters[i];
+        fprintf(out, "# TYPE %s counter\n# HELP %s %s\n%s_total %lu\n", c->name, c->name, c->help, c->name, c->value);
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        gauge_t *g = &gauges[i];
+        fprintf(out, "# TYPE %s gauge\n# HELP %s %s\n%s %g\n", g->name, g->name, g->help, g->name, g->value);
+    }
+
+    // Wakeup rate averaged over the daemon's lifetime
+    double uptime = start_time < 0 ? 0 : metrics_now() - start_time;
+    double wakeups_per_hour = uptime > 0 ? counters[METRIC_WAKEUPS].value * 3600.0 / uptime : 0;
+    fprintf(out, "# TYPE battery_monitor_wakeups_per_hour gauge\n"
+                 "# HELP battery_monitor_wakeups_per_hour Average daemon wakeups per hour since start\n"
+                 "battery_monitor_wakeups_per_hour %g\n", wakeups_per_hour);
+
+    // The daemon's own resource footprint
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    fprintf(out, "# TYPE process_cpu_seconds counter\n# UNIT process_cpu_seconds seconds\n"
+                 "# HELP process_cpu_seconds Total user and system CPU time spent\n"
+                 "process_cpu_seconds_total %.6f\n", cpu_seconds);
+    fprintf(out, "# TYPE process_resident_memory_bytes gauge\n# UNIT process_resident_memory_bytes bytes\n"
+                 "# HELP process_resident_memory_bytes Resident memory size\n"
+                 "process_resident_memory_bytes %ld\n", get_rss_bytes());
+    fprintf(out, "# TYPE battery_monitor_uptime_seconds gauge\n# UNIT battery_monitor_uptime_seconds seconds\n"
+                 "# HELP battery_monitor_uptime_seconds Time since the daemon started\n"
+                 "battery_monitor_uptime_seconds %.3f\n", uptime);
+
+    fprintf(out, "# EOF\n");
+    fclose(out);
+    return buffer;
+}
+
+// Scrapers connected but not yet answered. Each is served from the event
+// loop once its request arrives, and dropped if it takes too long.
+#define MAX_METRICS_CLIENTS 4
+#define METRICS_CLIENT_TIMEOUT 2.0
+
+typedef struct {
+    int fd;
+    double accepted;
+} metrics_client_t;
+
+static metrics_client_t clients[MAX_METRICS_CLIENTS];
+static int client_count = 0;
+
+static void drop_metrics_client(int index) {
+    event_loop_remove_fd(clients[index].fd);
+    close(clients[index].fd);
+    clients[index] = clients[--client_count];
+}
+
+// Answer one scrape with a minimal HTTP response so both curl and Prometheus can read it
+static void handle_metrics_request(int fd, void *data) {
+    (void)data;
+
+    int index = 0;
+    while (index < client_count && clients[index].fd != fd) {
+        index++;
+    }
+    if (index == client_count) {
+        return;
+    }
+
+    // The request's content does not matter, only that it came
+    char request[1024];
+    ssize_t length = read(fd, request, sizeof(request));
+    if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    char *body = length > 0 ? metrics_render() : NULL;
+    if (body != NULL) {
+        char header[256];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                                  "Content-Length: %zu\r\n\r\n", strlen(body));
+        // The socket is non-blocking, a scraper that does not read is cut off
+        if (send(fd, header, header_len, MSG_NOSIGNAL) != header_len ||
+            send(fd, body, strlen(body), MSG_NOSIGNAL) != (ssize_t)strlen(body)) {
+            log_message("Failed to write metrics response");
+        }
+        free(body);
+    }
+    drop_metrics_client(index);
+}
+
+// Accept a scraper without waiting for it, its request is read once it arrives
+static void handle_metrics_client(int listen_fd, void *data) {
+    (void)data;
+
+    int client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client == -1) {
+        return;
+    }
+
+    // Make room by dropping scrapers that never sent a request, then the oldest
+    double now = metrics_now();
+    for (int i = 0; i < client_count; ) {
+        if (now - clients[i].accepted > METRICS_CLIENT_TIMEOUT) {
+            drop_metrics_client(i);
+        } else {
+            i++;
+        }
+    }
+    if (client_count == MAX_METRICS_CLIENTS) {
+        int oldest = 0;
+        for (int i = 1; i < client_count; i++) {
+            if (clients[i].accepted < clients[oldest].accepted) {
+                oldest = i;
+            }
+        }
+        drop_metrics_client(oldest);
+    }
+
+    if (event_loop_add_quiet_fd(client, handle_metrics_request, NULL) == -1) {
+        close(client);
+        return;
+    }
+    clients[client_count].fd = client;
+    clients[client_count].accepted = now;
+    client_count++;
+}
+
+static int listen_unix(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        log_message("Metrics socket path too long");
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Failed to create metrics socket");
+        return -1;
+    }
+
+    // Replace a stale socket from an earlier run, but nothing else
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            log_message("Metrics socket path exists and is not a socket");
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1) {
+        perror("Failed to bind metrics socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_loopback(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Failed to create metrics socket");
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1) {
+        perror("Failed to bind metrics port");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metrics_init(const char *socket_path, int port) {
+    start_time = metrics_now();
+
+    int result = 0;
+    char message[PATH_MAX + 64];
+
+    if (socket_path != NULL && socket_path[0] != '\0') {
+        int fd = listen_unix(socket_path);
+        if (fd == -1 || event_loop_add_quiet_fd(fd, handle_metrics_client, NULL) == -1) {
+            log_message("Failed to serve metrics on Unix socket");
+            result = -1;
+        } else {
+            snprintf(message, sizeof(message), "Serving metrics on %s", socket_path);
+            log_message(message);
+        }
+    }
+
+    if (port > 0) {
+        int fd = listen_loopback(port);
+        if (fd == -1 || event_loop_add_quiet_fd(fd, handle_metrics_client, NULL) == -1) {
+            log_message("Failed to serve metrics on loopback port");
+            result = -1;
+        } else {
+            snprintf(message, sizeof(message), "Serving metrics on 127.0.0.1:%d", port);
+            log_message(message);
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,197 @@
+// monitor.c
+
+#include <stdio.h>
+#include <stddef.h>
+#include "monitor.h"
+#include "backend.h"
+#include "battery_monitor.h"
+#include "process_monitor.h"
+#include "log_message.h"
+#include "policy.h"
+#include "energy_budget.h"
+#include "usage_model.h"
+#include "display.h"
+#include "holders.h"
+
+// Global Variables for Thresholds
+int THRESHOLD_LOW = 15;       // Default values
+int THRESHOLD_CRITICAL = 5;
+int THRESHOLD_HIGH = 70;
+
+int battery_saving_mode_active = 0;  // 0: inactive, 1: active
+
+typedef struct {
+    int brightness;  // Percent, -1 to leave the backlight alone
+    int throttle;
+    int freeze;
+} preemptive_stage_t;
+
+// What the usage model's stages apply, growing with the predicted shortfall
+static const preemptive_stage_t preemptive_stages[USAGE_MODEL_STAGES + 1] = {
+    { -1, 0, 0 },
+    { 70, 0, 0 },
+    { 70, 1, 0 },
+    { 50, 1, 0 },
+    { 50, 1, 1 },
+};
+
+static int preemptive_stage = 0;
+
+// Backends, chosen by main() or a simulator before the first tick
+const power_source_backend_t *power_source = NULL;
+const clock_backend_t *clock_backend = NULL;
+const notifier_backend_t *notifier = NULL;
+
+// Carry out whatever the user chose in the notification
+void monitor_handle_response(notify_response_t response) {
+    switch (response) {
+        case NOTIFY_RESPONSE_OK:
+            log_message("User clicked OK");
+            break;
+        case NOTIFY_RESPONSE_SAVING:
+            log_message("User activated Battery Saving Mode");
+            activate_battery_saving_mode();
+            break;
+        case NOTIFY_RESPONSE_SLEEP:
+            log_message("User triggered Sleep Mode");
+            enter_sleep_mode();
+            break;
+        default:
+            break;
+    }
+}
+
+// Function to activate battery saving mode
+int activate_battery_saving_mode() {
+    if (battery_saving_mode_active) {
+        return 0;  // A later alert finds everything already applied
+    }
+    log_message("Activating battery saving mode");
+
+    // Suspend high CPU processes and user daemons
+    log_message("Suspending high CPU processes and user daemons");
+    if (hold_freeze(HOLDER_SAVING_MODE) == -1) {
+        log_message("Failed to suspend high CPU processes and user daemons");
+        return -1;
+    }
+
+    // Set the brightness to 50% for battery saving
+    if (hold_brightness(HOLDER_SAVING_MODE, 50) == -1) {
+        log_message("Failed to set brightness to 50%");
+        return -1;
+    }
+
+    // High refresh panels cost more than the brightness step
+    display_downshift(DISPLAY_HOLDER_SAVING_MODE);
+
+    // Set the battery-saving mode active flag
+    battery_saving_mode_active = 1;
+
+    return 0;
+}
+
+static void leave_battery_saving_mode() {
+    // Whatever a policy tier, idle or the budget still holds stays applied
+    release_freeze(HOLDER_SAVING_MODE);
+    release_brightness(HOLDER_SAVING_MODE);
+    display_restore(DISPLAY_HOLDER_SAVING_MODE);
+    battery_saving_mode_active = 0;
+}
+
+// Dim, throttle and finally freeze early while the learned usage pattern
+// says the battery will not last until the usual charge time, the more the
+// further it falls short. Independent of the policy tiers, so it neither
+// waits for their notifications nor keeps them engaged.
+static void set_preemptive_saving(int new_stage) {
+    const preemptive_stage_t *from = &preemptive_stages[preemptive_stage];
+    const preemptive_stage_t *to = &preemptive_stages[new_stage];
+
+    if (to->freeze != from->freeze) {
+        if (to->freeze) {
+            hold_freeze(HOLDER_USAGE_MODEL);
+        } else {
+            release_freeze(HOLDER_USAGE_MODEL);
+        }
+    }
+
+    if (to->throttle != from->throttle) {
+        if (to->throttle) {
+            hold_throttle(HOLDER_USAGE_MODEL);
+        } else {
+            release_throttle(HOLDER_USAGE_MODEL);
+        }
+    }
+
+    if (to->brightness != from->brightness) {
+        if (to->brightness >= 0) {
+            hold_brightness(HOLDER_USAGE_MODEL, to->brightness);
+        } else {
+            release_brightness(HOLDER_USAGE_MODEL);
+        }
+    }
+
+    preemptive_stage = new_stage;
+}
+
+int monitor_tick(battery_sample_t *sample) {
+    sample->level = -1;
+    sample->charging = power_source->is_charging();
+
+    // An unreadable status is not AC power: keep every hold as it is
+    if (sample->charging == -1) {
+        log_message("Charging status read failed, retrying in 1 minute");
+        return 60;
+    }
+
+    if (sample->charging == 1) {
+        // Release every policy tier if the battery is charging
+        log_message("Battery is charging, notifications reset");
+        policy_reset();
+        set_preemptive_saving(0);
+
+        if (battery_saving_mode_active) {
+            // Resume suspended processes
+            log_message("Battery is charging, resuming suspended processes");
+            leave_battery_saving_mode();
+        }
+
+        energy_budget_update(1);
+        sample->level = power_source->get_battery_level();
+        usage_model_update(clock_backend->now(), sample->level, 1);
+        return 300; // Sleep for 5 minutes while charging
+    }
+
+    int battery_level = power_source->get_battery_level();
+    sample->level = battery_level;
+    if (battery_level == -1) {
+        log_message("Battery level read failed, retrying in 1 minute");
+        return 60;
+    }
+
+    // Dynamic sleep interval based on battery level
+    int sleep_duration = 60; // Default 1 minute
+
+    if (battery_level > THRESHOLD_HIGH) {
+        sleep_duration = 300; // Sleep for 5 minutes
+    } else if (battery_level <= THRESHOLD_CRITICAL) {
+        sleep_duration = 30; // Sleep for 30 seconds when critically low
+    } else if (battery_level <= THRESHOLD_LOW) {
+        sleep_duration = 60; // Sleep for 1 minute when low
+    }
+
+    set_preemptive_saving(usage_model_update(clock_backend->now(), battery_level, 0));
+
+    // Engage or release policy tiers, acting on any notification they showed
+    monitor_handle_response(policy_update(battery_level));
+
+    // Leave battery-saving mode once the level has recovered past every tier
+    if (battery_saving_mode_active && policy_state() == -1) {
+        log_message("Battery level above threshold, resuming suspended processes");
+        leave_battery_saving_mode();
+    }
+
+    // Closed-loop runtime target, re-evaluated every sampling period
+    energy_budget_update(0);
+
+    return sleep_duration;
+}
@@ -11,8 +11,9 @@
 #include "battery_monitor.h"
 #include "process_monitor.h"
 #include "log_message.h"
+#include "backend.h"
+#include "paths.h"
 #include <glob.h>
-#include <sys/stat.h>
 
 #define CSS_STYLE "\
     * { \
@@ -25,77 +26,8 @@
     } \
 "
 
-extern int battery_saving_mode_active;
-
-typedef enum {
-    INIT_SYSTEMD,
-    INIT_SYSVINIT,
-    INIT_OPENRC,
-    INIT_UNKNOWN
-} init_system_t;
-
-init_system_t detect_init_system() {
-    struct stat sb;
-
-    if (stat("/run/systemd/system", &sb) == 0) {
-        return INIT_SYSTEMD;
-    } else if (stat("/sbin/init", &sb) == 0) {
-        // Additional checks can be added here
-        return INIT_SYSVINIT;
-    } else if (stat("/run/openrc", &sb) == 0) {
-        return INIT_OPENRC;
-    }
-
-    return INIT_UNKNOWN;
-}
-
-// Function to find the battery path dynamically
-char *get_battery_device_path(const char *file_name) {
-    glob_t glob_result;
-    char pattern[PATH_MAX];
-
-    snprintf(pattern, sizeof(pattern), "/sys/class/power_supply/BAT*/%s", file_name);
-
-    if (glob(pattern, 0, NULL, &glob_result) == 0) {
-        if (glob_result.gl_pathc > 0) {
-            char *battery_path = strdup(glob_result.gl_pathv[0]);
-            globfree(&glob_result);
-            return battery_path;
-        }
-    }
-
-    globfree(&glob_result);
-    return NULL;
-}
-
-// Function to get the battery level
-int get_battery_level() {
-    char *capacity_path = get_battery_device_path("capacity");
-    if (capacity_path == NULL) {
-        log_message("Failed to find battery capacity file");
-        return -1;
-    }
-
-    FILE *file = fopen(capacity_path, "r");
-    free(capacity_path);
-
-    if (file == NULL) {
-        perror("Failed to open capacity file");
-        log_message("Failed to open capacity file");
-        return -1;
-    }
-
-    int battery_level;
-    if (fscanf(file, "%d", &battery_level) != 1) {
-        perror("Failed to read battery level");
-        log_message("Failed to read battery level");
-        fclose(file);
-        return -1;
-    }
-
-    fclose(file);
-    return battery_level;
-}
+// Choice made in the most recent dialog
+static notify_response_t dialog_response = NOTIFY_RESPONSE_NONE;
 
 // Function to get the base directory of the executable
 char *get_base_directory() {
@@ -107,25 +39,11 @@ char *get_base_directory() {
     return base_dir;
 }
 
-// Function to log messages to a file
-void log_message(const char *message) {
-    char log_file[PATH_MAX];
-    snprintf(log_file, PATH_MAX, "/tmp/battery_monitor.log");
-
-    FILE *log_file_ptr = fopen(log_file, "a");
-    if (log_file_ptr) {
-        fprintf(log_file_ptr, "%s\n", message);
-        fclose(log_file_ptr);
-    } else {
-        perror("Failed to open log file");
-    }
-}
-
 char *get_backlight_device_path(const char *file_name) {
     glob_t glob_result;
     char pattern[PATH_MAX];
 
-    snprintf(pattern, sizeof(pattern), "/sys/class/backlight/*/%s", file_name);
+    snprintf(pattern, sizeof(pattern), "%s/sys/class/backlight/*/%s", sysfs_root, file_name);
 
     if (glob(pattern, 0, NULL, &glob_result) == 0) {
         if (glob_result.gl_pathc > 0) {
@@ -199,56 +117,37 @@ int set_brightness(int brightness) {
     return 0;
 }
 
-// Function to activate battery saving mode
-int activate_battery_saving_mode() {
-    log_message("Activating battery saving mode");
-
-    // Get the current PID of the running program
-    pid_t current_pid = getpid();
-
-    // Suspend high CPU processes
-    log_message("Suspending high CPU processes");
-    if (run_battery_saving_mode(current_pid) == -1) {
-        log_message("Failed to suspend high CPU processes");
+// Read a numeric backlight attribute, -1 on failure
+static int read_backlight_value(const char *file_name) {
+    char *path = get_backlight_device_path(file_name);
+    if (path == NULL) {
         return -1;
     }
 
-    // Suspend user daemons
-    log_message("Suspending user daemons");
-    if (suspend_user_daemons() == -1) {
-        log_message("Failed to suspend user daemons");
+    FILE *file = fopen(path, "r");
+    free(path);
+    if (file == NULL) {
         return -1;
     }
 
-    // Set the brightness to 50% for battery saving
-    if (set_brightness(50) == -1) {
-        log_message("Failed to set brightness to 50%");
-        return -1;
+    int value;
+    if (fscanf(file, "%d", &value) != 1) {
+        value = -1;
     }
-
-    // Set the battery-saving mode active flag
-    battery_saving_mode_active = 1;
-
-    return 0;
+    fclose(file);
+    return value;
 }
 
-// Function to enter sleep mode
-int enter_sleep_mode() {
-    log_message("Entering sleep mode");
-
-    init_system_t init_sys = detect_init_system();
+// Function to get the screen brightness as a percentage of the maximum
+int get_brightness() {
+    int brightness = read_backlight_value("brightness");
+    int max_brightness = read_backlight_value("max_brightness");
 
-    switch (init_sys) {
-        case INIT_SYSTEMD:
-            return system("systemctl suspend");
-        case INIT_SYSVINIT:
-            return system("pm-suspend");
-        case INIT_OPENRC:
-            return system("loginctl suspend");
-        default:
-            log_message("Unknown init system, cannot enter sleep mode");
-            return -1;
+    if (brightness < 0 || max_brightness <= 0) {
+        log_message("Failed to read backlight brightness");
+        return -1;
     }
+    return (brightness * 100 + max_brightness / 2) / max_brightness;
 }
 
 // Function to apply custom CSS styles to the GTK widgets
@@ -263,7 +162,7 @@ void apply_css(GtkWidget *widget, const char *css) {
 // Function to check the battery status and close the dialog if charging
 gboolean check_battery_status(gpointer user_data) {
     GtkWidget *dialog = GTK_WIDGET(user_data);
-    if (is_charging()) {
+    if (power_source->is_charging() == 1) {
         log_message("Battery started charging, closing notification");
         gtk_widget_destroy(dialog);
         gtk_main_quit();
@@ -294,15 +193,13 @@ gboolean on_key_press(GtkWidget *widget, GdkEventKey *event, gpointer user_data)
 void on_dialog_response(GtkDialog *dialog, gint response_id, gpointer user_data) {
     switch (response_id) {
         case GTK_RESPONSE_OK:
-            log_message("User clicked OK");
+            dialog_response = NOTIFY_RESPONSE_OK;
             break;
         case GTK_RESPONSE_APPLY:
-            log_message("User activated Battery Saving Mode");
-            activate_battery_saving_mode();
+            dialog_response = NOTIFY_RESPONSE_SAVING;
             break;
         case GTK_RESPONSE_CLOSE:
-            log_message("User triggered Sleep Mode");
-            enter_sleep_mode();
+            dialog_response = NOTIFY_RESPONSE_SLEEP;
             break;
         default:
             break;
@@ -311,9 +208,10 @@ void on_dialog_response(GtkDialog *dialog, gint response_id, gpointer user_data)
     gtk_main_quit();
 }
 
-// Function to show the notification dialog
-void show_notification(const char *message, const char *title) {
+// Function to show the notification dialog and return the user's choice
+notify_response_t show_notification(const char *message, const char *title) {
     log_message("Showing notification");
+    dialog_response = NOTIFY_RESPONSE_NONE;
 
     GtkWidget *dialog;
     gtk_init(0, NULL);
@@ -350,33 +248,11 @@ void show_notification(const char *message, const char *title) {
     // Show the dialog and enter the GTK main loop
     gtk_widget_show_all(dialog);
     gtk_main();
+    return dialog_response;
 }
 
-// Function to check if the battery is charging
-int is_charging() {
-    char *status_path = get_battery_device_path("status");
-    if (status_path == NULL) {
-        log_message("Failed to find battery status file");
-        return -1;
-    }
-
-    FILE *file = fopen(status_path, "r");
-    free(status_path);
-
-    if (file == NULL) {
-        perror("Failed to open status file");
-        log_message("Failed to open status file");
-        return -1;
-    }
-
-    char status[16];
-    if (fscanf(file, "%15s", status) != 1) {
-        perror("Failed to read battery status");
-        log_message("Failed to read battery status");
-        fclose(file);
-        return -1;
-    }
-
-    fclose(file);
-    return (strcmp(status, "Charging") == 0);
-}
+// Notifier backend showing GTK dialogs
+const notifier_backend_t gtk_notifier = {
+    "gtk",
+    show_notification,
+};
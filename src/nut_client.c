@@ -0,0 +1,605 @@
+// nut_client.c
+//
+// Power source backend for a UPS served by Network UPS Tools, or anything
+// speaking its line protocol, over TCP or a Unix socket. The protocol has
+// no notifications, so like upsmon the backend polls on a timer registered
+// with the event loop and wakes the monitor when the UPS goes on or off
+// battery. Readings come from one LIST VAR round trip. Once the timer runs,
+// the request, the reply and any reconnect are driven by the event loop and
+// the getters only read what the last poll fetched; before that, each
+// sample makes the round trip itself.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include "backend.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "log_message.h"
+
+#define DEFAULT_ADDRESS "ups@localhost:3493"
+#define DEFAULT_PORT "3493"
+#define POLL_SECONDS 5       // upsmon's default POLLFREQ
+#define CACHE_SECONDS 1.0    // Readings shared by the getters of one sample
+#define IO_TIMEOUT_SECONDS 2
+#define STALE_SECONDS (2 * POLL_SECONDS)  // Polled readings older than this are not used
+#define MAX_VARS 128
+#define MAX_ADDRESSES 4
+
+typedef struct {
+    char name[48];
+    char value[64];
+} nut_var_t;
+
+static char ups_name[64] = "ups";
+static char host[256] = "localhost";  // Or the socket path when it starts with '/'
+static char port[16] = DEFAULT_PORT;
+
+// Resolved once, so reconnecting from the event loop never waits on DNS
+static struct sockaddr_storage addresses[MAX_ADDRESSES];
+static socklen_t address_lengths[MAX_ADDRESSES];
+static int address_count = 0;
+static int next_address = 0;  // Where the next connect attempt starts
+
+static int server_fd = -1;
+static int server_watched = 0;  // server_fd is registered with the event loop
+static int connecting = 0;      // Non-blocking connect still in progress
+static char input[4096];
+static size_t input_length = 0;
+
+static int polling = 0;          // The poll timer fetches, getters read its result
+static int reply_pending = 0;    // The timer's LIST VAR is still being answered
+static double request_start = 0;
+static int in_list = 0;          // BEGIN LIST VAR seen
+static nut_var_t incoming[MAX_VARS];
+static int incoming_count = 0;
+
+static nut_var_t vars[MAX_VARS];
+static int var_count = 0;
+static double fetched_at = -1;
+static char server_error[256] = "";  // ERR line of the last failed request
+static char logged_error[256] = "";  // Last problem logged, to log each only once
+static int last_status = -1;  // Flags from the last poll
+
+enum { STATUS_ONLINE = 0x01, STATUS_ON_BATTERY = 0x02, STATUS_LOW = 0x04 };
+
+// UPSNAME@HOST[:PORT] or UPSNAME@/path/to/socket
+static int parse_address(const char *address) {
+    const char *at = strchr(address, '@');
+    if (at == NULL || at == address || (size_t)(at - address) >= sizeof(ups_name)) {
+        return -1;
+    }
+    snprintf(ups_name, sizeof(ups_name), "%.*s", (int)(at - address), address);
+
+    const char *rest = at + 1;
+    const char *colon = rest[0] == '/' ? NULL : strrchr(rest, ':');
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - rest), rest);
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    } else {
+        snprintf(host, sizeof(host), "%s", rest);
+        snprintf(port, sizeof(port), "%s", DEFAULT_PORT);
+    }
+    return host[0] != '\0' ? 0 : -1;
+}
+
+// Set before connect(): Linux bounds connect() by SO_SNDTIMEO, so an
+// unreachable host costs IO_TIMEOUT_SECONDS instead of the SYN timeout
+static int set_timeouts(int fd) {
+    struct timeval timeout = { IO_TIMEOUT_SECONDS, 0 };
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int resolve_server() {
+    address_count = 0;
+    next_address = 0;
+
+    if (host[0] == '/') {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&addresses[0];
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", host);
+        address_lengths[0] = sizeof(*addr);
+        address_count = 1;
+        return 0;
+    }
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+    for (struct addrinfo *ai = result; ai != NULL && address_count < MAX_ADDRESSES; ai = ai->ai_next) {
+        memcpy(&addresses[address_count], ai->ai_addr, ai->ai_addrlen);
+        address_lengths[address_count++] = ai->ai_addrlen;
+    }
+    freeaddrinfo(result);
+    return address_count > 0 ? 0 : -1;
+}
+
+// Connect to one resolved address, -1 on failure. A non-blocking connect
+// may still be in progress when this returns.
+static int connect_address(int index, int nonblocking, int *in_progress) {
+    int fd = socket(addresses[index].ss_family, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    *in_progress = 0;
+    if (fd == -1) {
+        return -1;
+    }
+    if (set_timeouts(fd) == 0 && connect(fd, (struct sockaddr *)&addresses[index], address_lengths[index]) == 0) {
+        return fd;
+    }
+    if (nonblocking && errno == EINPROGRESS) {
+        *in_progress = 1;
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+static int connect_server() {
+    if (address_count == 0 && resolve_server() == -1) {
+        return -1;
+    }
+    int in_progress;
+    for (int i = 0; i < address_count; i++) {
+        int fd = connect_address(i, 0, &in_progress);
+        if (fd != -1) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static void disconnect_server() {
+    if (server_watched) {
+        event_loop_remove_fd(server_fd);
+        server_watched = 0;
+    }
+    if (server_fd != -1) {
+        close(server_fd);
+        server_fd = -1;
+    }
+    input_length = 0;
+    connecting = 0;
+    reply_pending = 0;
+    in_list = 0;
+}
+
+// Take the next complete line out of the input buffer, -1 if there is none yet
+static int next_line(char *line, size_t size) {
+    char *newline = memchr(input, '\n', input_length);
+    if (newline == NULL) {
+        return -1;
+    }
+    size_t length = newline - input;
+    snprintf(line, size, "%.*s", (int)length, input);
+    memmove(input, newline + 1, input_length - length - 1);
+    input_length -= length + 1;
+    return 0;
+}
+
+// Next line from the server without its newline, -1 on error or timeout
+static int read_line(char *line, size_t size) {
+    while (next_line(line, size) == -1) {
+        if (input_length == sizeof(input)) {
+            return -1;
+        }
+
+        ssize_t received = recv(server_fd, input + input_length, sizeof(input) - input_length, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        input_length += received;
+    }
+    return 0;
+}
+
+static int send_line(const char *line) {
+    size_t length = strlen(line);
+    return send(server_fd, line, length, MSG_NOSIGNAL) == (ssize_t)length ? 0 : -1;
+}
+
+// VAR <ups> <name> "<value>"
+static int parse_var(const char *line, nut_var_t *var) {
+    char name[48];
+    int offset = 0;
+    if (sscanf(line, "VAR %*s %47s \"%n", name, &offset) != 1 || offset == 0) {
+        return -1;
+    }
+
+    const char *p = line + offset;
+    size_t length = 0;
+    while (*p != '\0' && *p != '"' && length < sizeof(var->value) - 1) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+        var->value[length++] = *p++;
+    }
+    var->value[length] = '\0';
+    snprintf(var->name, sizeof(var->name), "%s", name);
+    return 0;
+}
+
+static int send_list_request() {
+    char line[128];
+    snprintf(line, sizeof(line), "LIST VAR %s\n", ups_name);
+    in_list = 0;
+    return send_line(line);
+}
+
+// Feed one line of a LIST VAR reply: 1 once the list is complete, 0 while
+// more is expected, -2 for an error reply
+static int list_line(const char *line) {
+    if (!in_list) {
+        if (strncmp(line, "BEGIN LIST VAR", 14) != 0) {
+            // ERR UNKNOWN-UPS, ERR DRIVER-NOT-CONNECTED and the like
+            snprintf(server_error, sizeof(server_error), "%s", line);
+            return -2;
+        }
+        in_list = 1;
+        incoming_count = 0;
+        return 0;
+    }
+    if (strncmp(line, "END LIST VAR", 12) == 0) {
+        in_list = 0;
+        memcpy(vars, incoming, incoming_count * sizeof(incoming[0]));
+        var_count = incoming_count;
+        return 1;
+    }
+    if (incoming_count < MAX_VARS && parse_var(line, &incoming[incoming_count]) == 0) {
+        incoming_count++;
+    }
+    return 0;
+}
+
+static int list_vars() {
+    char line[512];
+    if (send_list_request() == -1) {
+        return -1;
+    }
+    int result = 0;
+    while (result == 0) {
+        if (read_line(line, sizeof(line)) == -1) {
+            return -1;
+        }
+        result = list_line(line);
+    }
+    return result == 1 ? 0 : -2;
+}
+
+// Record the outcome of a fetch started at start: 0 on success, -1 for a
+// lost server, -2 for an error reply
+static int finish_fetch(int result, double start) {
+    fetched_at = metrics_now();
+
+    if (result == 0) {
+        metrics_observe(METRIC_SAMPLE_LATENCY, fetched_at - start);
+        logged_error[0] = '\0';
+        return var_count > 0 ? 0 : -1;
+    }
+
+    // The poll timer retries every few seconds, so only log what changed
+    var_count = 0;
+    const char *error = result == -1 ? "server unreachable" : server_error;
+    if (strcmp(error, logged_error) != 0) {
+        char message[320];
+        snprintf(message, sizeof(message), "UPS %s: %s", ups_name, error);
+        log_message(message);
+        snprintf(logged_error, sizeof(logged_error), "%s", error);
+    }
+    return -1;
+}
+
+// Fetch every variable now. A dropped connection is only re-established by
+// the next call, so one sample never waits out two timeouts.
+static int refresh(int force) {
+    double start = metrics_now();
+    if (!force && fetched_at >= 0 && start - fetched_at < CACHE_SECONDS) {
+        return var_count > 0 ? 0 : -1;
+    }
+
+    int result = -1;
+    if (server_fd != -1 || (server_fd = connect_server()) != -1) {
+        result = list_vars();
+        if (result == -1) {
+            disconnect_server();
+        }
+    }
+    return finish_fetch(result, start);
+}
+
+// Readings for the getters: the poll timer's while it runs, never waiting
+// on the server from the event loop thread
+static int readings() {
+    if (!polling) {
+        return refresh(0);
+    }
+    return var_count > 0 && metrics_now() - fetched_at < STALE_SECONDS ? 0 : -1;
+}
+
+static const char *find_var(const char *name) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(vars[i].name, name) == 0) {
+            return vars[i].value;
+        }
+    }
+    return NULL;
+}
+
+// ups.status is a list of flags such as "OL CHRG" or "OB DISCHRG LB"
+static int read_status() {
+    const char *status = find_var("ups.status");
+    if (status == NULL) {
+        return -1;
+    }
+
+    int flags = 0;
+    char copy[64];
+    snprintf(copy, sizeof(copy), "%s", status);
+    for (char *flag = strtok(copy, " "); flag != NULL; flag = strtok(NULL, " ")) {
+        if (strcmp(flag, "OL") == 0) {
+            flags |= STATUS_ONLINE;
+        } else if (strcmp(flag, "OB") == 0) {
+            flags |= STATUS_ON_BATTERY;
+        } else if (strcmp(flag, "LB") == 0) {
+            flags |= STATUS_LOW;
+        }
+    }
+    return flags;
+}
+
+static int nut_get_battery_level(void) {
+    const char *charge = readings() == 0 ? find_var("battery.charge") : NULL;
+    return charge != NULL ? (int)lround(atof(charge)) : -1;
+}
+
+static int nut_is_charging(void) {
+    int flags = readings() == 0 ? read_status() : -1;
+    if (flags == -1 || (flags & (STATUS_ONLINE | STATUS_ON_BATTERY)) == 0) {
+        return -1;
+    }
+    // Like a laptop on AC: the load runs from the mains while the UPS is on line
+    return (flags & STATUS_ONLINE) != 0;
+}
+
+// Real power drawn by the load in uW, from ups.realpower or the load share of its nominal
+static long nut_get_battery_power(void) {
+    if (readings() == -1) {
+        return -1;
+    }
+
+    const char *realpower = find_var("ups.realpower");
+    if (realpower != NULL) {
+        return (long)(atof(realpower) * 1000000.0);
+    }
+
+    const char *load = find_var("ups.load");
+    const char *nominal = find_var("ups.realpower.nominal");
+    if (load == NULL || nominal == NULL) {
+        return -1;
+    }
+    return (long)(atof(load) / 100.0 * atof(nominal) * 1000000.0);
+}
+
+// UPSes report runtime rather than energy, so estimate it at the current draw
+static long nut_get_battery_energy(void) {
+    long power = nut_get_battery_power();
+    const char *runtime = find_var("battery.runtime");
+    if (power < 0 || runtime == NULL) {
+        return -1;
+    }
+    return (long)((double)power * atof(runtime) / 3600.0);
+}
+
+// Wake the monitor when the UPS switched to or from battery, or was lost
+static void report_status() {
+    int flags = var_count > 0 ? read_status() : -1;
+    if (flags != last_status) {
+        // Losing the server is logged by refresh()
+        if (flags != -1) {
+            char message[128];
+            snprintf(message, sizeof(message), "UPS %s %s%s", ups_name,
+                     (flags & STATUS_ON_BATTERY) ? "on battery" : "on line power",
+                     (flags & STATUS_LOW) ? ", battery low" : "");
+            log_message(message);
+        }
+        event_loop_interrupt();
+    }
+    last_status = flags;
+}
+
+static void poll_failed(double start) {
+    disconnect_server();
+    finish_fetch(-1, start);
+    report_status();
+}
+
+// Reply data from the server, read without blocking
+static void handle_reply(int fd, void *data) {
+    (void)data;
+    if (fd != server_fd) {
+        return;  // Dropped earlier in the same event loop pass
+    }
+    int closed = 0;
+    while (input_length < sizeof(input)) {
+        ssize_t received = recv(fd, input + input_length, sizeof(input) - input_length, MSG_DONTWAIT);
+        if (received > 0) {
+            input_length += received;
+            continue;
+        }
+        closed = received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+    }
+
+    if (!reply_pending) {
+        // Nothing was asked; an idle connection the server closed is dropped
+        input_length = 0;
+        if (closed) {
+            disconnect_server();
+        }
+        return;
+    }
+
+    char line[512];
+    int result = 0;
+    while (result == 0 && next_line(line, sizeof(line)) == 0) {
+        result = list_line(line);
+    }
+    if (result == 0 && !closed && input_length < sizeof(input)) {
+        return;
+    }
+
+    if (result != 1) {
+        if (result == -2) {
+            reply_pending = 0;
+            finish_fetch(-2, request_start);
+            report_status();
+        } else {
+            poll_failed(request_start);
+        }
+        return;
+    }
+    reply_pending = 0;
+    finish_fetch(0, request_start);
+    report_status();
+}
+
+// Whether a non-blocking connect finished: 1 connected, 0 still going, -1 failed
+static int connect_state(int fd) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    if (poll(&pfd, 1, 0) == 0) {
+        return 0;
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+// Start connecting without blocking, from the address that worked last
+static void start_connect() {
+    if (address_count == 0 && resolve_server() == -1) {
+        return;
+    }
+    for (int tried = 0; tried < address_count && server_fd == -1; tried++) {
+        int in_progress;
+        server_fd = connect_address(next_address, 1, &in_progress);
+        connecting = in_progress;
+        if (server_fd == -1) {
+            next_address = (next_address + 1) % address_count;
+        }
+    }
+}
+
+// Poll the status: send LIST VAR and return, handle_reply() takes the answer.
+// A reply or connect that takes a whole period counts as a lost server.
+static void handle_poll_timer(int fd, void *data) {
+    (void)data;
+    unsigned long long expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    double start = metrics_now();
+    if (reply_pending) {
+        poll_failed(request_start);
+    }
+
+    int started = 0;
+    if (server_fd == -1) {
+        start_connect();
+        started = 1;
+    }
+    if (server_fd != -1 && connecting) {
+        int state = connect_state(server_fd);
+        if (state == 0 && started) {
+            return;
+        }
+        if (state != 1) {
+            next_address = (next_address + 1) % address_count;
+            poll_failed(start);
+            return;
+        }
+        connecting = 0;
+    }
+    if (server_fd == -1) {
+        poll_failed(start);
+        return;
+    }
+
+    if (!server_watched) {
+        if (event_loop_add_fd(server_fd, handle_reply, NULL) == -1) {
+            poll_failed(start);
+            return;
+        }
+        server_watched = 1;
+    }
+    if (send_list_request() == -1) {
+        poll_failed(start);
+        return;
+    }
+    reply_pending = 1;
+    request_start = start;
+}
+
+static int nut_open(const char *address) {
+    char message[512];
+    if (parse_address(address != NULL && address[0] != '\0' ? address : DEFAULT_ADDRESS) == -1) {
+        snprintf(message, sizeof(message), "Invalid UPS address %s, expected UPS@HOST[:PORT] or UPS@/PATH", address);
+        log_message(message);
+        return -1;
+    }
+
+    disconnect_server();
+    snprintf(message, sizeof(message), "Reading UPS %s from %s%s%s", ups_name, host, host[0] == '/' ? "" : ":",
+             host[0] == '/' ? "" : port);
+    log_message(message);
+    if (resolve_server() == -1) {
+        log_message("Failed to resolve the UPS server, trying again on every poll");
+    }
+    last_status = refresh(1) == 0 ? read_status() : -1;
+    return 0;
+}
+
+static int nut_watch(void) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec interval = { { POLL_SECONDS, 0 }, { POLL_SECONDS, 0 } };
+    if (fd == -1 || timerfd_settime(fd, 0, &interval, NULL) == -1 ||
+        event_loop_add_fd(fd, handle_poll_timer, NULL) == -1) {
+        log_message("Failed to set up the UPS poll timer, sampling only");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    polling = 1;
+    return 0;
+}
+
+// Power source backend for a UPS behind a NUT-style server
+const power_source_backend_t nut_power_source = {
+    "nut",
+    nut_get_battery_level,
+    nut_is_charging,
+    nut_get_battery_energy,
+    nut_get_battery_power,
+    nut_open,
+    nut_watch,
+};
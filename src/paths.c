@@ -0,0 +1,23 @@
+// paths.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "paths.h"
+
+char sysfs_root[PATH_MAX] = "";
+char procfs_root[PATH_MAX] = "";
+
+void set_root_prefixes(const char *sys_root, const char *proc_root) {
+    if (sys_root != NULL) {
+        snprintf(sysfs_root, sizeof(sysfs_root), "%s", sys_root);
+    }
+    if (proc_root != NULL) {
+        snprintf(procfs_root, sizeof(procfs_root), "%s", proc_root);
+    }
+}
+
+void load_root_prefixes_from_env() {
+#ifdef BATTERY_MONITOR_TESTING
+    set_root_prefixes(getenv("BATTERY_MONITOR_SYSFS_ROOT"), getenv("BATTERY_MONITOR_PROC_ROOT"));
+#endif
+}
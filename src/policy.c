@@ -0,0 +1,286 @@
+// policy.c
+//
+// Tiered battery policy. Tiers are sorted by threshold and compiled into a
+// next-state table indexed by (engaged tier, battery level), so each sample
+// costs a single lookup. Work only happens on tier transitions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "policy.h"
+#include "battery_monitor.h"
+#include "process_monitor.h"
+#include "power_profile.h"
+#include "display.h"
+#include "holders.h"
+#include "log_message.h"
+
+#define LEVEL_COUNT 101
+
+static policy_tier_t tiers[POLICY_MAX_TIERS];
+static int tier_count = 0;
+static int compiled = 0;
+
+// next_state[state + 1][level] is the tier engaged after seeing `level` in `state`
+static signed char next_state[POLICY_MAX_TIERS + 1][LEVEL_COUNT];
+
+// What being in a tier implies, including every shallower tier
+static unsigned int cumulative_actions[POLICY_MAX_TIERS];
+static int effective_dim[POLICY_MAX_TIERS];  // -1 when no tier dims
+static int effective_epp[POLICY_MAX_TIERS];  // Tier whose EPP profile applies, -1 when none
+
+static int state = -1;
+static char saved_epp[32] = "";
+
+int policy_add_tier(const char *spec) {
+    if (tier_count >= POLICY_MAX_TIERS) {
+        log_message("Maximum number of policy tiers reached");
+        return -1;
+    }
+
+    policy_tier_t tier;
+    char action_list[256];
+    memset(&tier, 0, sizeof(tier));
+    tier.dim_percent = -1;
+
+    if (sscanf(spec, "%31[^:]:%d:%d:%255s", tier.name, &tier.threshold, &tier.hysteresis, action_list) != 4) {
+        char message[320];
+        snprintf(message, sizeof(message), "Invalid policy tier: %s", spec);
+        log_message(message);
+        return -1;
+    }
+
+    for (char *action = strtok(action_list, ","); action != NULL; action = strtok(NULL, ",")) {
+        if (strcmp(action, "notify") == 0) {
+            tier.actions |= POLICY_ACTION_NOTIFY;
+        } else if (strcmp(action, "throttle") == 0) {
+            tier.actions |= POLICY_ACTION_THROTTLE;
+        } else if (strcmp(action, "freeze") == 0) {
+            tier.actions |= POLICY_ACTION_FREEZE;
+        } else if (strncmp(action, "dim=", 4) == 0) {
+            tier.actions |= POLICY_ACTION_DIM;
+            tier.dim_percent = atoi(action + 4);
+        } else if (strncmp(action, "epp=", 4) == 0) {
+            tier.actions |= POLICY_ACTION_EPP;
+            snprintf(tier.epp, sizeof(tier.epp), "%s", action + 4);
+        } else if (strcmp(action, "refresh") == 0) {
+            tier.actions |= POLICY_ACTION_REFRESH;
+        } else if (strcmp(action, "suspend") == 0) {
+            tier.actions |= POLICY_ACTION_SUSPEND;
+        } else {
+            char message[320];
+            snprintf(message, sizeof(message), "Unknown policy action '%s' in tier %s", action, tier.name);
+            log_message(message);
+        }
+    }
+
+    if (tier.threshold < 0) tier.threshold = 0;
+    if (tier.threshold > 100) tier.threshold = 100;
+    if (tier.hysteresis < 0) tier.hysteresis = 0;
+
+    tiers[tier_count++] = tier;
+    compiled = 0;
+    return 0;
+}
+
+void policy_compile() {
+    if (tier_count == 0) {
+        // Classic behaviour: one notification at the low and critical thresholds
+        char spec[64];
+        snprintf(spec, sizeof(spec), "low:%d:0:notify", THRESHOLD_LOW);
+        policy_add_tier(spec);
+        snprintf(spec, sizeof(spec), "critical:%d:0:notify", THRESHOLD_CRITICAL);
+        policy_add_tier(spec);
+    }
+
+    // Shallowest tier (highest threshold) first
+    for (int i = 1; i < tier_count; i++) {
+        policy_tier_t tier = tiers[i];
+        int j = i - 1;
+        while (j >= 0 && tiers[j].threshold < tier.threshold) {
+            tiers[j + 1] = tiers[j];
+            j--;
+        }
+        tiers[j + 1] = tier;
+    }
+
+    for (int i = 0; i < tier_count; i++) {
+        cumulative_actions[i] = tiers[i].actions | (i > 0 ? cumulative_actions[i - 1] : 0);
+
+        effective_dim[i] = i > 0 ? effective_dim[i - 1] : -1;
+        if ((tiers[i].actions & POLICY_ACTION_DIM) &&
+            (effective_dim[i] < 0 || tiers[i].dim_percent < effective_dim[i])) {
+            effective_dim[i] = tiers[i].dim_percent;
+        }
+
+        effective_epp[i] = (tiers[i].actions & POLICY_ACTION_EPP) ? i : (i > 0 ? effective_epp[i - 1] : -1);
+    }
+
+    for (int from = -1; from < tier_count; from++) {
+        for (int level = 0; level < LEVEL_COUNT; level++) {
+            // Deepest tier the level falls into
+            int engage = -1;
+            for (int i = 0; i < tier_count; i++) {
+                if (level <= tiers[i].threshold) {
+                    engage = i;
+                }
+            }
+
+            // Deepest tier at or above the current one still held by its hysteresis
+            int hold = -1;
+            for (int i = 0; i <= from; i++) {
+                if (level <= tiers[i].threshold + tiers[i].hysteresis) {
+                    hold = i;
+                }
+            }
+
+            next_state[from + 1][level] = engage > hold ? engage : hold;
+        }
+    }
+
+    compiled = 1;
+
+    char message[128];
+    for (int i = 0; i < tier_count; i++) {
+        snprintf(message, sizeof(message), "Policy tier %d: %s at %d%% (+%d), actions 0x%02x",
+                 i, tiers[i].name, tiers[i].threshold, tiers[i].hysteresis, tiers[i].actions);
+        log_message(message);
+    }
+}
+
+static void apply_brightness(int old_state, int new_state) {
+    int from = old_state >= 0 ? effective_dim[old_state] : -1;
+    int to = new_state >= 0 ? effective_dim[new_state] : -1;
+    if (from == to) {
+        return;
+    }
+
+    if (to >= 0) {
+        hold_brightness(HOLDER_POLICY, to);
+    } else {
+        release_brightness(HOLDER_POLICY);
+    }
+}
+
+static void apply_epp(int old_state, int new_state) {
+    int from = old_state >= 0 ? effective_epp[old_state] : -1;
+    int to = new_state >= 0 ? effective_epp[new_state] : -1;
+    if (from == to) {
+        return;
+    }
+
+    if (to >= 0) {
+        if (saved_epp[0] == '\0' && get_epp_profile(saved_epp, sizeof(saved_epp)) == -1) {
+            saved_epp[0] = '\0';
+        }
+        set_epp_profile(tiers[to].epp);
+    } else if (saved_epp[0] != '\0') {
+        set_epp_profile(saved_epp);
+        saved_epp[0] = '\0';
+    }
+}
+
+static notify_response_t notify_tier(int index) {
+    char message[128];
+    const policy_tier_t *tier = &tiers[index];
+    int critical = (tier_count > 1 && index == tier_count - 1) || (tier->actions & POLICY_ACTION_SUSPEND);
+
+    if (critical) {
+        log_message("Battery critically low, showing notification");
+        snprintf(message, sizeof(message), "Battery is critically low, below %d%%", tier->threshold);
+        return notifier->notify(message, "Critical Battery Warning");
+    }
+
+    log_message("Battery low, showing notification");
+    snprintf(message, sizeof(message), "Battery is low, below %d%%", tier->threshold);
+    return notifier->notify(message, "Low Battery Warning");
+}
+
+static notify_response_t apply_transition(int old_state, int new_state) {
+    unsigned int before = old_state >= 0 ? cumulative_actions[old_state] : 0;
+    unsigned int after = new_state >= 0 ? cumulative_actions[new_state] : 0;
+    unsigned int added = after & ~before;
+    unsigned int released = before & ~after;
+
+    char message[128];
+    snprintf(message, sizeof(message), "Policy tier %s -> %s",
+             old_state >= 0 ? tiers[old_state].name : "none",
+             new_state >= 0 ? tiers[new_state].name : "none");
+    log_message(message);
+
+    state = new_state;
+
+    // Saving mode, idle, the budget or thermal may still hold these
+    if (released & POLICY_ACTION_THROTTLE) {
+        release_throttle(HOLDER_POLICY);
+    }
+    if (released & POLICY_ACTION_FREEZE) {
+        release_freeze(HOLDER_POLICY);
+    }
+    if (added & POLICY_ACTION_THROTTLE) {
+        hold_throttle(HOLDER_POLICY);
+    }
+    if (added & POLICY_ACTION_FREEZE) {
+        hold_freeze(HOLDER_POLICY);
+    }
+    if (added & POLICY_ACTION_REFRESH) {
+        display_downshift(DISPLAY_HOLDER_POLICY);
+    } else if (released & POLICY_ACTION_REFRESH) {
+        display_restore(DISPLAY_HOLDER_POLICY);
+    }
+
+    apply_brightness(old_state, new_state);
+    apply_epp(old_state, new_state);
+
+    // Notifications and sleep fire once, on the way down
+    notify_response_t response = NOTIFY_RESPONSE_NONE;
+    if (new_state > old_state) {
+        unsigned int entered = 0;
+        for (int i = old_state + 1; i <= new_state; i++) {
+            entered |= tiers[i].actions;
+        }
+        // The dialog blocks until answered, so a sleeping tier does not show it
+        if (entered & POLICY_ACTION_SUSPEND) {
+            log_message("Entering a sleeping tier, skipping its notification");
+            enter_sleep_mode();
+        } else if (entered & POLICY_ACTION_NOTIFY) {
+            response = notify_tier(new_state);
+        }
+    }
+
+    return response;
+}
+
+notify_response_t policy_update(int battery_level) {
+    if (!compiled) {
+        policy_compile();
+    }
+
+    if (battery_level < 0) battery_level = 0;
+    if (battery_level > 100) battery_level = 100;
+
+    int new_state = next_state[state + 1][battery_level];
+    if (new_state == state) {
+        return NOTIFY_RESPONSE_NONE;
+    }
+    return apply_transition(state, new_state);
+}
+
+void policy_reset() {
+    if (state != -1) {
+        apply_transition(state, -1);
+    }
+}
+
+int policy_state() {
+    return state;
+}
+
+const policy_tier_t *policy_tier(int index) {
+    return index >= 0 && index < tier_count ? &tiers[index] : NULL;
+}
+
+int policy_tier_count() {
+    return tier_count;
+}
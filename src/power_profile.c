@@ -0,0 +1,73 @@
+// power_profile.c
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <glob.h>
+#include "power_profile.h"
+#include "log_message.h"
+#include "paths.h"
+
+#define EPP_PATTERN "%s/sys/devices/system/cpu/cpu[0-9]*/cpufreq/energy_performance_preference"
+
+int set_epp_profile(const char *profile) {
+    glob_t glob_result;
+    char pattern[PATH_MAX];
+
+    snprintf(pattern, sizeof(pattern), EPP_PATTERN, sysfs_root);
+
+    if (glob(pattern, 0, NULL, &glob_result) != 0) {
+        log_message("No CPU exposes energy_performance_preference");
+        globfree(&glob_result);
+        return -1;
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < glob_result.gl_pathc; i++) {
+        FILE *file = fopen(glob_result.gl_pathv[i], "w");
+        if (file == NULL || fputs(profile, file) == EOF) {
+            failures++;
+        }
+        if (file != NULL && fclose(file) == EOF) {
+            failures++;
+        }
+    }
+    globfree(&glob_result);
+
+    char message[128];
+    if (failures > 0) {
+        snprintf(message, sizeof(message), "Failed to set EPP profile %s on %d CPUs", profile, failures);
+        log_message(message);
+        return -1;
+    }
+
+    snprintf(message, sizeof(message), "Set EPP profile to %s", profile);
+    log_message(message);
+    return 0;
+}
+
+int get_epp_profile(char *buffer, size_t size) {
+    glob_t glob_result;
+    char pattern[PATH_MAX];
+
+    snprintf(pattern, sizeof(pattern), EPP_PATTERN, sysfs_root);
+
+    if (glob(pattern, 0, NULL, &glob_result) != 0) {
+        globfree(&glob_result);
+        return -1;
+    }
+
+    FILE *file = fopen(glob_result.gl_pathv[0], "r");
+    globfree(&glob_result);
+    if (file == NULL) {
+        return -1;
+    }
+
+    int result = -1;
+    if (fgets(buffer, size, file) != NULL) {
+        buffer[strcspn(buffer, "\n")] = '\0';
+        result = 0;
+    }
+    fclose(file);
+    return result;
+}
@@ -0,0 +1,344 @@
+// power_source.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <glob.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "battery_monitor.h"
+#include "backend.h"
+#include "event_loop.h"
+#include "log_message.h"
+#include "metrics.h"
+#include "paths.h"
+
+static char supply_name[64] = "";     // Configured supply, empty to pick one
+static char supply_dir[PATH_MAX] = "";  // Cached once found
+
+// Attributes sampled every period. Their files are opened once the supply
+// is found and re-read with pread(), like the thermal zones.
+enum {
+    ATTRIBUTE_CAPACITY,
+    ATTRIBUTE_STATUS,
+    ATTRIBUTE_ENERGY_NOW,
+    ATTRIBUTE_CHARGE_NOW,
+    ATTRIBUTE_POWER_NOW,
+    ATTRIBUTE_CURRENT_NOW,
+    ATTRIBUTE_VOLTAGE_NOW,
+    ATTRIBUTE_COUNT
+};
+
+static const char *attribute_names[ATTRIBUTE_COUNT] = {
+    "capacity", "status", "energy_now", "charge_now", "power_now", "current_now", "voltage_now"
+};
+static int attribute_fds[ATTRIBUTE_COUNT] = { -1, -1, -1, -1, -1, -1, -1 };
+static int attributes_open = 0;
+
+#define MAX_SUPPLY_PREFIXES 4
+#define MAX_SUPPLY_PREFIX 192
+
+// Read the first word of a supply attribute, -1 if missing
+static int read_supply_word(const char *dir, const char *file_name, char *word, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file_name);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int ok = fgets(word, size, file) != NULL;
+    fclose(file);
+    if (!ok) {
+        return -1;
+    }
+    word[strcspn(word, "\n")] = '\0';
+    return 0;
+}
+
+// Whether a supply powers this machine: a system battery or a UPS. Batteries of
+// peripherals such as mice have scope Device and are skipped.
+static int is_system_supply(const char *dir, int ups) {
+    char type[32], scope[32];
+    if (read_supply_word(dir, "type", type, sizeof(type)) == -1) {
+        // Old kernels and test trees without a type file
+        const char *name = strrchr(dir, '/');
+        return !ups && name != NULL && strncmp(name + 1, "BAT", 3) == 0;
+    }
+    if (strcmp(type, ups ? "UPS" : "Battery") != 0) {
+        return 0;
+    }
+    return read_supply_word(dir, "scope", scope, sizeof(scope)) == -1 || strcmp(scope, "Device") != 0;
+}
+
+// Find the configured supply, or the first system battery, or the first UPS
+static int find_supply() {
+    if (supply_name[0] != '\0') {
+        snprintf(supply_dir, sizeof(supply_dir), "%s/sys/class/power_supply/%s", sysfs_root, supply_name);
+        return access(supply_dir, F_OK) == 0 ? 0 : -1;
+    }
+
+    glob_t glob_result;
+    char pattern[PATH_MAX];
+    snprintf(pattern, sizeof(pattern), "%s/sys/class/power_supply/*", sysfs_root);
+
+    int found = -1;
+    if (glob(pattern, 0, NULL, &glob_result) == 0) {
+        for (int ups = 0; ups <= 1 && found == -1; ups++) {
+            for (size_t i = 0; i < glob_result.gl_pathc; i++) {
+                if (is_system_supply(glob_result.gl_pathv[i], ups)) {
+                    snprintf(supply_dir, sizeof(supply_dir), "%s", glob_result.gl_pathv[i]);
+                    found = 0;
+                    break;
+                }
+            }
+        }
+    }
+    globfree(&glob_result);
+    return found;
+}
+
+static void close_attributes() {
+    for (int i = 0; i < ATTRIBUTE_COUNT; i++) {
+        if (attribute_fds[i] >= 0) {
+            close(attribute_fds[i]);
+        }
+        attribute_fds[i] = -1;
+    }
+    attributes_open = 0;
+}
+
+// Find the supply if needed and open every attribute it has, once
+static int open_attributes() {
+    if (attributes_open) {
+        return 0;
+    }
+    if (supply_dir[0] == '\0' && find_supply() == -1) {
+        supply_dir[0] = '\0';
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    for (int i = 0; i < ATTRIBUTE_COUNT; i++) {
+        snprintf(path, sizeof(path), "%s/%s", supply_dir, attribute_names[i]);
+        attribute_fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    attributes_open = 1;
+    return 0;
+}
+
+// Re-read one attribute through its cached descriptor, -1 if the supply
+// does not have it. A supply that went away, e.g. an unplugged USB UPS, is
+// looked for again on the next read.
+static int read_attribute(int attribute, char *buffer, size_t size) {
+    if (open_attributes() == -1 || attribute_fds[attribute] < 0) {
+        return -1;
+    }
+
+    ssize_t length = pread(attribute_fds[attribute], buffer, size - 1, 0);
+    if (length == -1 && (errno == ENODEV || errno == ENOENT)) {
+        close_attributes();
+        supply_dir[0] = '\0';
+        return -1;
+    }
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    return 0;
+}
+
+// Function to get the battery level
+int get_battery_level() {
+    double start = metrics_now();
+    char buffer[32];
+    if (read_attribute(ATTRIBUTE_CAPACITY, buffer, sizeof(buffer)) == -1) {
+        log_message("Failed to read battery capacity");
+        return -1;
+    }
+
+    int battery_level;
+    if (sscanf(buffer, "%d", &battery_level) != 1) {
+        log_message("Failed to read battery level");
+        return -1;
+    }
+
+    metrics_observe(METRIC_SAMPLE_LATENCY, metrics_now() - start);
+    return battery_level;
+}
+
+// Read a single numeric battery attribute, -1 if the battery does not report it
+static long read_battery_value(int attribute) {
+    char buffer[32];
+    long value;
+    if (read_attribute(attribute, buffer, sizeof(buffer)) == -1 || sscanf(buffer, "%ld", &value) != 1) {
+        return -1;
+    }
+    return value;
+}
+
+// Function to get the remaining energy in uWh
+long get_battery_energy() {
+    long energy = read_battery_value(ATTRIBUTE_ENERGY_NOW);
+    if (energy >= 0) {
+        return energy;
+    }
+
+    // Charge-based batteries report uAh, convert with the current voltage (uV)
+    long charge = read_battery_value(ATTRIBUTE_CHARGE_NOW);
+    long voltage = read_battery_value(ATTRIBUTE_VOLTAGE_NOW);
+    if (charge < 0 || voltage < 0) {
+        return -1;
+    }
+    return (long)((double)charge * voltage / 1000000.0);
+}
+
+// Function to get the current power draw in uW
+long get_battery_power() {
+    long power = read_battery_value(ATTRIBUTE_POWER_NOW);
+    if (power >= 0) {
+        return power;
+    }
+
+    long current = read_battery_value(ATTRIBUTE_CURRENT_NOW);
+    long voltage = read_battery_value(ATTRIBUTE_VOLTAGE_NOW);
+    if (current < 0 || voltage < 0) {
+        return -1;
+    }
+    return (long)((double)current * voltage / 1000000.0);
+}
+
+// Function to check if the battery is charging
+int is_charging() {
+    double start = metrics_now();
+    char buffer[32];
+    if (read_attribute(ATTRIBUTE_STATUS, buffer, sizeof(buffer)) == -1) {
+        log_message("Failed to read battery status");
+        return -1;
+    }
+
+    char status[16];
+    if (sscanf(buffer, "%15s", status) != 1) {
+        log_message("Failed to read battery status");
+        return -1;
+    }
+
+    metrics_observe(METRIC_SAMPLE_LATENCY, metrics_now() - start);
+    // A full battery or a UPS on line power reports Full or "Not charging",
+    // which reads as its first word
+    return (strcmp(status, "Charging") == 0 || strcmp(status, "Full") == 0 || strcmp(status, "Not") == 0);
+}
+
+// Power supply uevents: re-sample as soon as the charger or the UPS input changes
+static void handle_uevent(int fd, void *data) {
+    (void)data;
+    char buffer[4096];
+    int changed = 0;
+    ssize_t length;
+
+    while ((length = recv(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT)) > 0) {
+        buffer[length] = '\0';
+        for (char *p = buffer; p < buffer + length; p += strlen(p) + 1) {
+            if (strcmp(p, "SUBSYSTEM=power_supply") == 0) {
+                changed = 1;
+            }
+        }
+    }
+
+    if (changed) {
+        event_loop_interrupt();
+    }
+}
+
+static int sysfs_open(const char *address) {
+    snprintf(supply_name, sizeof(supply_name), "%s", address != NULL ? address : "");
+    close_attributes();
+    supply_dir[0] = '\0';
+
+    char message[PATH_MAX + 64];
+    if (find_supply() == -1) {
+        log_message("No battery or UPS found under /sys/class/power_supply");
+        return -1;
+    }
+    snprintf(message, sizeof(message), "Reading power supply %s", supply_dir);
+    log_message(message);
+    return 0;
+}
+
+// Uevent prefixes of the power supply directories, e.g.
+// "change@/devices/.../PNP0C0A:00/power_supply/". They cover the battery,
+// the AC adapter and any later supply below the same parent.
+static int supply_uevent_prefixes(char prefixes[][MAX_SUPPLY_PREFIX], int max_prefixes) {
+    glob_t glob_result;
+    char pattern[PATH_MAX];
+    char sys_root[PATH_MAX];
+    snprintf(pattern, sizeof(pattern), "%s/sys/class/power_supply/*", sysfs_root);
+    snprintf(sys_root, sizeof(sys_root), "%s/sys", sysfs_root);
+
+    int count = 0;
+    if (glob(pattern, 0, NULL, &glob_result) == 0) {
+        for (size_t i = 0; i < glob_result.gl_pathc && count < max_prefixes; i++) {
+            char device[PATH_MAX];
+            if (realpath(glob_result.gl_pathv[i], device) == NULL ||
+                strncmp(device, sys_root, strlen(sys_root)) != 0) {
+                continue;
+            }
+            char *name = strrchr(device, '/');
+            if (name == NULL) {
+                continue;
+            }
+            name[1] = '\0';
+
+            char prefix[MAX_SUPPLY_PREFIX];
+            if (snprintf(prefix, sizeof(prefix), "change@%s", device + strlen(sys_root)) >= (int)sizeof(prefix)) {
+                continue;
+            }
+            int seen = 0;
+            for (int j = 0; j < count; j++) {
+                seen |= strcmp(prefixes[j], prefix) == 0;
+            }
+            if (!seen) {
+                snprintf(prefixes[count++], MAX_SUPPLY_PREFIX, "%s", prefix);
+            }
+        }
+    }
+    globfree(&glob_result);
+    return count;
+}
+
+static int sysfs_watch(void) {
+    char prefixes[MAX_SUPPLY_PREFIXES][MAX_SUPPLY_PREFIX];
+    const char *filters[MAX_SUPPLY_PREFIXES];
+    int count = supply_uevent_prefixes(prefixes, MAX_SUPPLY_PREFIXES);
+    if (count == 0) {
+        // Nothing to narrow down to yet, at least skip adds, removes and binds
+        snprintf(prefixes[count++], MAX_SUPPLY_PREFIX, "change@/devices/");
+    }
+    for (int i = 0; i < count; i++) {
+        filters[i] = prefixes[i];
+    }
+
+    int fd = event_loop_open_uevents(filters, count);
+    if (fd == -1 || event_loop_add_fd(fd, handle_uevent, NULL) == -1) {
+        log_message("Failed to listen for power supply events, sampling only");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Power source backend reading a battery or UPS under /sys/class/power_supply
+const power_source_backend_t sysfs_power_source = {
+    "sysfs",
+    get_battery_level,
+    is_charging,
+    get_battery_energy,
+    get_battery_power,
+    sysfs_open,
+    sysfs_watch,
+};
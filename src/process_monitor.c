@@ -9,27 +9,73 @@
 #include <stdbool.h>
 #include <signal.h>
 #include "process_monitor.h"
+#include "process_tree.h"
+#include "wakeups.h"
 #include "log_message.h"
+#include "metrics.h"
+#include "paths.h"
+#include <limits.h>
 #include <dirent.h>
 #include <pwd.h>
+#include <grp.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <errno.h>
 
 #define BUFFER_SIZE 1024
 #define CONFIG_FILE "/.config/battery_monitor/config.conf"
 #define MAX_CRITICAL_PROCESSES 100
 #define MAX_IGNORE_PROCESSES 100
 #define MAX_SUSPENDED_PROCESSES 1024
+#define MAX_MANAGED_USERS 64
 
 pid_t suspended_pids[MAX_SUSPENDED_PROCESSES];
 int suspended_count = 0;
 pid_t suspended_high_cpu_pids[MAX_SUSPENDED_PROCESSES];
 int suspended_high_cpu_count = 0;
 
+// Processes reniced by throttle_high_cpu_processes() and their original nice values
+static pid_t throttled_pids[MAX_SUSPENDED_PROCESSES];
+static int throttled_nice[MAX_SUSPENDED_PROCESSES];
+static int throttled_count = 0;
+
+// Users whose processes are managed in system mode. Outside system mode
+// only the current user is; in system mode with no sessions, nobody is.
+static uid_t managed_uids[MAX_MANAGED_USERS];
+static int managed_count = 0;
+static bool system_mode_users = false;
+
+#ifdef BATTERY_MONITOR_TESTING
+static pid_t test_scope_parent = 0;
+
+void set_test_scope(pid_t parent) {
+    test_scope_parent = parent;
+}
+
+// Inside a test scope only the scope's children are candidates, whoever runs the test
+#define TEST_SCOPE_ACTIVE (test_scope_parent != 0)
+#else
+#define TEST_SCOPE_ACTIVE 0
+#endif
+
+// Ignore list of one user, loaded once per scan
+typedef struct {
+    uid_t uid;
+    char *ignore_list[MAX_IGNORE_PROCESSES];
+    int ignore_count;
+} user_ignore_t;
+
+typedef void (*high_cpu_action_t)(process_tree_t *tree, pid_t pid, const char *command_name, float cpu_usage);
+
 bool dry_run = true;  // Set to 'true' for dry run, 'false' for normal operation
 
 // CPU usage threshold to consider a process as high CPU-consuming
 #define CPU_USAGE_THRESHOLD 1.0
 
+// Nice value applied to throttled processes
+#define THROTTLE_NICE 19
+
 // List of default critical processes (expanded with more essential processes)
 const char *default_critical_processes[] = {
     "systemd", "Xorg", "dbus-daemon", "NetworkManager", "dwm", "DWM",
@@ -61,6 +107,87 @@ void output_message(const char *message) {
     }
 }
 
+// How long to watch for a signalled process to actually stop or continue
+#define SIGNAL_CONFIRM_SECONDS 0.5
+#define SIGNAL_CONFIRM_POLL_US 200
+
+// Processes signalled since the last confirm_signals(), with the send time
+static pid_t pending_pids[MAX_SUSPENDED_PROCESSES];
+static double pending_sent[MAX_SUSPENDED_PROCESSES];
+static int pending_count = 0;
+
+// Send SIGSTOP/SIGCONT and remember when, so confirm_signals() can time the transition
+static int send_signal(pid_t pid, int sig) {
+    double sent = metrics_now();
+    int result = kill(pid, sig);
+    if (result == 0 && pending_count < MAX_SUSPENDED_PROCESSES) {
+        pending_pids[pending_count] = pid;
+        pending_sent[pending_count] = sent;
+        pending_count++;
+    }
+    return result;
+}
+
+// Scheduler state letter of a process from /proc/<pid>/stat, 0 if it is gone
+static char read_process_state(pid_t pid) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/proc/%d/stat", procfs_root, pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char buffer[BUFFER_SIZE];
+    size_t length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    fclose(file);
+    buffer[length] = '\0';
+
+    // The command name may contain spaces and parentheses, the state follows the last ')'
+    char *end = strrchr(buffer, ')');
+    return end != NULL && end[1] == ' ' ? end[2] : 0;
+}
+
+// Wait until every pending process is seen stopped (SIGSTOP) or running
+// again (SIGCONT), and record the time from its signal to that point.
+// Processes that exit, or do not change within the deadline, are not recorded.
+static void confirm_signals(int sig) {
+    metric_histogram_t histogram = sig == SIGCONT ? METRIC_THAW_LATENCY : METRIC_FREEZE_LATENCY;
+    double deadline = metrics_now() + SIGNAL_CONFIRM_SECONDS;
+
+    while (pending_count > 0) {
+        for (int i = 0; i < pending_count; ) {
+            char state = read_process_state(pending_pids[i]);
+            int stopped = state == 'T' || state == 't';
+            if (state == 0 || state == 'Z' || stopped == (sig == SIGSTOP)) {
+                if (state != 0 && state != 'Z') {
+                    metrics_observe(histogram, metrics_now() - pending_sent[i]);
+                }
+                pending_count--;
+                pending_pids[i] = pending_pids[pending_count];
+                pending_sent[i] = pending_sent[pending_count];
+            } else {
+                i++;
+            }
+        }
+        if (pending_count == 0 || metrics_now() >= deadline) {
+            break;
+        }
+        usleep(SIGNAL_CONFIRM_POLL_US);
+    }
+
+    if (pending_count > 0) {
+        char message[128];
+        snprintf(message, sizeof(message), "%d processes did not %s within %.1f seconds", pending_count,
+                 sig == SIGCONT ? "continue" : "stop", SIGNAL_CONFIRM_SECONDS);
+        log_message(message);
+        pending_count = 0;
+    }
+}
+
+static void update_suspended_gauge() {
+    metrics_set(METRIC_SUSPENDED_TASKS, suspended_count + suspended_high_cpu_count);
+}
+
 // Helper function to remove leading/trailing whitespace
 static char *trim_whitespace(char *str) {
     char *end;
@@ -92,6 +219,18 @@ void build_critical_processes_list(char *critical_list[], int *count) {
     *count = index;
 }
 
+// Build the config file path under a home directory
+static char *build_config_file_path(const char *home_dir) {
+    size_t path_len = strlen(home_dir) + strlen(CONFIG_FILE) + 1;
+    char *config_file_path = malloc(path_len);
+    if (config_file_path != NULL) {
+        strcpy(config_file_path, home_dir);
+        strcat(config_file_path, CONFIG_FILE);
+    }
+
+    return config_file_path;
+}
+
 // Function to dynamically get the user's home directory and build the config file path
 char *get_config_file_path() {
     const char *home_dir = getenv("HOME");
@@ -100,19 +239,44 @@ char *get_config_file_path() {
         return NULL;
     }
 
-    size_t path_len = strlen(home_dir) + strlen(CONFIG_FILE) + 1;
-    char *config_file_path = malloc(path_len);
-    if (config_file_path != NULL) {
-        strcpy(config_file_path, home_dir);
-        strcat(config_file_path, CONFIG_FILE);
+    return build_config_file_path(home_dir);
+}
+
+// Open another user's config file with that user's permissions, so the
+// system daemon cannot be pointed at root's files through a symlink
+static FILE *open_user_config(const char *path, const struct passwd *owner) {
+    gid_t groups[NGROUPS_MAX];
+    int group_count = getgroups(NGROUPS_MAX, groups);
+    if (group_count == -1 || setgroups(1, &owner->pw_gid) == -1) {
+        return NULL;
     }
 
-    return config_file_path;
+    int fd = -1;
+    if (setegid(owner->pw_gid) == 0 && seteuid(owner->pw_uid) == 0) {
+        fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (seteuid(0) == -1 || setegid(0) == -1 || setgroups(group_count, groups) == -1) {
+        // Never carry on with a half-restored identity
+        perror("Failed to restore root credentials");
+        abort();
+    }
+
+    struct stat st;
+    if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != owner->pw_uid)) {
+        close(fd);
+        fd = -1;
+    }
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "r");
+    if (file == NULL && fd != -1) {
+        close(fd);
+    }
+    return file;
 }
 
-// Function to parse the ignore list from the config file
-int get_ignore_processes(char *ignore_list[], int max_ignores, const char *config_key) {
-    char *config_file_path = get_config_file_path();
+// Parse an ignore list from one config file, followed by the default critical
+// processes. With an owner, the file is another user's and read as that user.
+static int read_ignore_processes(char *config_file_path, const struct passwd *owner, char *ignore_list[],
+                                 int max_ignores, const char *config_key) {
     if (config_file_path == NULL) {
         output_message("Could not determine the config file path");
         // Proceed with default critical processes
@@ -121,7 +285,8 @@ int get_ignore_processes(char *ignore_list[], int max_ignores, const char *confi
         return ignore_count;
     }
 
-    FILE *config_file = fopen(config_file_path, "r");
+    FILE *config_file = owner != NULL && geteuid() == 0 ? open_user_config(config_file_path, owner)
+                                                        : fopen(config_file_path, "r");
     free(config_file_path);
 
     int ignore_count = 0;
@@ -159,6 +324,60 @@ int get_ignore_processes(char *ignore_list[], int max_ignores, const char *confi
     return ignore_count;
 }
 
+// Function to parse the ignore list from the config file
+int get_ignore_processes(char *ignore_list[], int max_ignores, const char *config_key) {
+    return read_ignore_processes(get_config_file_path(), NULL, ignore_list, max_ignores, config_key);
+}
+
+// Same as get_ignore_processes(), but from another user's config file
+int get_user_ignore_processes(uid_t uid, char *ignore_list[], int max_ignores, const char *config_key) {
+    struct passwd *pw = getpwuid(uid);
+    return read_ignore_processes(pw != NULL ? build_config_file_path(pw->pw_dir) : NULL, pw,
+                                 ignore_list, max_ignores, config_key);
+}
+
+void set_managed_users(const uid_t *uids, int count) {
+    system_mode_users = true;
+    managed_count = 0;
+    for (int i = 0; i < count && managed_count < MAX_MANAGED_USERS; i++) {
+        managed_uids[managed_count++] = uids[i];
+    }
+}
+
+// Load the ignore lists of every managed user, or of the current user outside system mode
+static int load_user_ignores(user_ignore_t *users, const char *config_key) {
+    if (!system_mode_users) {
+        users[0].uid = getuid();
+        users[0].ignore_count = get_ignore_processes(users[0].ignore_list, MAX_IGNORE_PROCESSES, config_key);
+        return 1;
+    }
+
+    for (int i = 0; i < managed_count; i++) {
+        users[i].uid = managed_uids[i];
+        users[i].ignore_count = get_user_ignore_processes(managed_uids[i], users[i].ignore_list,
+                                                          MAX_IGNORE_PROCESSES, config_key);
+    }
+    return managed_count;
+}
+
+static void free_user_ignores(user_ignore_t *users, int count) {
+    for (int u = 0; u < count; u++) {
+        for (int i = 0; i < users[u].ignore_count; i++) {
+            free(users[u].ignore_list[i]);
+        }
+    }
+}
+
+// Ignore list that applies to a process owner, NULL if the owner is not managed
+static const user_ignore_t *find_user_ignores(const user_ignore_t *users, int count, uid_t uid) {
+    for (int i = 0; i < count; i++) {
+        if (users[i].uid == uid) {
+            return &users[i];
+        }
+    }
+    return NULL;
+}
+
 // Function to check if a process is critical (case-insensitive check)
 int is_process_critical(const char *process_name, char *ignore_list[], int ignore_count) {
     for (int i = 0; i < ignore_count; i++) {
@@ -169,15 +388,126 @@ int is_process_critical(const char *process_name, char *ignore_list[], int ignor
     return 0;
 }
 
-// Main function to run battery saving mode
-int run_battery_saving_mode(pid_t current_pid) {
-    output_message("Running battery saving mode in process_monitor");
+// Whether a collected subtree of count processes can be recorded next to
+// the already suspended ones. A full buffer may have cut the subtree short.
+static bool fits_whole(int count, int suspended) {
+    return count < MAX_SUSPENDED_PROCESSES && suspended + count <= MAX_SUSPENDED_PROCESSES;
+}
 
+// Suspend one high CPU process with its subtree, or its whole terminal job,
+// and remember them for resume_high_cpu_processes()
+static void suspend_high_cpu_process(process_tree_t *tree, pid_t pid, const char *command_name, float cpu_usage) {
+    int index = process_tree_find(tree, pid);
+    if (index == -1 || tree->nodes[index].frozen) {
+        return;  // Exited since the scan, or stopped with an ancestor
+    }
+
+    char message[512];
+    snprintf(message, sizeof(message), "Process to be suspended: %s (PID: %d, CPU Usage: %.2f%%)", command_name, pid, cpu_usage);
+    output_message(message);
+    if (tree->nodes[index].keep) {
+        snprintf(message, sizeof(message), "Skipping %s (PID: %d): a protected process depends on it", command_name, pid);
+        output_message(message);
+        return;
+    }
+
+    static pid_t pids[MAX_SUSPENDED_PROCESSES];
+    int count = process_tree_is_job(&tree->nodes[index])
+                    ? process_tree_collect_group(tree, tree->nodes[index].pgrp, pids, MAX_SUSPENDED_PROCESSES)
+                    : process_tree_collect(tree, index, pids, MAX_SUSPENDED_PROCESSES);
+
+    // A subtree is stopped whole or not at all, never just its leaves
+    if (!dry_run && !fits_whole(count, suspended_high_cpu_count)) {
+        output_message("Maximum suspended processes limit reached.");
+        return;
+    }
+
+    // Children are stopped before their parents
+    for (int i = 0; i < count; i++) {
+        if (dry_run) {
+            snprintf(message, sizeof(message), "Dry run mode active: Would suspend process %s (PID: %d)", command_name, pids[i]);
+            output_message(message);
+        } else if (send_signal(pids[i], SIGSTOP) == -1) {
+            perror("Failed to suspend process");
+            output_message("Failed to suspend process");
+        } else {
+            suspended_high_cpu_pids[suspended_high_cpu_count++] = pids[i];
+            output_message("Process suspended successfully");
+        }
+    }
+}
+
+// Lower the priority of one high CPU process and remember its old nice value
+static void throttle_high_cpu_process(process_tree_t *tree, pid_t pid, const char *command_name, float cpu_usage) {
+    (void)tree;
+    char message[512];
+
+    for (int i = 0; i < throttled_count; i++) {
+        if (throttled_pids[i] == pid) {
+            return;  // Already throttled
+        }
+    }
+
+    if (dry_run) {
+        snprintf(message, sizeof(message), "Dry run mode active: Would throttle process %s (PID: %d, CPU Usage: %.2f%%)", command_name, pid, cpu_usage);
+        output_message(message);
+        return;
+    }
+
+    if (throttled_count >= MAX_SUSPENDED_PROCESSES) {
+        output_message("Maximum throttled processes limit reached.");
+        return;
+    }
+
+    errno = 0;
+    int old_nice = getpriority(PRIO_PROCESS, pid);
+    if (errno != 0 || setpriority(PRIO_PROCESS, pid, THROTTLE_NICE) == -1) {
+        perror("Failed to throttle process");
+        output_message("Failed to throttle process");
+        return;
+    }
+
+    throttled_pids[throttled_count] = pid;
+    throttled_nice[throttled_count] = old_nice;
+    throttled_count++;
+
+    snprintf(message, sizeof(message), "Throttled process %s (PID: %d, CPU Usage: %.2f%%)", command_name, pid, cpu_usage);
+    output_message(message);
+}
+
+// Mark what must keep running: processes of unmanaged users, critical
+// processes, the daemon itself, interactive shells and, for daemon
+// suspension, anything with a terminal. process_tree_protect() then extends
+// this to their ancestors, so the terminal emulator a shell runs in is kept
+// too. Jobs started from a shell are still fair game.
+static void mark_protected(process_tree_t *tree, const user_ignore_t *users, int user_count, bool keep_terminals) {
+    pid_t self = getpid();
+
+    for (int i = 0; i < tree->count; i++) {
+        process_node_t *node = &tree->nodes[i];
+        const user_ignore_t *ignores = find_user_ignores(users, user_count, node->uid);
+
+        node->keep = node->uid == 0 || ignores == NULL || node->pid == self ||
+                     (node->tty_nr != 0 && (keep_terminals || node->pid == node->session)) ||
+                     is_process_critical(node->comm, (char **)ignores->ignore_list, ignores->ignore_count);
+#ifdef BATTERY_MONITOR_TESTING
+        if (TEST_SCOPE_ACTIVE) {
+            node->keep = node->ppid != test_scope_parent;
+        }
+#endif
+    }
+    process_tree_protect(tree);
+}
+
+// Apply an action to every non-root, non-critical process above the CPU usage threshold.
+// With a tree, processes that a protected process depends on are marked in it, and
+// processes that wake the CPU too often are suspended however little CPU they use.
+static int scan_high_cpu_processes(pid_t current_pid, high_cpu_action_t action, process_tree_t *tree) {
     FILE *fp;
     char buffer[BUFFER_SIZE];
 
     // Command to get high CPU-consuming processes excluding root processes
-    const char *command = "ps -eo user:32,pid,pcpu,comm --no-headers --sort=-pcpu";
+    const char *command = "ps -eo uid,pid,pcpu,comm --no-headers --sort=-pcpu";
 
     fp = popen(command, "r");
     if (fp == NULL) {
@@ -185,13 +515,11 @@ int run_battery_saving_mode(pid_t current_pid) {
         return -1;
     }
 
-    // Load ignore processes from config file
-    char *ignore_list[MAX_IGNORE_PROCESSES];
-    int ignore_count = get_ignore_processes(ignore_list, MAX_IGNORE_PROCESSES, "ignore_processes_for_kill");
-    if (ignore_count == -1) {
-        output_message("Failed to get ignore processes");
-        pclose(fp);
-        return -1;
+    // Load ignore processes from the config file of every managed user
+    static user_ignore_t users[MAX_MANAGED_USERS];
+    int user_count = load_user_ignores(users, "ignore_processes_for_kill");
+    if (tree != NULL) {
+        mark_protected(tree, users, user_count, false);
     }
 
     // Process the list and handle processes accordingly
@@ -204,21 +532,27 @@ int run_battery_saving_mode(pid_t current_pid) {
             continue;
         }
 
-        char user[33];  // +1 for null terminator
+        unsigned int uid;
         char command_name[256];
         int pid;
         float cpu_usage;
 
-        int items = sscanf(line, "%32s %d %f %255[^\n]", user, &pid, &cpu_usage, command_name);
+        int items = sscanf(line, "%u %d %f %255[^\n]", &uid, &pid, &cpu_usage, command_name);
 
         if (items == 4) {
             // Exclude root processes
-            if (strcmp(user, "root") == 0) {
+            if (uid == 0 && !TEST_SCOPE_ACTIVE) {
+                continue;
+            }
+
+            // In system mode only session users are managed, each with their own list
+            const user_ignore_t *ignores = system_mode_users ? find_user_ignores(users, user_count, uid) : &users[0];
+            if (ignores == NULL) {
                 continue;
             }
 
             // Exclude processes with CPU usage below threshold
-            if (cpu_usage < CPU_USAGE_THRESHOLD) {
+            if (cpu_usage < CPU_USAGE_THRESHOLD && (tree == NULL || !wakeups_is_victim(pid, command_name))) {
                 continue;
             }
 
@@ -227,29 +561,8 @@ int run_battery_saving_mode(pid_t current_pid) {
                 continue;
             }
 
-            if (!is_process_critical(command_name, ignore_list, ignore_count)) {
-                char message[512];
-                snprintf(message, sizeof(message), "Process to be suspended: %s (PID: %d, CPU Usage: %.2f%%)", command_name, pid, cpu_usage);
-                output_message(message);
-
-                if (dry_run) {
-                    snprintf(message, sizeof(message), "Dry run mode active: Would suspend process %s (PID: %d)", command_name, pid);
-                    output_message(message);
-                } else {
-                    // Suspend the process
-                    if (kill(pid, SIGSTOP) == -1) {
-                        perror("Failed to suspend process");
-                        output_message("Failed to suspend process");
-                    } else {
-                        // Add to the list of suspended processes
-                        if (suspended_high_cpu_count < MAX_SUSPENDED_PROCESSES) {
-                            suspended_high_cpu_pids[suspended_high_cpu_count++] = pid;
-                            output_message("Process suspended successfully");
-                        } else {
-                            output_message("Maximum suspended processes limit reached.");
-                        }
-                    }
-                }
+            if (!is_process_critical(command_name, (char **)ignores->ignore_list, ignores->ignore_count)) {
+                action(tree, pid, command_name, cpu_usage);
             } else {
                 char message[512];
                 snprintf(message, sizeof(message), "Skipping critical process: %s (PID: %d)", command_name, pid);
@@ -261,145 +574,154 @@ int run_battery_saving_mode(pid_t current_pid) {
     }
 
     // Clean up
-    for (int i = 0; i < ignore_count; i++) {
-        free(ignore_list[i]);
-    }
+    free_user_ignores(users, user_count);
 
     pclose(fp);
     return 0;
 }
 
+// Main function to run battery saving mode
+int run_battery_saving_mode(pid_t current_pid) {
+    output_message("Running battery saving mode in process_monitor");
+
+    process_tree_t tree = { 0 };
+    int result = process_tree_scan(&tree);
+    if (result == 0) {
+        result = scan_high_cpu_processes(current_pid, suspend_high_cpu_process, &tree);
+        confirm_signals(SIGSTOP);
+    }
+    process_tree_free(&tree);
+    update_suspended_gauge();
+    return result;
+}
+
+int throttle_high_cpu_processes(pid_t current_pid) {
+    output_message("Throttling high CPU processes");
+    return scan_high_cpu_processes(current_pid, throttle_high_cpu_process, NULL);
+}
+
+int unthrottle_processes() {
+    for (int i = 0; i < throttled_count; i++) {
+        pid_t pid = throttled_pids[i];
+
+        if (setpriority(PRIO_PROCESS, pid, throttled_nice[i]) == 0) {
+            output_message("Restored priority of throttled process");
+        } else {
+            // Unprivileged users may not lower the nice value again
+            perror("Failed to restore process priority");
+            output_message("Failed to restore process priority");
+        }
+    }
+    throttled_count = 0;
+    return 0;
+}
+
 int resume_high_cpu_processes() {
-    for (int i = 0; i < suspended_high_cpu_count; i++) {
+    // Parents were stopped last, resume them first
+    for (int i = suspended_high_cpu_count - 1; i >= 0; i--) {
         pid_t pid = suspended_high_cpu_pids[i];
 
         if (dry_run) {
             printf("Dry run: Would resume high CPU process PID: %d\n", pid);
         } else {
-            if (kill(pid, SIGCONT) == 0) {
+            if (send_signal(pid, SIGCONT) == 0) {
                 output_message("Resumed high CPU process");
             } else {
                 perror("Failed to resume high CPU process");
             }
         }
     }
+    confirm_signals(SIGCONT);
     suspended_high_cpu_count = 0;  // Reset the count after resuming
+    update_suspended_gauge();
     return 0;
 }
 
+// Stop whole subtrees of terminal-less user processes that nothing protected
+// depends on, leaves first
 int suspend_user_daemons() {
-    DIR *proc_dir = opendir("/proc");
-    if (proc_dir == NULL) {
-        perror("Failed to open /proc directory");
-        return -1;
-    }
-
-    struct dirent *entry;
-    uid_t uid = getuid();  // Get the UID of the current user
+    double scan_start = metrics_now();
 
-    // Load ignore processes from config file for suspending daemons
-    char *ignore_list[MAX_IGNORE_PROCESSES];
-    int ignore_count = get_ignore_processes(ignore_list, MAX_IGNORE_PROCESSES, "ignore_processes_for_sleep");
-    if (ignore_count == -1) {
-        output_message("Failed to get ignore processes");
-        closedir(proc_dir);
+    process_tree_t tree = { 0 };
+    if (process_tree_scan(&tree) == -1) {
+        process_tree_free(&tree);
         return -1;
     }
 
-    while ((entry = readdir(proc_dir)) != NULL) {
-        if (!isdigit(entry->d_name[0]))
-            continue;
-
-        pid_t pid = atoi(entry->d_name);
-        if (pid == getpid())  // Skip current process
-            continue;
+    // Load ignore processes for suspending daemons, per managed user
+    static user_ignore_t users[MAX_MANAGED_USERS];
+    int user_count = load_user_ignores(users, "ignore_processes_for_sleep");
+    mark_protected(&tree, users, user_count, true);
 
-        char status_file[256];
-        snprintf(status_file, sizeof(status_file), "/proc/%d/stat", pid);
+    static pid_t pids[MAX_SUSPENDED_PROCESSES];
+    bool limit_logged = false;
+    for (int i = 0; i < tree.count; i++) {
+        process_node_t *node = &tree.nodes[i];
 
-        FILE *status_fp = fopen(status_file, "r");
-        if (status_fp == NULL)
+        if (node->keep) {
+            // Log that we are skipping a critical process
+            if (dry_run && node->tty_nr == 0 && find_user_ignores(users, user_count, node->uid) != NULL) {
+                printf("Skipping protected process: PID: %d (%s)\n", node->pid, node->comm);
+            }
             continue;
-
-        char comm[256];
-        char state;
-        int ppid, pgrp, session;
-        unsigned int tty_nr;
-        uid_t proc_uid = -1;
-
-        // Read necessary fields from /proc/[pid]/stat
-        fscanf(status_fp, "%*d (%255[^)]) %c %d %d %d %u", comm, &state, &ppid, &pgrp, &session, &tty_nr);
-        fclose(status_fp);
-
-        // Get UID of the process owner
-        char proc_status_file[256];
-        snprintf(proc_status_file, sizeof(proc_status_file), "/proc/%d/status", pid);
-
-        FILE *proc_status_fp = fopen(proc_status_file, "r");
-        if (proc_status_fp == NULL)
+        }
+        // Each unprotected subtree is stopped once, from its topmost process
+        if (node->parent != -1 && !tree.nodes[node->parent].keep) {
             continue;
+        }
 
-        char line[256];
-        while (fgets(line, sizeof(line), proc_status_fp)) {
-            if (strncmp(line, "Uid:", 4) == 0) {
-                sscanf(line, "Uid:\t%u", &proc_uid);
-                break;
+        // Subtrees that no longer fit are left running whole, smaller ones may still fit
+        int count = process_tree_collect(&tree, i, pids, MAX_SUSPENDED_PROCESSES);
+        if (!dry_run && !fits_whole(count, suspended_count)) {
+            if (!limit_logged) {
+                output_message("Maximum suspended processes limit reached.");
+                limit_logged = true;
             }
+            continue;
         }
-        fclose(proc_status_fp);
-
-        // Check if process is owned by the user and has no controlling terminal
-        if (proc_uid == uid && tty_nr == 0) {
-            // Check if process is not critical
-            if (!is_process_critical(comm, ignore_list, ignore_count)) {
-                if (dry_run) {
-                    printf("Dry run: Would suspend process PID: %d (%s)\n", pid, comm);
-                } else {
-                    if (suspended_count < MAX_SUSPENDED_PROCESSES) {
-                        if (kill(pid, SIGSTOP) == 0) {
-                            suspended_pids[suspended_count++] = pid;
-                            output_message("Suspended process");
-                        } else {
-                            perror("Failed to suspend process");
-                        }
-                    } else {
-                        output_message("Maximum suspended processes limit reached.");
-                        break;
-                    }
-                }
+        for (int j = 0; j < count; j++) {
+            if (dry_run) {
+                printf("Dry run: Would suspend process PID: %d\n", pids[j]);
+            } else if (send_signal(pids[j], SIGSTOP) == 0) {
+                suspended_pids[suspended_count++] = pids[j];
+                output_message("Suspended process");
             } else {
-                // Log that we are skipping a critical process
-                if (dry_run) {
-                    printf("Skipping critical process: PID: %d (%s)\n", pid, comm);
-                }
+                perror("Failed to suspend process");
             }
         }
     }
 
-    // Free ignore_list
-    for (int i = 0; i < ignore_count; i++) {
-        free(ignore_list[i]);
-    }
+    confirm_signals(SIGSTOP);
+
+    // Free the ignore lists
+    free_user_ignores(users, user_count);
 
-    closedir(proc_dir);
+    metrics_observe(METRIC_PROC_SCAN_DURATION, metrics_now() - scan_start);
+    metrics_add(METRIC_PROCESSES_SCANNED, tree.count);
+    metrics_set(METRIC_LAST_SCAN_PROCESSES, tree.count);
+    process_tree_free(&tree);
+    update_suspended_gauge();
     return 0;
 }
 
 int resume_user_daemons() {
-    for (int i = 0; i < suspended_count; i++) {
+    // Parents were stopped last, resume them first
+    for (int i = suspended_count - 1; i >= 0; i--) {
         pid_t pid = suspended_pids[i];
 
         if (dry_run) {
             printf("Dry run: Would resume process PID: %d\n", pid);
         } else {
-            if (kill(pid, SIGCONT) == 0) {
+            if (send_signal(pid, SIGCONT) == 0) {
                 output_message("Resumed process");
             } else {
                 perror("Failed to resume process");
             }
         }
     }
+    confirm_signals(SIGCONT);
     suspended_count = 0;  // Reset the count after resuming
+    update_suspended_gauge();
     return 0;
 }
 
@@ -0,0 +1,296 @@
+// process_tree.c
+//
+// A snapshot of /proc as a graph. Freezing a parent while its children
+// keep running, or one stage of a shell pipeline while the rest of the job
+// waits on it, hangs the survivors. The scanners therefore mark what has
+// to stay up, let the marks spread to ancestors and terminal jobs, and
+// stop whole subtrees with the leaves first.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include "process_tree.h"
+#include "paths.h"
+
+#define INITIAL_CAPACITY 512
+
+static unsigned int hash_pid(pid_t pid, int bucket_count) {
+    return ((unsigned int)pid * 2654435761u) & (bucket_count - 1);
+}
+
+static int add_node(process_tree_t *tree, const process_node_t *node) {
+    if (tree->count == tree->capacity) {
+        int capacity = tree->capacity ? tree->capacity * 2 : INITIAL_CAPACITY;
+        process_node_t *nodes = realloc(tree->nodes, capacity * sizeof(*nodes));
+        if (nodes == NULL) {
+            return -1;
+        }
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+    }
+    tree->nodes[tree->count++] = *node;
+    return 0;
+}
+
+// Read the fields we need from /proc/<pid>/stat and the real uid from status
+static int read_process(pid_t pid, process_node_t *node) {
+    char path[PATH_MAX];
+    char buffer[1024];
+
+    snprintf(path, sizeof(path), "%s/proc/%d/stat", procfs_root, pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char *line = fgets(buffer, sizeof(buffer), file);
+    fclose(file);
+    if (line == NULL) {
+        return -1;
+    }
+
+    // The command name may itself contain spaces and parentheses
+    char *open = strchr(buffer, '(');
+    char *close = strrchr(buffer, ')');
+    if (open == NULL || close == NULL || close < open) {
+        return -1;
+    }
+    size_t length = close - open - 1;
+    if (length >= sizeof(node->comm)) {
+        length = sizeof(node->comm) - 1;
+    }
+    memcpy(node->comm, open + 1, length);
+    node->comm[length] = '\0';
+
+    if (sscanf(close + 1, " %c %d %d %d %u", &node->state, &node->ppid, &node->pgrp,
+               &node->session, &node->tty_nr) != 5) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/proc/%d/status", procfs_root, pid);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    node->uid = (uid_t)-1;
+    while (fgets(buffer, sizeof(buffer), file)) {
+        if (strncmp(buffer, "Uid:", 4) == 0) {
+            sscanf(buffer, "Uid:\t%u", &node->uid);
+            break;
+        }
+    }
+    fclose(file);
+
+    node->pid = pid;
+    node->parent = -1;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    node->keep = 0;
+    node->frozen = 0;
+    return 0;
+}
+
+static int build_index(process_tree_t *tree) {
+    int bucket_count = 1024;
+    while (bucket_count < tree->count * 2) {
+        bucket_count *= 2;
+    }
+    if (bucket_count > tree->bucket_count) {
+        int *buckets = realloc(tree->buckets, bucket_count * sizeof(*buckets));
+        if (buckets == NULL) {
+            return -1;
+        }
+        tree->buckets = buckets;
+        tree->bucket_count = bucket_count;
+    }
+    memset(tree->buckets, -1, tree->bucket_count * sizeof(*tree->buckets));
+
+    for (int i = 0; i < tree->count; i++) {
+        unsigned int slot = hash_pid(tree->nodes[i].pid, tree->bucket_count);
+        while (tree->buckets[slot] != -1) {
+            slot = (slot + 1) & (tree->bucket_count - 1);
+        }
+        tree->buckets[slot] = i;
+    }
+    return 0;
+}
+
+int process_tree_find(const process_tree_t *tree, pid_t pid) {
+    if (tree->bucket_count == 0) {
+        return -1;
+    }
+    unsigned int slot = hash_pid(pid, tree->bucket_count);
+    while (tree->buckets[slot] != -1) {
+        if (tree->nodes[tree->buckets[slot]].pid == pid) {
+            return tree->buckets[slot];
+        }
+        slot = (slot + 1) & (tree->bucket_count - 1);
+    }
+    return -1;
+}
+
+int process_tree_scan(process_tree_t *tree) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/proc", procfs_root);
+
+    DIR *proc_dir = opendir(path);
+    if (proc_dir == NULL) {
+        perror("Failed to open /proc directory");
+        return -1;
+    }
+
+    tree->count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(proc_dir)) != NULL) {
+        if (!isdigit((unsigned char)entry->d_name[0])) {
+            continue;
+        }
+        process_node_t node;
+        // Processes may exit between readdir() and the reads
+        if (read_process(atoi(entry->d_name), &node) == 0 && add_node(tree, &node) == -1) {
+            closedir(proc_dir);
+            return -1;
+        }
+    }
+    closedir(proc_dir);
+
+    if (build_index(tree) == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < tree->count; i++) {
+        process_node_t *node = &tree->nodes[i];
+        int parent = node->ppid != node->pid ? process_tree_find(tree, node->ppid) : -1;
+        if (parent != -1) {
+            node->parent = parent;
+            node->next_sibling = tree->nodes[parent].first_child;
+            tree->nodes[parent].first_child = i;
+        }
+    }
+    return 0;
+}
+
+void process_tree_free(process_tree_t *tree) {
+    free(tree->nodes);
+    free(tree->buckets);
+    memset(tree, 0, sizeof(*tree));
+}
+
+int process_tree_is_job(const process_node_t *node) {
+    // The shell leads the session; its jobs get process groups of their own
+    return node->tty_nr != 0 && node->pgrp != node->session;
+}
+
+static int compare_pids(const void *a, const void *b) {
+    pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Keep a terminal job running if any of its members must
+static int spread_to_groups(process_tree_t *tree) {
+    pid_t *groups = malloc(tree->count * sizeof(*groups));
+    if (groups == NULL) {
+        return 0;
+    }
+
+    int group_count = 0;
+    for (int i = 0; i < tree->count; i++) {
+        if (tree->nodes[i].keep && process_tree_is_job(&tree->nodes[i])) {
+            groups[group_count++] = tree->nodes[i].pgrp;
+        }
+    }
+    qsort(groups, group_count, sizeof(*groups), compare_pids);
+
+    int changed = 0;
+    for (int i = 0; i < tree->count && group_count > 0; i++) {
+        process_node_t *node = &tree->nodes[i];
+        if (!node->keep && process_tree_is_job(node) &&
+            bsearch(&node->pgrp, groups, group_count, sizeof(*groups), compare_pids) != NULL) {
+            node->keep = 1;
+            changed = 1;
+        }
+    }
+
+    free(groups);
+    return changed;
+}
+
+// Keep every ancestor of a kept process running
+static int spread_to_ancestors(process_tree_t *tree) {
+    int changed = 0;
+    for (int i = 0; i < tree->count; i++) {
+        if (!tree->nodes[i].keep) {
+            continue;
+        }
+        for (int p = tree->nodes[i].parent; p != -1 && !tree->nodes[p].keep; p = tree->nodes[p].parent) {
+            tree->nodes[p].keep = 1;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+void process_tree_protect(process_tree_t *tree) {
+    spread_to_ancestors(tree);
+    while (spread_to_groups(tree) && spread_to_ancestors(tree)) {
+    }
+}
+
+int process_tree_collect(process_tree_t *tree, int index, pid_t *pids, int max) {
+    if (index < 0 || index >= tree->count) {
+        return 0;
+    }
+
+    // Pre-order walk with an explicit stack; reversed, every process comes
+    // after all of its descendants
+    int *stack = malloc(tree->count * sizeof(*stack));
+    int *order = malloc(tree->count * sizeof(*order));
+    if (stack == NULL || order == NULL) {
+        free(stack);
+        free(order);
+        return 0;
+    }
+
+    int depth = 0, visited = 0;
+    stack[depth++] = index;
+    while (depth > 0) {
+        int current = stack[--depth];
+        order[visited++] = current;
+        for (int child = tree->nodes[current].first_child; child != -1; child = tree->nodes[child].next_sibling) {
+            stack[depth++] = child;
+        }
+    }
+
+    int stored = 0;
+    for (int i = visited - 1; i >= 0 && stored < max; i--) {
+        process_node_t *node = &tree->nodes[order[i]];
+        if (node->frozen || node->state == 'T') {
+            continue;
+        }
+        node->frozen = 1;
+        pids[stored++] = node->pid;
+    }
+
+    free(stack);
+    free(order);
+    return stored;
+}
+
+int process_tree_collect_group(process_tree_t *tree, pid_t pgrp, pid_t *pids, int max) {
+    int stored = 0;
+    for (int i = 0; i < tree->count && stored < max; i++) {
+        process_node_t *node = &tree->nodes[i];
+        // Start from members whose parent is outside the group, their
+        // subtrees hold the rest
+        if (node->pgrp != pgrp || !process_tree_is_job(node)) {
+            continue;
+        }
+        if (node->parent != -1 && tree->nodes[node->parent].pgrp == pgrp) {
+            continue;
+        }
+        stored += process_tree_collect(tree, i, pids + stored, max - stored);
+    }
+    return stored;
+}
@@ -0,0 +1,432 @@
+// sessions.c
+//
+// System mode. One daemon samples the battery for the whole machine and
+// follows the logind session list in /run/systemd/sessions through
+// inotify, so the list is only re-read when a session comes or goes.
+// Alerts are handed to a small per-user helper in each graphical session,
+// whose answer comes back asynchronously through the event loop.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sessions.h"
+#include "monitor.h"
+#include "battery_monitor.h"
+#include "process_monitor.h"
+#include "energy_budget.h"
+#include "event_loop.h"
+#include "log_message.h"
+
+#ifndef SESSIONS_DIR
+#define SESSIONS_DIR "/run/systemd/sessions"
+#endif
+
+#define MAX_SESSIONS 64
+#define HELPER_TIMEOUT_MS 1000  // A helper that takes longer is skipped for this alert
+
+typedef struct {
+    char id[32];
+    uid_t uid;
+    int active;
+    int graphical;
+    char display[64];  // X11 display of the session, empty if none
+} session_t;
+
+static session_t sessions[MAX_SESSIONS];
+static int session_count = 0;
+
+void get_notify_socket_path(uid_t uid, char *buffer, size_t size) {
+    snprintf(buffer, size, "/run/user/%u/battery_monitor-notify.sock", (unsigned int)uid);
+}
+
+// Parse one logind session file, returns 0 for user sessions worth tracking
+static int read_session(const char *id, session_t *session) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", SESSIONS_DIR, id);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    memset(session, 0, sizeof(*session));
+    snprintf(session->id, sizeof(session->id), "%s", id);
+    session->uid = (uid_t)-1;
+
+    int user_class = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strncmp(line, "UID=", 4) == 0) {
+            session->uid = (uid_t)strtoul(line + 4, NULL, 10);
+        } else if (strncmp(line, "ACTIVE=", 7) == 0) {
+            session->active = atoi(line + 7);
+        } else if (strncmp(line, "TYPE=", 5) == 0) {
+            session->graphical = strcmp(line + 5, "x11") == 0 || strcmp(line + 5, "wayland") == 0 ||
+                                 strcmp(line + 5, "mir") == 0;
+        } else if (strncmp(line, "CLASS=", 6) == 0) {
+            user_class = strcmp(line + 6, "user") == 0;
+        } else if (strncmp(line, "DISPLAY=", 8) == 0) {
+            snprintf(session->display, sizeof(session->display), "%s", line + 8);
+        }
+    }
+    fclose(file);
+
+    // Greeters and root sessions have nothing to freeze or notify
+    return user_class && session->uid != (uid_t)-1 && session->uid != 0 ? 0 : -1;
+}
+
+static int read_sessions() {
+    DIR *dir = opendir(SESSIONS_DIR);
+    if (dir == NULL) {
+        log_message("Failed to open logind session directory");
+        return -1;
+    }
+
+    session_count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && session_count < MAX_SESSIONS) {
+        // logind writes through hidden temporary files and renames them
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (read_session(entry->d_name, &sessions[session_count]) == 0) {
+            session_count++;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static void scan_sessions() {
+    if (read_sessions() == -1) {
+        return;
+    }
+
+    // Every user with a session gets their processes managed
+    uid_t uids[MAX_SESSIONS];
+    int uid_count = 0;
+    for (int i = 0; i < session_count; i++) {
+        int seen = 0;
+        for (int j = 0; j < uid_count; j++) {
+            seen |= uids[j] == sessions[i].uid;
+        }
+        if (!seen) {
+            uids[uid_count++] = sessions[i].uid;
+        }
+    }
+    set_managed_users(uids, uid_count);
+    energy_budget_watch_users(uids, uid_count);
+
+    char message[128];
+    snprintf(message, sizeof(message), "Tracking %d sessions of %d users", session_count, uid_count);
+    log_message(message);
+}
+
+static void handle_session_change(int fd, void *data) {
+    (void)data;
+
+    // Drain every queued event, one rescan covers them all
+    char buffer[4096];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+    scan_sessions();
+}
+
+int sessions_init() {
+    scan_sessions();
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        perror("inotify_init1 failed");
+        return -1;
+    }
+    if (inotify_add_watch(fd, SESSIONS_DIR, IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE) == -1) {
+        perror("Failed to watch logind sessions");
+        close(fd);
+        return -1;
+    }
+    return event_loop_add_fd(fd, handle_session_change, NULL);
+}
+
+static const char *response_names[] = { "none", "ok", "saving", "sleep" };
+
+static notify_response_t parse_response(const char *name) {
+    for (int i = 0; i < (int)(sizeof(response_names) / sizeof(response_names[0])); i++) {
+        if (strncmp(name, response_names[i], strlen(response_names[i])) == 0) {
+            return (notify_response_t)i;
+        }
+    }
+    return NOTIFY_RESPONSE_NONE;
+}
+
+// Whether the process at the other end of a connection runs as uid
+static int peer_is(int fd, uid_t uid) {
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0 && cred.uid == uid;
+}
+
+// Whether every tracked session belongs to uid
+static int only_user(uid_t uid) {
+    for (int i = 0; i < session_count; i++) {
+        if (sessions[i].uid != uid) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A helper answered, or went away without answering
+static void handle_helper_reply(int fd, void *data) {
+    uid_t uid = (uid_t)(uintptr_t)data;
+    char reply[32] = "";
+
+    ssize_t length = peer_is(fd, uid) ? read(fd, reply, sizeof(reply) - 1) : -1;
+    event_loop_remove_fd(fd);
+    close(fd);
+    if (length <= 0) {
+        return;
+    }
+    reply[length] = '\0';
+
+    notify_response_t response = parse_response(reply);
+    char message[96];
+    snprintf(message, sizeof(message), "User %u answered notification with %s",
+             (unsigned int)uid, response_names[response]);
+    log_message(message);
+
+    // Several users may answer the same alert, saving mode is machine-wide
+    if (response == NOTIFY_RESPONSE_SAVING && battery_saving_mode_active) {
+        return;
+    }
+    // Suspending takes the machine away from everyone, so one user may only
+    // choose it while nobody else is logged in, as logind's own policy has it
+    if (response == NOTIFY_RESPONSE_SLEEP && !only_user(uid)) {
+        snprintf(message, sizeof(message), "Not suspending for user %u, other users are logged in",
+                 (unsigned int)uid);
+        log_message(message);
+        return;
+    }
+    monitor_handle_response(response);
+}
+
+// Wait up to HELPER_TIMEOUT_MS for a helper connection to become ready
+static int wait_for_helper(int fd, short events) {
+    struct pollfd pfd = { fd, events, 0 };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, HELPER_TIMEOUT_MS);
+    } while (ready == -1 && errno == EINTR);
+    return ready == 1 && !(pfd.revents & (POLLERR | POLLHUP)) ? 0 : -1;
+}
+
+// The socket lives in a directory the user owns, so the daemon never blocks
+// on it and only talks to a helper that really runs as that user
+static int send_to_helper(uid_t uid, const char *message, const char *title) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    get_notify_socket_path(uid, addr.sun_path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+        (errno != EINPROGRESS || wait_for_helper(fd, POLLOUT) == -1)) {
+        close(fd);
+        return -1;
+    }
+    if (!peer_is(fd, uid)) {
+        char log[96];
+        snprintf(log, sizeof(log), "Notification socket of user %u is not served by that user", (unsigned int)uid);
+        log_message(log);
+        close(fd);
+        return -1;
+    }
+
+    char request[512];
+    int length = snprintf(request, sizeof(request), "%s\t%s\n", title, message);
+    if (length >= (int)sizeof(request)) {
+        length = sizeof(request) - 1;
+    }
+    int sent = 0;
+    while (sent < length) {
+        ssize_t written = write(fd, request + sent, length - sent);
+        if (written > 0) {
+            sent += written;
+        } else if (written == -1 && errno != EAGAIN && errno != EINTR) {
+            break;
+        } else if (wait_for_helper(fd, POLLOUT) == -1) {
+            break;
+        }
+    }
+    if (sent < length || event_loop_add_fd(fd, handle_helper_reply, (void *)(uintptr_t)uid) == -1) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Forward to each user with an active graphical session, once per user
+static notify_response_t session_notify(const char *message, const char *title) {
+    uid_t notified[MAX_SESSIONS];
+    int notified_count = 0;
+    char log[128];
+
+    for (int i = 0; i < session_count; i++) {
+        if (!sessions[i].active || !sessions[i].graphical) {
+            continue;
+        }
+
+        int seen = 0;
+        for (int j = 0; j < notified_count; j++) {
+            seen |= notified[j] == sessions[i].uid;
+        }
+        if (seen) {
+            continue;
+        }
+        notified[notified_count++] = sessions[i].uid;
+
+        if (send_to_helper(sessions[i].uid, message, title) == -1) {
+            snprintf(log, sizeof(log), "No responsive notification helper for user %u", (unsigned int)sessions[i].uid);
+            log_message(log);
+        }
+    }
+
+    // Answers arrive later through handle_helper_reply()
+    return NOTIFY_RESPONSE_NONE;
+}
+
+const notifier_backend_t session_notifier = {
+    "sessions",
+    session_notify,
+};
+
+// Helper side: show each alert forwarded by the system daemon as a GTK dialog
+
+static int listen_helper_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(path, 0600) == -1 ||
+        listen(fd, 4) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Only the system daemon (root) or the user themselves may raise dialogs
+static int peer_allowed(int fd) {
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1) {
+        return 0;
+    }
+    return cred.uid == 0 || cred.uid == getuid();
+}
+
+// Take DISPLAY from the user's graphical logind session when the service
+// manager did not pass one, preferring the active session
+static void use_session_display() {
+    const char *current = getenv("DISPLAY");
+    if (current != NULL && current[0] != '\0') {
+        return;
+    }
+
+    read_sessions();
+    const char *display = NULL;
+    for (int i = 0; i < session_count; i++) {
+        if (sessions[i].uid == getuid() && sessions[i].display[0] != '\0' &&
+            (display == NULL || sessions[i].active)) {
+            display = sessions[i].display;
+        }
+    }
+    if (display != NULL) {
+        setenv("DISPLAY", display, 1);
+    } else {
+        log_message("No graphical session with a display found for the notification helper");
+    }
+}
+
+int notify_helper_command(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    use_session_display();
+
+    char path[PATH_MAX];
+    get_notify_socket_path(getuid(), path, sizeof(path));
+
+    int listen_fd = listen_helper_socket(path);
+    if (listen_fd == -1) {
+        perror("Failed to listen for notifications");
+        return 1;
+    }
+
+    // The dialog closes itself once the charger is plugged in
+    if (power_source == NULL) {
+        power_source = &sysfs_power_source;
+    }
+    log_message("Notification helper started");
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept failed");
+            break;
+        }
+
+        char request[512];
+        ssize_t length = peer_allowed(fd) ? read(fd, request, sizeof(request) - 1) : -1;
+        if (length > 0) {
+            request[length] = '\0';
+            request[strcspn(request, "\n")] = '\0';
+
+            char *message = strchr(request, '\t');
+            if (message != NULL) {
+                *message++ = '\0';
+                notify_response_t response = show_notification(message, request);
+
+                char reply[16];
+                int reply_length = snprintf(reply, sizeof(reply), "%s\n", response_names[response]);
+                if (write(fd, reply, reply_length) != reply_length) {
+                    log_message("Failed to answer the system daemon");
+                }
+            }
+        }
+        close(fd);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    return 1;
+}
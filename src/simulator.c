@@ -0,0 +1,496 @@
+// simulator.c
+//
+// Replays recorded or synthetic discharge traces through monitor_tick()
+// on a virtual clock, so threshold and sampling changes can be evaluated
+// offline at far more than real time.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "monitor.h"
+#include "backend.h"
+#include "battery_monitor.h"
+#include "process_monitor.h"
+#include "power_profile.h"
+#include "policy.h"
+#include "energy_budget.h"
+#include "usage_model.h"
+#include "display.h"
+
+typedef struct {
+    long offset;   // Seconds since the start of the trace
+    double level;  // Battery percentage
+    int charging;
+} trace_point_t;
+
+typedef struct {
+    long offset;
+    int level;
+    char what[32];
+    char detail[96];
+} sim_event_t;
+
+static trace_point_t *trace = NULL;
+static int trace_count = 0;
+static int trace_cursor = 0;
+
+static sim_event_t *events = NULL;
+static int event_count = 0;
+
+static time_t sim_start = 0;
+static time_t sim_time = 0;
+static unsigned long sim_wakeups = 0;
+static unsigned long sim_samples = 0;
+static int sim_verbose = 0;
+static double sim_capacity_wh = 50;  // Full battery, converts levels into energy and power
+static notify_response_t sim_response = NOTIFY_RESPONSE_SAVING;
+
+// Trace helpers
+
+static void add_trace_point(long offset, double level, int charging) {
+    trace = realloc(trace, (trace_count + 1) * sizeof(*trace));
+    if (trace == NULL) {
+        perror("Failed to grow trace");
+        exit(1);
+    }
+    trace[trace_count].offset = offset;
+    trace[trace_count].level = level;
+    trace[trace_count].charging = charging;
+    trace_count++;
+}
+
+// Copy the n-th comma separated field of a line, empty fields included
+static void csv_field(const char *line, int n, char *buffer, size_t size) {
+    const char *p = line;
+    for (int commas = 0; *p && commas < n; p++) {
+        if (*p == ',') commas++;
+    }
+    size_t len = strcspn(p, ",\n");
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(buffer, p, len);
+    buffer[len] = '\0';
+}
+
+static int parse_charging(const char *field) {
+    return strncmp(field, "charging", 8) == 0 || strcmp(field, "1") == 0;
+}
+
+// Accepts either `offset,level[,status]` lines or the CSV printed by `battery_monitor history`
+static int load_trace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open trace");
+        return -1;
+    }
+
+    char line[256];
+    time_t first = -1;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char when[64];
+        char status[32];
+        double level;
+
+        // Skip headers and comments
+        if (line[0] < '0' || line[0] > '9') {
+            continue;
+        }
+
+        if (sscanf(line, "%63[^,],%lf", when, &level) != 2) {
+            continue;
+        }
+
+        long offset;
+        if (strchr(when, 'T') != NULL) {
+            // history format: time,level,energy_wh,power_w,status,saving
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            if (strptime(when, "%Y-%m-%dT%H:%M:%S", &tm) == NULL) {
+                continue;
+            }
+            tm.tm_isdst = -1;
+            time_t t = mktime(&tm);
+            if (first == -1) {
+                first = t;
+                sim_start = t;  // Replay recorded traces at their original wall-clock time
+            }
+            offset = t - first;
+            csv_field(line, 4, status, sizeof(status));
+        } else {
+            offset = atol(when);
+            csv_field(line, 2, status, sizeof(status));
+        }
+
+        add_trace_point(offset, level, parse_charging(status));
+    }
+
+    fclose(file);
+
+    if (trace_count < 2) {
+        fprintf(stderr, "Trace needs at least two samples\n");
+        return -1;
+    }
+    return 0;
+}
+
+// START:RATE[:HOURS] discharges from START% at RATE%/hour, optionally reaching a charger after HOURS
+static int build_synthetic_trace(const char *spec) {
+    double start, rate, hours = -1;
+    int fields = sscanf(spec, "%lf:%lf:%lf", &start, &rate, &hours);
+    if (fields < 2 || rate <= 0 || start <= 0 || start > 100) {
+        fprintf(stderr, "Invalid synthetic trace '%s', expected START:RATE[:HOURS]\n", spec);
+        return -1;
+    }
+
+    double empty_hours = start / rate;
+    add_trace_point(0, start, 0);
+
+    if (fields == 3 && hours >= 0 && hours < empty_hours) {
+        double plug_level = start - rate * hours;
+        long plug = (long)(hours * 3600);
+        add_trace_point(plug, plug_level, 1);
+        // Charge at 60%/hour until full
+        add_trace_point(plug + (long)((100 - plug_level) / 60 * 3600), 100, 1);
+    } else {
+        add_trace_point((long)(empty_hours * 3600), 0, 0);
+    }
+    return 0;
+}
+
+// Backends
+
+static time_t sim_now(void) {
+    return sim_time;
+}
+
+static void sim_sleep(int seconds) {
+    sim_wakeups++;
+    sim_time += seconds;
+}
+
+// Locate the trace segment for the current virtual time
+static const trace_point_t *current_segment() {
+    long offset = sim_time - sim_start;
+    while (trace_cursor < trace_count - 2 && trace[trace_cursor + 1].offset <= offset) {
+        trace_cursor++;
+    }
+    return &trace[trace_cursor];
+}
+
+static int sim_get_battery_level(void) {
+    const trace_point_t *a = current_segment();
+    const trace_point_t *b = a + 1;
+    long offset = sim_time - sim_start;
+
+    if (offset >= b->offset) {
+        return (int)b->level;
+    }
+    double fraction = (double)(offset - a->offset) / (b->offset - a->offset);
+    return (int)(a->level + (b->level - a->level) * fraction + 0.5);
+}
+
+static int sim_is_charging(void) {
+    return current_segment()->charging;
+}
+
+static long sim_get_battery_energy(void) {
+    return (long)(sim_get_battery_level() / 100.0 * sim_capacity_wh * 1e6);
+}
+
+// Draw implied by the trace slope; every budget stage is assumed to save 8%
+static long sim_get_battery_power(void) {
+    const trace_point_t *a = current_segment();
+    const trace_point_t *b = a + 1;
+    if (a->charging || b->offset <= a->offset || b->level >= a->level) {
+        return -1;
+    }
+    double watts = (a->level - b->level) / 100.0 * sim_capacity_wh * 3600.0 / (b->offset - a->offset);
+    return (long)(watts * (1 - 0.08 * energy_budget_stage()) * 1e6);
+}
+
+static void record_event(const char *what, const char *detail) {
+    events = realloc(events, (event_count + 1) * sizeof(*events));
+    if (events == NULL) {
+        perror("Failed to grow event list");
+        exit(1);
+    }
+    sim_event_t *e = &events[event_count++];
+    e->offset = sim_time - sim_start;
+    e->level = sim_get_battery_level();
+    snprintf(e->what, sizeof(e->what), "%s", what);
+    snprintf(e->detail, sizeof(e->detail), "%s", detail);
+}
+
+static notify_response_t sim_notify(const char *message, const char *title) {
+    (void)message;
+    record_event("alert", title);
+    return sim_response;
+}
+
+static const power_source_backend_t trace_power_source = {
+    "trace",
+    sim_get_battery_level,
+    sim_is_charging,
+    sim_get_battery_energy,
+    sim_get_battery_power,
+    NULL,
+    NULL,
+};
+
+static const clock_backend_t virtual_clock = {
+    "virtual",
+    sim_now,
+    sim_sleep,
+};
+
+static const notifier_backend_t recording_notifier = {
+    "recording",
+    sim_notify,
+};
+
+// Stand-ins for the actions the monitor takes on the real system
+
+void log_message(const char *message) {
+    if (sim_verbose) {
+        long offset = sim_time - sim_start;
+        fprintf(stderr, "[%02ld:%02ld:%02ld] %s\n", offset / 3600, (offset / 60) % 60, offset % 60, message);
+    }
+}
+
+int enter_sleep_mode() {
+    record_event("sleep", "Sleep requested");
+    return 0;
+}
+
+int resume_high_cpu_processes() {
+    return 0;
+}
+
+int resume_user_daemons() {
+    record_event("thaw", "Suspended processes resumed");
+    return 0;
+}
+
+int run_battery_saving_mode(pid_t current_pid) {
+    (void)current_pid;
+    record_event("freeze", "High CPU processes suspended");
+    return 0;
+}
+
+int suspend_user_daemons() {
+    return 0;
+}
+
+int throttle_high_cpu_processes(pid_t current_pid) {
+    (void)current_pid;
+    record_event("throttle", "High CPU processes reniced");
+    return 0;
+}
+
+int unthrottle_processes() {
+    record_event("unthrottle", "Throttled processes restored");
+    return 0;
+}
+
+static int sim_brightness = 100;
+
+int get_brightness() {
+    return sim_brightness;
+}
+
+int set_brightness(int brightness) {
+    char detail[64];
+    snprintf(detail, sizeof(detail), "Brightness %d%%", brightness);
+    record_event("brightness", detail);
+    sim_brightness = brightness;
+    return 0;
+}
+
+static char sim_epp[32] = "balance_performance";
+
+int get_epp_profile(char *buffer, size_t size) {
+    snprintf(buffer, size, "%s", sim_epp);
+    return 0;
+}
+
+int set_epp_profile(const char *profile) {
+    char detail[64];
+    snprintf(detail, sizeof(detail), "EPP %s", profile);
+    record_event("epp", detail);
+    snprintf(sim_epp, sizeof(sim_epp), "%s", profile);
+    return 0;
+}
+
+// The panel is downshifted while any holder wants it
+static int sim_display_holders = 0;
+
+int display_downshift(int holder) {
+    if (sim_display_holders == 0) {
+        record_event("refresh", "Panel at lowest refresh rate");
+    }
+    sim_display_holders |= holder;
+    return 0;
+}
+
+int display_restore(int holder) {
+    if (sim_display_holders & holder) {
+        sim_display_holders &= ~holder;
+        if (sim_display_holders == 0) {
+            record_event("refresh", "Panel refresh rate restored");
+        }
+    }
+    return 0;
+}
+
+// Report
+
+static void format_offset(long offset, char *buffer, size_t size) {
+    snprintf(buffer, size, "%02ld:%02ld:%02ld", offset / 3600, (offset / 60) % 60, offset % 60);
+}
+
+static void print_report(double elapsed, int json) {
+    long simulated = sim_time - sim_start;
+    double speedup = elapsed > 0 ? simulated / elapsed : 0;
+
+    if (json) {
+        printf("{\"simulated_seconds\":%ld,\"elapsed_seconds\":%.6f,\"speedup\":%.0f,"
+               "\"samples\":%lu,\"wakeups\":%lu,\"events\":[",
+               simulated, elapsed, speedup, sim_samples, sim_wakeups);
+        for (int i = 0; i < event_count; i++) {
+            printf("%s{\"offset\":%ld,\"level\":%d,\"event\":\"%s\",\"detail\":\"%s\"}",
+                   i > 0 ? "," : "", events[i].offset, events[i].level, events[i].what, events[i].detail);
+        }
+        printf("]}\n");
+        return;
+    }
+
+    char duration[32];
+    format_offset(simulated, duration, sizeof(duration));
+    printf("Simulated %s of battery time in %.3f ms (%.0fx real time)\n", duration, elapsed * 1000, speedup);
+    printf("Samples: %lu  Wakeups: %lu\n", sim_samples, sim_wakeups);
+    printf("Events:\n");
+    for (int i = 0; i < event_count; i++) {
+        char when[32];
+        format_offset(events[i].offset, when, sizeof(when));
+        printf("  %s  %3d%%  %-12s %s\n", when, events[i].level, events[i].what, events[i].detail);
+    }
+}
+
+static void print_usage() {
+    printf("Usage: battery_sim (--trace FILE | --synthetic START:RATE[:HOURS]) [options]\n"
+           "  --trace FILE       Replay 'offset,level[,status]' lines or 'battery_monitor history' output\n"
+           "  --synthetic SPEC   Discharge from START%% at RATE%%/hour, reaching a charger after HOURS\n"
+           "  --low N            Low threshold (default %d)\n"
+           "  --critical N       Critical threshold (default %d)\n"
+           "  --high N           High threshold (default %d)\n"
+           "  --tier SPEC        Add a policy tier, name:threshold:hysteresis:actions (repeatable)\n"
+           "  --respond ACTION   Answer alerts with ok, saving, sleep or none (default saving)\n"
+           "  --budget MINUTES   Make the battery last MINUTES after every unplug\n"
+           "  --capacity WH      Battery capacity used to derive energy and power (default 50)\n"
+           "  --learn            Learn the usage pattern from the trace and save power pre-emptively\n"
+           "  --json             Print the report as JSON\n"
+           "  --verbose          Print the monitor's log messages with virtual timestamps\n",
+           THRESHOLD_LOW, THRESHOLD_CRITICAL, THRESHOLD_HIGH);
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_path = NULL;
+    const char *synthetic = NULL;
+    int json = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--synthetic") == 0 && i + 1 < argc) {
+            synthetic = argv[++i];
+        } else if (strcmp(argv[i], "--low") == 0 && i + 1 < argc) {
+            THRESHOLD_LOW = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--critical") == 0 && i + 1 < argc) {
+            THRESHOLD_CRITICAL = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--high") == 0 && i + 1 < argc) {
+            THRESHOLD_HIGH = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tier") == 0 && i + 1 < argc) {
+            if (policy_add_tier(argv[++i]) == -1) {
+                fprintf(stderr, "Invalid tier '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--respond") == 0 && i + 1 < argc) {
+            const char *action = argv[++i];
+            if (strcmp(action, "ok") == 0) {
+                sim_response = NOTIFY_RESPONSE_OK;
+            } else if (strcmp(action, "saving") == 0) {
+                sim_response = NOTIFY_RESPONSE_SAVING;
+            } else if (strcmp(action, "sleep") == 0) {
+                sim_response = NOTIFY_RESPONSE_SLEEP;
+            } else {
+                sim_response = NOTIFY_RESPONSE_NONE;
+            }
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            energy_budget_set_runtime(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            sim_capacity_wh = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--learn") == 0) {
+            usage_model_open(NULL);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            sim_verbose = 1;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if ((trace_path == NULL) == (synthetic == NULL)) {
+        print_usage();
+        return 1;
+    }
+
+    if (trace_path != NULL ? load_trace(trace_path) == -1 : build_synthetic_trace(synthetic) == -1) {
+        return 1;
+    }
+
+    if (sim_start == 0) {
+        sim_start = time(NULL);
+    }
+    sim_time = sim_start;
+
+    policy_compile();
+
+    power_source = &trace_power_source;
+    clock_backend = &virtual_clock;
+    notifier = &recording_notifier;
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    long end = trace[trace_count - 1].offset;
+    while (sim_time - sim_start <= end) {
+        int was_saving = battery_saving_mode_active;
+        battery_sample_t sample;
+        int sleep_duration = monitor_tick(&sample);
+        sim_samples++;
+
+        if (!was_saving && battery_saving_mode_active) {
+            record_event("saving_on", "Battery saving mode engaged");
+        } else if (was_saving && !battery_saving_mode_active) {
+            record_event("saving_off", "Battery saving mode released");
+        }
+
+        clock_backend->sleep(sleep_duration);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    print_report(elapsed, json);
+
+    usage_model_close();
+    free(trace);
+    free(events);
+    return 0;
+}
@@ -0,0 +1,469 @@
+// sleep.c
+//
+// Puts the machine to sleep without forking. logind is asked over D-Bus;
+// when that fails and we are root, /sys/power/disk and /sys/power/state are
+// written directly. RAM sleep still drains the battery, so the drain of
+// past sleeps is learned and the deeper states are used when the remaining
+// energy would not last until the user is likely to return.
+
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include "sleep.h"
+#include "battery_monitor.h"
+#include "backend.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "log_message.h"
+#include "paths.h"
+
+#define LOGIND_SERVICE "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_INTERFACE "org.freedesktop.login1.Manager"
+
+#define SLEEP_RESERVE 2.0           // Percent at which firmware may cut power
+#define HYBRID_MIN_HOURS 1.0        // Below this much RAM sleep, hibernate outright
+#define DEFAULT_DRAIN 1.0           // Percent per hour until a sleep was measured
+#define MIN_LEARN_SECONDS 600       // Shorter sleeps lose too little to measure
+#define DRAIN_DECAY_HOURS 48.0      // Hours asleep after which old sleeps weigh 1/e
+#define SLEEP_WAIT_SECONDS 60       // How long to wait for a requested sleep to happen
+
+typedef struct {
+    const char *name;
+    const char *logind_can;     // logind method telling whether the state is allowed
+    const char *logind_method;
+    const char *disk_mode;      // /sys/power/disk mode, NULL for RAM sleep
+} sleep_state_t;
+
+static const sleep_state_t sleep_states[SLEEP_MODE_COUNT] = {
+    [SLEEP_SUSPEND] = { "suspend", "CanSuspend", "Suspend", NULL },
+    [SLEEP_HYBRID] = { "hybrid-sleep", "CanHybridSleep", "HybridSleep", "suspend" },
+    [SLEEP_HIBERNATE] = { "hibernate", "CanHibernate", "Hibernate", "platform" },
+};
+
+// States tried in order when the chosen one is not available, -1 ends the list
+static const int fallbacks[SLEEP_MODE_COUNT][SLEEP_MODE_COUNT] = {
+    [SLEEP_SUSPEND] = { SLEEP_SUSPEND, -1, -1 },
+    [SLEEP_HYBRID] = { SLEEP_HYBRID, SLEEP_HIBERNATE, SLEEP_SUSPEND },
+    [SLEEP_HIBERNATE] = { SLEEP_HIBERNATE, SLEEP_HYBRID, SLEEP_SUSPEND },
+};
+
+static double horizon_hours = 12.0;
+static int forced_mode = -1;
+
+// Decayed sums over past RAM sleeps, in percent and, where the supply
+// reports it, in uWh
+static double drain_sum = 0;
+static double asleep_hours = 0;
+static double energy_drain_sum = 0;
+static double energy_asleep_hours = 0;
+
+// Last sample, to notice sleeps and what they cost
+static double last_offset = -1;
+static int last_level = -1;
+static long last_energy = -1;
+static int last_charging = 1;
+static int last_entered = -1;  // Mode of our own most recent entry, -1 if none
+static int skip_next_update = 0;  // The next caller sample predates our own sleep
+
+static GDBusConnection *system_bus = NULL;
+
+// A sleep logind accepted but has not carried out yet. The timer fires
+// after SLEEP_WAIT_SECONDS, or earlier when the wall clock jumps, which the
+// kernel reports on every resume.
+static int pending_chosen = -1;
+static int pending_index = -1;
+static double pending_start = 0;
+static double pending_offset = 0;
+static int pending_fd = -1;
+
+void sleep_set_horizon(double hours) {
+    if (hours > 0) {
+        horizon_hours = hours;
+    }
+}
+
+void sleep_set_mode(int mode) {
+    forced_mode = mode >= 0 && mode < SLEEP_MODE_COUNT ? mode : -1;
+}
+
+int sleep_parse_mode(const char *name) {
+    if (strcmp(name, "auto") == 0) {
+        return -1;
+    }
+    for (int i = 0; i < SLEEP_MODE_COUNT; i++) {
+        if (strcmp(name, sleep_states[i].name) == 0) {
+            return i;
+        }
+    }
+    return -2;
+}
+
+sleep_mode_t sleep_choose_mode(double hours) {
+    if (forced_mode >= 0) {
+        return forced_mode;
+    }
+    if (hours < 0 || hours >= horizon_hours) {
+        return SLEEP_SUSPEND;
+    }
+    // Hybrid sleep resumes quickly if the user is back soon and from disk otherwise
+    return hours >= HYBRID_MIN_HOURS ? SLEEP_HYBRID : SLEEP_HIBERNATE;
+}
+
+// Measured RAM sleep drain in percent per hour
+static double drain_rate() {
+    return asleep_hours >= 1.0 ? drain_sum / asleep_hours : DEFAULT_DRAIN;
+}
+
+// Hours RAM sleep would last before the reserve, -1 if unknown or if it
+// drains nothing. The energy counter is used when the supply has one, since
+// a short sleep often loses less than a whole percent.
+static double sleep_hours_left(int level, long energy) {
+    if (energy >= 0 && level > 0) {
+        double per_percent = (double)energy / level;  // uWh
+        double drain = energy_asleep_hours >= 1.0 ? energy_drain_sum / energy_asleep_hours
+                                                  : DEFAULT_DRAIN * per_percent;
+        return drain > 0 ? (energy - SLEEP_RESERVE * per_percent) / drain : -1;
+    }
+    if (level < 0 || drain_rate() <= 0) {
+        return -1;
+    }
+    return (level - SLEEP_RESERVE) / drain_rate();
+}
+
+// Seconds spent asleep since boot: CLOCK_BOOTTIME counts them, CLOCK_MONOTONIC does not
+static double sleep_offset() {
+    struct timespec boot, mono;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (boot.tv_sec - mono.tv_sec) + (boot.tv_nsec - mono.tv_nsec) / 1e9;
+}
+
+static void finish_pending_sleep(void);
+
+void sleep_update(int level, long energy, int charging) {
+    if (skip_next_update) {
+        skip_next_update = 0;
+        return;
+    }
+
+    double offset = sleep_offset();
+    double slept = last_offset >= 0 ? offset - last_offset : 0;
+    char message[160];
+
+    // The resume may be sampled before the timer reports it
+    if (pending_chosen >= 0 && offset - pending_offset > 1.0) {
+        finish_pending_sleep();
+    }
+
+    if (slept >= MIN_LEARN_SECONDS && level >= 0 && last_level >= 0) {
+        snprintf(message, sizeof(message), "Resumed after %.1f h asleep, battery %d%% -> %d%%",
+                 slept / 3600, last_level, level);
+        log_message(message);
+
+        // Only RAM sleep on battery says anything about RAM sleep drain
+        if (!charging && !last_charging && last_entered != SLEEP_HIBERNATE) {
+            double hours = slept / 3600;
+            double decay = exp(-hours / DRAIN_DECAY_HOURS);
+            int lost = last_level - level;
+            drain_sum = drain_sum * decay + (lost > 0 ? lost : 0);
+            asleep_hours = asleep_hours * decay + hours;
+            if (energy >= 0 && last_energy >= 0) {
+                long used = last_energy - energy;
+                energy_drain_sum = energy_drain_sum * decay + (used > 0 ? used : 0);
+                energy_asleep_hours = energy_asleep_hours * decay + hours;
+            }
+        }
+        last_entered = -1;
+    }
+
+    last_offset = offset;
+    last_level = level;
+    last_energy = energy;
+    last_charging = charging;
+}
+
+static GDBusConnection *get_system_bus() {
+    if (system_bus == NULL) {
+        GError *error = NULL;
+        system_bus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+        if (system_bus == NULL) {
+            log_message("Failed to connect to the system bus");
+            g_error_free(error);
+        }
+    }
+    return system_bus;
+}
+
+// Whether logind would let us enter a state without asking for a password
+static int logind_can(sleep_mode_t mode) {
+    GDBusConnection *bus = get_system_bus();
+    if (bus == NULL) {
+        return 0;
+    }
+
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_sync(bus, LOGIND_SERVICE, LOGIND_PATH, LOGIND_INTERFACE,
+                                                  sleep_states[mode].logind_can, NULL, G_VARIANT_TYPE("(s)"),
+                                                  G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    if (reply == NULL) {
+        g_error_free(error);
+        return 0;
+    }
+
+    const gchar *answer;
+    g_variant_get(reply, "(&s)", &answer);
+    int can = strcmp(answer, "yes") == 0;
+    g_variant_unref(reply);
+    return can;
+}
+
+static int logind_sleep(sleep_mode_t mode) {
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_sync(get_system_bus(), LOGIND_SERVICE, LOGIND_PATH, LOGIND_INTERFACE,
+                                                  sleep_states[mode].logind_method, g_variant_new("(b)", FALSE),
+                                                  NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    if (reply == NULL) {
+        char message[256];
+        snprintf(message, sizeof(message), "logind refused %s: %s", sleep_states[mode].name, error->message);
+        log_message(message);
+        g_error_free(error);
+        return -1;
+    }
+    g_variant_unref(reply);
+    return 0;
+}
+
+// Whether a /sys/power file lists a token, selected ([token]) or not
+static int sysfs_power_has(const char *file, const char *token) {
+    char path[PATH_MAX];
+    char buffer[256];
+    snprintf(path, sizeof(path), "%s/sys/power/%s", sysfs_root, file);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char *line = fgets(buffer, sizeof(buffer), fp);
+    fclose(fp);
+    if (line == NULL) {
+        return 0;
+    }
+
+    for (char *word = strtok(buffer, " []\n"); word != NULL; word = strtok(NULL, " []\n")) {
+        if (strcmp(word, token) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int sysfs_power_write(const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sys/power/%s", sysfs_root, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+// /sys/power/disk mode for a disk state; without firmware support hibernation powers off
+static const char *sysfs_disk_mode(sleep_mode_t mode) {
+    const char *disk_mode = sleep_states[mode].disk_mode;
+    if (mode == SLEEP_HIBERNATE && !sysfs_power_has("disk", disk_mode)) {
+        disk_mode = "shutdown";
+    }
+    return sysfs_power_has("disk", disk_mode) ? disk_mode : NULL;
+}
+
+static int sysfs_can(sleep_mode_t mode) {
+    if (geteuid() != 0) {
+        return 0;
+    }
+    if (sleep_states[mode].disk_mode == NULL) {
+        return sysfs_power_has("state", "mem");
+    }
+    return sysfs_power_has("state", "disk") && sysfs_disk_mode(mode) != NULL;
+}
+
+// Returns once the machine has resumed
+static int sysfs_sleep(sleep_mode_t mode) {
+    if (sleep_states[mode].disk_mode != NULL) {
+        if (sysfs_power_write("disk", sysfs_disk_mode(mode)) == -1) {
+            return -1;
+        }
+        return sysfs_power_write("state", "disk");
+    }
+    return sysfs_power_write("state", "mem");
+}
+
+// Last resort without logind or root
+static int legacy_suspend() {
+    struct stat sb;
+
+    if (stat("/run/systemd/system", &sb) == 0) {
+        return system("systemctl suspend");
+    } else if (stat("/sbin/init", &sb) == 0) {
+        return system("pm-suspend");
+    } else if (stat("/run/openrc", &sb) == 0) {
+        return system("loginctl suspend");
+    }
+
+    log_message("Unknown init system, cannot enter sleep mode");
+    return -1;
+}
+
+// Learn from the level read after resume. A sample the caller took before
+// asking for sleep would look like no drain, so the next one is skipped.
+static void sleep_update_after_resume() {
+    sleep_update(power_source->get_battery_level(), power_source->get_battery_energy(),
+                 power_source->is_charging() == 1);
+    skip_next_update = 1;
+}
+
+static void record_sleep(sleep_mode_t mode, const char *via, double start) {
+    // CLOCK_MONOTONIC stops while asleep, so this is entry plus resume
+    double transition = metrics_now() - start;
+    metrics_observe(METRIC_SLEEP_TRANSITION, transition);
+    last_entered = mode;
+
+    char message[160];
+    snprintf(message, sizeof(message), "Slept (%s via %s), entering and resuming took %.2f s",
+             sleep_states[mode].name, via, transition);
+    log_message(message);
+}
+
+static void stop_pending_timer() {
+    if (pending_fd != -1) {
+        event_loop_remove_fd(pending_fd);
+        close(pending_fd);
+        pending_fd = -1;
+    }
+}
+
+static void finish_pending_sleep(void) {
+    record_sleep(fallbacks[pending_chosen][pending_index], "logind", pending_start);
+    pending_chosen = -1;
+    stop_pending_timer();
+}
+
+static int try_sleep_modes(sleep_mode_t chosen, int first, int skip_logind, double start);
+
+// Wall clock deadline for the pending sleep. TFD_TIMER_CANCEL_ON_SET makes
+// the timer readable with ECANCELED as soon as the clock is set, resumes included.
+static int arm_pending_timer(double seconds) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct itimerspec deadline = { { 0, 0 }, { now.tv_sec + (time_t)seconds + 1, now.tv_nsec } };
+    return timerfd_settime(pending_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &deadline, NULL);
+}
+
+static void handle_pending_timer(int fd, void *data) {
+    (void)data;
+    uint64_t expirations;
+    ssize_t result = read(fd, &expirations, sizeof(expirations));
+    if (result == -1 && errno == EAGAIN) {
+        return;
+    }
+
+    if (sleep_offset() - pending_offset > 1.0) {
+        finish_pending_sleep();
+        sleep_update_after_resume();
+        return;
+    }
+
+    double waited = metrics_now() - pending_start;
+    if (result == -1 && errno == ECANCELED && waited < SLEEP_WAIT_SECONDS) {
+        // Someone set the clock, keep waiting for the rest
+        arm_pending_timer(SLEEP_WAIT_SECONDS - waited);
+        return;
+    }
+
+    // logind still holds the request, most likely for an inhibitor. Try
+    // the same state through /sys/power, then the next safer ones.
+    log_message("Sleep was requested but did not happen, an inhibitor may be holding it");
+    int chosen = pending_chosen;
+    int index = pending_index;
+    pending_chosen = -1;
+    stop_pending_timer();
+    try_sleep_modes(chosen, index, 1, metrics_now());
+}
+
+// Ask logind and return to the event loop, the timer notices the outcome
+static int wait_for_logind(sleep_mode_t chosen, int index, double start) {
+    pending_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pending_fd == -1 || arm_pending_timer(SLEEP_WAIT_SECONDS) == -1 ||
+        event_loop_add_fd(pending_fd, handle_pending_timer, NULL) == -1) {
+        log_message("Failed to watch for the requested sleep");
+        if (pending_fd != -1) {
+            close(pending_fd);
+            pending_fd = -1;
+        }
+        return -1;
+    }
+    pending_chosen = chosen;
+    pending_index = index;
+    pending_start = start;
+    pending_offset = sleep_offset();
+    return 0;
+}
+
+// Try the fallbacks of chosen from position first on, logind before
+// /sys/power unless skip_logind is set for the first one
+static int try_sleep_modes(sleep_mode_t chosen, int first, int skip_logind, double start) {
+    for (int i = first; i < SLEEP_MODE_COUNT && fallbacks[chosen][i] != -1; i++) {
+        sleep_mode_t mode = fallbacks[chosen][i];
+        int use_logind = !(skip_logind && i == first);
+
+        if (use_logind && logind_can(mode) && logind_sleep(mode) == 0) {
+            return wait_for_logind(chosen, i, start);
+        } else if (sysfs_can(mode) && sysfs_sleep(mode) == 0) {
+            record_sleep(mode, "/sys/power", start);
+            sleep_update_after_resume();
+            return 0;
+        }
+    }
+
+    log_message("Neither logind nor /sys/power can suspend, falling back to the init system");
+    last_entered = SLEEP_SUSPEND;
+    int result = legacy_suspend();
+    sleep_update_after_resume();
+    return result;
+}
+
+int enter_sleep_mode() {
+    if (pending_chosen >= 0) {
+        log_message("Sleep already requested, waiting for it");
+        return 0;
+    }
+
+    int level = power_source->get_battery_level();
+    long energy = power_source->get_battery_energy();
+    int charging = power_source->is_charging() == 1;
+    double hours = sleep_hours_left(level, energy);
+    sleep_mode_t chosen = charging ? SLEEP_SUSPEND : sleep_choose_mode(hours);
+
+    char message[256];
+    snprintf(message, sizeof(message), "Entering sleep mode: battery %d%%, RAM sleep would last %.1f h, choosing %s",
+             level, hours, sleep_states[chosen].name);
+    log_message(message);
+
+    // Drain is learned from the level at entry
+    skip_next_update = 0;
+    sleep_update(level, energy, charging);
+
+    return try_sleep_modes(chosen, 0, 0, metrics_now());
+}
@@ -0,0 +1,305 @@
+// thermal.c
+//
+// Heat costs battery through fan power and leakage. Thermal zones and
+// cooling devices under /sys/class/thermal are discovered once, their
+// attribute files are kept open and re-read with pread(), and kernel
+// uevents for the thermal subsystem wake the daemon through the event
+// loop, so trip point crossings are handled without waiting for the next
+// battery sample.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include "thermal.h"
+#include "holders.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "log_message.h"
+#include "paths.h"
+
+#define MAX_ZONES 32
+#define MAX_COOLING_DEVICES 32
+#define THERMAL_HYSTERESIS 5.0  // Degrees below the hot threshold before releasing
+#define THERMAL_UEVENT_PREFIX "change@/devices/virtual/thermal/"  // Trip point crossings
+#define THERMAL_FREEZE_SECONDS 120  // Time past a passive trip on battery before freezing
+
+typedef struct {
+    char type[32];
+    int temp_fd;
+    double passive_trip;  // Celsius, -1 when the zone has no passive trip point
+} thermal_zone_t;
+
+typedef struct {
+    char type[32];
+    int cur_state_fd;
+    long max_state;
+} cooling_device_t;
+
+static thermal_zone_t zones[MAX_ZONES];
+static int zone_count = 0;
+static cooling_device_t cooling_devices[MAX_COOLING_DEVICES];
+static int cooling_count = 0;
+
+static double hot_threshold = 75.0;
+static double temperature = -1;
+static int hot = 0;
+static int throttling = 0;
+static int freezing = 0;
+static int last_charging = 1;
+static double above_trip_since = -1;  // Monotonic time a zone passed its passive trip, -1 if none has
+
+// Read a whole (short) sysfs attribute into buffer, stripping the newline
+static int read_attribute(const char *path, char *buffer, size_t size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int result = fgets(buffer, size, file) != NULL ? 0 : -1;
+    fclose(file);
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return result;
+}
+
+// Re-read a numeric attribute through its cached descriptor
+static long read_cached(int fd) {
+    char buffer[32];
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    return strtol(buffer, NULL, 10);
+}
+
+// Lowest passive trip point of a zone in Celsius, -1 if it has none
+static double find_passive_trip(const char *zone_path) {
+    double lowest = -1;
+    char path[PATH_MAX];
+    char value[64];
+
+    for (int i = 0; i < 16; i++) {
+        snprintf(path, sizeof(path), "%s/trip_point_%d_type", zone_path, i);
+        if (read_attribute(path, value, sizeof(value)) == -1) {
+            break;
+        }
+        if (strcmp(value, "passive") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/trip_point_%d_temp", zone_path, i);
+        if (read_attribute(path, value, sizeof(value)) == 0) {
+            double trip = atol(value) / 1000.0;
+            if (trip > 0 && (lowest < 0 || trip < lowest)) {
+                lowest = trip;
+            }
+        }
+    }
+    return lowest;
+}
+
+static void discover_zones() {
+    glob_t glob_result;
+    char pattern[PATH_MAX];
+    char path[PATH_MAX];
+
+    snprintf(pattern, sizeof(pattern), "%s/sys/class/thermal/thermal_zone*", sysfs_root);
+    if (glob(pattern, 0, NULL, &glob_result) == 0) {
+        for (size_t i = 0; i < glob_result.gl_pathc && zone_count < MAX_ZONES; i++) {
+            thermal_zone_t *zone = &zones[zone_count];
+
+            snprintf(path, sizeof(path), "%s/temp", glob_result.gl_pathv[i]);
+            zone->temp_fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (zone->temp_fd == -1) {
+                continue;
+            }
+            // Some firmware zones exist but cannot be read
+            if (read_cached(zone->temp_fd) == -1) {
+                close(zone->temp_fd);
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/type", glob_result.gl_pathv[i]);
+            if (read_attribute(path, zone->type, sizeof(zone->type)) == -1) {
+                snprintf(zone->type, sizeof(zone->type), "unknown");
+            }
+            zone->passive_trip = find_passive_trip(glob_result.gl_pathv[i]);
+            zone_count++;
+        }
+    }
+    globfree(&glob_result);
+
+    snprintf(pattern, sizeof(pattern), "%s/sys/class/thermal/cooling_device*", sysfs_root);
+    if (glob(pattern, 0, NULL, &glob_result) == 0) {
+        for (size_t i = 0; i < glob_result.gl_pathc && cooling_count < MAX_COOLING_DEVICES; i++) {
+            cooling_device_t *device = &cooling_devices[cooling_count];
+            char value[32];
+
+            snprintf(path, sizeof(path), "%s/cur_state", glob_result.gl_pathv[i]);
+            device->cur_state_fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (device->cur_state_fd == -1) {
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/max_state", glob_result.gl_pathv[i]);
+            device->max_state = read_attribute(path, value, sizeof(value)) == 0 ? atol(value) : 0;
+            snprintf(path, sizeof(path), "%s/type", glob_result.gl_pathv[i]);
+            if (read_attribute(path, device->type, sizeof(device->type)) == -1) {
+                snprintf(device->type, sizeof(device->type), "unknown");
+            }
+            cooling_count++;
+        }
+    }
+    globfree(&glob_result);
+}
+
+// Whether any zone is above the hot threshold or its own passive trip point.
+// Also notes since when some zone has been past its passive trip.
+static int sample_zones() {
+    int above = 0;
+    temperature = -1;
+
+    for (int i = 0; i < zone_count; i++) {
+        long millidegrees = read_cached(zones[i].temp_fd);
+        if (millidegrees < 0) {
+            continue;
+        }
+        double celsius = millidegrees / 1000.0;
+        if (celsius > temperature) {
+            temperature = celsius;
+        }
+        if (zones[i].passive_trip > 0 && celsius >= zones[i].passive_trip) {
+            above = 1;
+        }
+    }
+
+    metrics_set(METRIC_TEMPERATURE, temperature);
+    if (!above) {
+        above_trip_since = -1;
+    } else if (above_trip_since < 0) {
+        above_trip_since = metrics_now();
+    }
+    return above || temperature >= hot_threshold;
+}
+
+// Cooling devices the kernel currently has engaged, for the log
+static int active_cooling_devices() {
+    int active = 0;
+    for (int i = 0; i < cooling_count; i++) {
+        if (read_cached(cooling_devices[i].cur_state_fd) > 0) {
+            active++;
+        }
+    }
+    return active;
+}
+
+void thermal_update(int charging) {
+    if (zone_count == 0) {
+        return;
+    }
+    // An unreadable status keeps whatever was decided on the last one
+    if (charging == -1) {
+        charging = last_charging;
+    }
+    last_charging = charging;
+
+    int above = sample_zones();
+    if (above && !hot) {
+        hot = 1;
+    } else if (!above && hot && temperature < hot_threshold - THERMAL_HYSTERESIS) {
+        hot = 0;
+    }
+
+    char message[128];
+    int want = hot && !charging;
+    if (want && !throttling) {
+        snprintf(message, sizeof(message), "Running hot on battery (%.1f C, %d cooling devices active), throttling",
+                 temperature, active_cooling_devices());
+        log_message(message);
+        hold_throttle(HOLDER_THERMAL);
+        throttling = 1;
+    } else if (!want && throttling) {
+        snprintf(message, sizeof(message), charging ? "On AC power (%.1f C), restoring priorities"
+                                                    : "Cooled down to %.1f C, restoring priorities", temperature);
+        log_message(message);
+        // A policy tier, idle or the budget may still hold the throttle
+        release_throttle(HOLDER_THERMAL);
+        throttling = 0;
+    }
+
+    // Renicing did not bring a zone back under its passive trip, so stop the
+    // hottest consumers the way battery saving mode does
+    int stuck = want && above_trip_since >= 0 && metrics_now() - above_trip_since >= THERMAL_FREEZE_SECONDS;
+    if (stuck && !freezing) {
+        snprintf(message, sizeof(message), "Still past a passive trip point after %d seconds (%.1f C), freezing",
+                 THERMAL_FREEZE_SECONDS, temperature);
+        log_message(message);
+        hold_freeze(HOLDER_THERMAL);
+        freezing = 1;
+    } else if (!want && freezing) {
+        log_message("Thermal freeze no longer needed, resuming processes");
+        release_freeze(HOLDER_THERMAL);
+        freezing = 0;
+    }
+}
+
+// Kernel uevents: react to thermal zone changes right away
+static void handle_uevent(int fd, void *data) {
+    (void)data;
+    char buffer[4096];
+    int thermal = 0;
+    ssize_t length;
+
+    while ((length = recv(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT)) > 0) {
+        buffer[length] = '\0';
+        // Payload is NUL separated KEY=VALUE pairs after the header
+        for (char *p = buffer; p < buffer + length; p += strlen(p) + 1) {
+            if (strcmp(p, "SUBSYSTEM=thermal") == 0) {
+                thermal = 1;
+            }
+        }
+    }
+
+    if (thermal) {
+        thermal_update(last_charging);
+    }
+}
+
+int thermal_init(int hot_celsius) {
+    if (hot_celsius > 0) {
+        hot_threshold = hot_celsius;
+    }
+
+    discover_zones();
+
+    char message[128];
+    for (int i = 0; i < zone_count; i++) {
+        snprintf(message, sizeof(message), "Thermal zone %s, passive trip %.0f C", zones[i].type, zones[i].passive_trip);
+        log_message(message);
+    }
+    for (int i = 0; i < cooling_count; i++) {
+        snprintf(message, sizeof(message), "Cooling device %s, %ld states", cooling_devices[i].type,
+                 cooling_devices[i].max_state + 1);
+        log_message(message);
+    }
+    snprintf(message, sizeof(message), "Found %d thermal zones and %d cooling devices, hot above %.0f C",
+             zone_count, cooling_count, hot_threshold);
+    log_message(message);
+    if (zone_count == 0) {
+        return -1;
+    }
+
+    const char *prefix = THERMAL_UEVENT_PREFIX;
+    int fd = event_loop_open_uevents(&prefix, 1);
+    if (fd == -1 || event_loop_add_fd(fd, handle_uevent, NULL) == -1) {
+        log_message("Failed to listen for thermal events, sampling only");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,331 @@
+// ups_server.c
+//
+// Stand-in for a NUT upsd serving one UPS, for running the daemon's nut
+// backend without UPS hardware. It answers the read-only part of the line
+// protocol (VER, LIST UPS, LIST VAR, GET VAR, LOGOUT) over TCP and/or a
+// Unix socket. Variables start from a mains powered default and change
+// with NAME=VALUE lines on standard input, e.g. "ups.status=OB DISCHRG".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_VARS 64
+#define MAX_CLIENTS 16
+
+typedef struct {
+    char name[48];
+    char value[64];
+} ups_var_t;
+
+typedef struct {
+    int fd;
+    char input[1024];
+    size_t length;
+} client_t;
+
+static char ups_name[64] = "ups";
+static ups_var_t vars[MAX_VARS] = {
+    { "battery.charge", "100" },
+    { "battery.runtime", "1800" },
+    { "ups.status", "OL" },
+    { "ups.load", "25" },
+    { "ups.realpower", "150" },
+    { "ups.realpower.nominal", "600" },
+};
+static int var_count = 6;
+static client_t clients[MAX_CLIENTS];
+static int client_count = 0;
+
+static ups_var_t *find_var(const char *name) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(vars[i].name, name) == 0) {
+            return &vars[i];
+        }
+    }
+    return NULL;
+}
+
+// NAME=VALUE, an empty value removes the variable
+static int set_var(const char *assignment) {
+    const char *equals = strchr(assignment, '=');
+    if (equals == NULL || equals == assignment || equals - assignment >= 48) {
+        return -1;
+    }
+
+    char name[48];
+    snprintf(name, sizeof(name), "%.*s", (int)(equals - assignment), assignment);
+    ups_var_t *var = find_var(name);
+    if (equals[1] == '\0') {
+        if (var != NULL) {
+            *var = vars[--var_count];
+        }
+        return 0;
+    }
+    if (var == NULL) {
+        if (var_count == MAX_VARS) {
+            return -1;
+        }
+        var = &vars[var_count++];
+        snprintf(var->name, sizeof(var->name), "%s", name);
+    }
+    snprintf(var->value, sizeof(var->value), "%s", equals + 1);
+    return 0;
+}
+
+static void reply(int fd, const char *text) {
+    send(fd, text, strlen(text), MSG_NOSIGNAL);
+}
+
+static void reply_var(int fd, const ups_var_t *var) {
+    char line[256];
+    snprintf(line, sizeof(line), "VAR %s %s \"%s\"\n", ups_name, var->name, var->value);
+    reply(fd, line);
+}
+
+// Handle one request line, 0 to hang up
+static int handle_request(int fd, char *line) {
+    char *words[4] = { NULL };
+    int count = 0;
+    for (char *word = strtok(line, " \t\r"); word != NULL && count < 4; word = strtok(NULL, " \t\r")) {
+        words[count++] = word;
+    }
+    if (count == 0) {
+        return 1;
+    }
+
+    char text[256];
+    if (strcmp(words[0], "VER") == 0) {
+        reply(fd, "battery_monitor UPS stand-in\n");
+    } else if (strcmp(words[0], "LOGOUT") == 0) {
+        reply(fd, "OK Goodbye\n");
+        return 0;
+    } else if (strcmp(words[0], "USERNAME") == 0 || strcmp(words[0], "PASSWORD") == 0) {
+        reply(fd, "OK\n");
+    } else if (count == 2 && strcmp(words[0], "LIST") == 0 && strcmp(words[1], "UPS") == 0) {
+        snprintf(text, sizeof(text), "BEGIN LIST UPS\nUPS %s \"Stand-in UPS\"\nEND LIST UPS\n", ups_name);
+        reply(fd, text);
+    } else if ((count == 3 && strcmp(words[0], "LIST") == 0 && strcmp(words[1], "VAR") == 0) ||
+               (count == 4 && strcmp(words[0], "GET") == 0 && strcmp(words[1], "VAR") == 0)) {
+        if (strcmp(words[2], ups_name) != 0) {
+            reply(fd, "ERR UNKNOWN-UPS\n");
+        } else if (count == 4) {
+            const ups_var_t *var = find_var(words[3]);
+            if (var == NULL) {
+                reply(fd, "ERR VAR-NOT-SUPPORTED\n");
+            } else {
+                reply_var(fd, var);
+            }
+        } else {
+            snprintf(text, sizeof(text), "BEGIN LIST VAR %s\n", ups_name);
+            reply(fd, text);
+            for (int i = 0; i < var_count; i++) {
+                reply_var(fd, &vars[i]);
+            }
+            snprintf(text, sizeof(text), "END LIST VAR %s\n", ups_name);
+            reply(fd, text);
+        }
+    } else {
+        reply(fd, "ERR UNKNOWN-COMMAND\n");
+    }
+    return 1;
+}
+
+// Read what a client sent and answer every complete line, 0 to drop it
+static int handle_client(client_t *client) {
+    ssize_t received = recv(client->fd, client->input + client->length, sizeof(client->input) - client->length, 0);
+    if (received <= 0) {
+        return 0;
+    }
+    client->length += received;
+
+    char *newline;
+    while ((newline = memchr(client->input, '\n', client->length)) != NULL) {
+        *newline = '\0';
+        size_t consumed = newline - client->input + 1;
+        if (!handle_request(client->fd, client->input)) {
+            return 0;
+        }
+        memmove(client->input, newline + 1, client->length - consumed);
+        client->length -= consumed;
+    }
+    // A line longer than the buffer is not a request
+    return client->length < sizeof(client->input);
+}
+
+static int listen_tcp(const char *address) {
+    char host[256] = "127.0.0.1";
+    const char *port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    int reuse = 1;
+    if (fd != -1 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+                     bind(fd, result->ai_addr, result->ai_addrlen) == -1 || listen(fd, 8) == -1)) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 8) == -1)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Apply the NAME=VALUE lines waiting on standard input, 0 at end of input
+static int read_assignments() {
+    static char input[1024];
+    static size_t length = 0;
+
+    ssize_t received = read(STDIN_FILENO, input + length, sizeof(input) - length);
+    if (received <= 0) {
+        return 0;
+    }
+    length += received;
+
+    char *newline;
+    while ((newline = memchr(input, '\n', length)) != NULL) {
+        *newline = '\0';
+        input[strcspn(input, "\r")] = '\0';
+        if (input[0] != '\0' && set_var(input) == -1) {
+            fprintf(stderr, "Invalid assignment %s\n", input);
+        }
+        size_t consumed = newline - input + 1;
+        memmove(input, newline + 1, length - consumed);
+        length -= consumed;
+    }
+    if (length == sizeof(input)) {
+        length = 0;
+    }
+    return 1;
+}
+
+static void usage() {
+    printf("Usage: battery_ups_server [--listen [HOST:]PORT] [--socket PATH] [--ups NAME] [--set NAME=VALUE]...\n"
+           "  Serves one stand-in UPS over the NUT line protocol, on 127.0.0.1:3493 by default.\n"
+           "  NAME=VALUE lines on standard input change variables while it runs.\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *tcp_address = NULL;
+    const char *socket_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            tcp_address = argv[++i];
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--ups") == 0 && i + 1 < argc) {
+            snprintf(ups_name, sizeof(ups_name), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--set") == 0 && i + 1 < argc) {
+            if (set_var(argv[++i]) == -1) {
+                fprintf(stderr, "Invalid assignment %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (tcp_address == NULL && socket_path == NULL) {
+        tcp_address = "127.0.0.1:3493";
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int listeners[2];
+    int listener_count = 0;
+    if (tcp_address != NULL) {
+        if ((listeners[listener_count++] = listen_tcp(tcp_address)) == -1) {
+            perror("Failed to listen on TCP");
+            return 1;
+        }
+        printf("Serving UPS %s on %s\n", ups_name, tcp_address);
+    }
+    if (socket_path != NULL) {
+        if ((listeners[listener_count++] = listen_unix(socket_path)) == -1) {
+            perror("Failed to listen on the Unix socket");
+            return 1;
+        }
+        printf("Serving UPS %s on %s\n", ups_name, socket_path);
+    }
+    fflush(stdout);
+
+    int stdin_open = 1;
+    while (1) {
+        struct pollfd fds[2 + 1 + MAX_CLIENTS];
+        int count = 0;
+        for (int i = 0; i < listener_count; i++) {
+            fds[count++] = (struct pollfd){ listeners[i], POLLIN, 0 };
+        }
+        fds[count++] = (struct pollfd){ stdin_open ? STDIN_FILENO : -1, POLLIN, 0 };
+        for (int i = 0; i < client_count; i++) {
+            fds[count++] = (struct pollfd){ clients[i].fd, POLLIN, 0 };
+        }
+
+        if (poll(fds, count, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return 1;
+        }
+
+        for (int i = 0; i < listener_count; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            int fd = accept(listeners[i], NULL, NULL);
+            if (fd != -1 && client_count < MAX_CLIENTS) {
+                clients[client_count++] = (client_t){ .fd = fd };
+            } else if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        if (fds[listener_count].revents != 0 && read_assignments() == 0) {
+            stdin_open = 0;  // Keep serving the last values
+        }
+
+        // Walk backwards so dropping a client does not skip the next one
+        for (int i = count - 1; i > listener_count; i--) {
+            client_t *client = &clients[i - listener_count - 1];
+            if (fds[i].revents != 0 && !handle_client(client)) {
+                close(client->fd);
+                *client = clients[--client_count];
+            }
+        }
+    }
+}
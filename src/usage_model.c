@@ -0,0 +1,318 @@
+// usage_model.c
+//
+// Learns when and how fast the battery usually drains. For each hour of
+// the week the model keeps exponentially decayed sums of the percent lost,
+// the hours spent on battery and the number of times a charger was
+// connected, so every sample costs a constant amount of work. Dividing the
+// sums gives a drain rate and a plug-in hazard per hour, which are walked
+// forward to predict the battery level at the usual charge time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "usage_model.h"
+#include "battery_monitor.h"
+#include "log_message.h"
+
+#define USAGE_MODEL_FILE "/battery_monitor/usage_model.bin"
+
+#define DECAY_HOURS 4.0        // Battery hours in a slot after which old data weighs 1/e
+#define MAX_SAMPLE_GAP 1800    // Longer gaps (suspend, shutdown) are not learned from
+#define MIN_SLOT_HOURS 0.5     // Below this a slot falls back to the weekly average
+#define MIN_MODEL_HOURS 8.0    // Below this the model makes no predictions
+#define HEADROOM 10.0          // Percent of improvement before a pre-emptive stage is released
+#define STAGE_STEP 10.0        // Further percent of shortfall per pre-emptive stage
+#define CHARGER_HAZARD 4.0     // Plug-ins per hour assumed in hours normally spent on a charger
+
+#define PREDICTION_UNKNOWN -1000.0
+
+static usage_model_t *model = NULL;
+static int model_mapped = 0;
+
+static time_t previous_time = 0;
+static int previous_level = -1;
+static int previous_charging = 1;
+
+static int shortfall = 0;
+static int predicted_level = -1;
+static int predicted_slot = -1;
+
+// Build the model path under $XDG_DATA_HOME or ~/.local/share; caller frees the result
+char *get_usage_model_path() {
+    char path[PATH_MAX];
+    const char *data_home = getenv("XDG_DATA_HOME");
+
+    if (data_home != NULL && data_home[0] != '\0') {
+        snprintf(path, sizeof(path), "%s%s", data_home, USAGE_MODEL_FILE);
+    } else {
+        const char *home_dir = getenv("HOME");
+        if (home_dir == NULL) {
+            log_message("Failed to get HOME environment variable");
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "%s/.local/share%s", home_dir, USAGE_MODEL_FILE);
+    }
+
+    return strdup(path);
+}
+
+static int model_is_valid(const usage_model_t *m) {
+    return memcmp(m->magic, USAGE_MODEL_MAGIC, sizeof(m->magic)) == 0 &&
+           m->version == USAGE_MODEL_VERSION &&
+           m->slot_count == USAGE_MODEL_SLOTS;
+}
+
+static void model_init(usage_model_t *m) {
+    memset(m, 0, sizeof(*m));
+    memcpy(m->magic, USAGE_MODEL_MAGIC, sizeof(m->magic));
+    m->version = USAGE_MODEL_VERSION;
+    m->slot_count = USAGE_MODEL_SLOTS;
+}
+
+int usage_model_open(const char *path) {
+    if (model != NULL) {
+        return 0;
+    }
+
+    if (path == NULL) {
+        model = malloc(sizeof(*model));
+        if (model == NULL) {
+            return -1;
+        }
+        model_init(model);
+        return 0;
+    }
+
+    // Create the parent directories
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Failed to open usage model");
+        log_message("Failed to open usage model");
+        return -1;
+    }
+
+    struct stat st;
+    int fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+    if (fresh && ftruncate(fd, sizeof(usage_model_t)) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (!fresh && (size_t)st.st_size != sizeof(usage_model_t)) {
+        log_message("Usage model has an unknown format, not learning");
+        close(fd);
+        return -1;
+    }
+
+    usage_model_t *mapped = mmap(NULL, sizeof(usage_model_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("Failed to map usage model");
+        return -1;
+    }
+
+    if (fresh) {
+        model_init(mapped);
+    } else if (!model_is_valid(mapped)) {
+        log_message("Usage model has an unknown format, not learning");
+        munmap(mapped, sizeof(usage_model_t));
+        return -1;
+    }
+
+    model = mapped;
+    model_mapped = 1;
+    return 0;
+}
+
+void usage_model_close() {
+    if (model == NULL) {
+        return;
+    }
+    if (model_mapped) {
+        munmap(model, sizeof(usage_model_t));
+    } else {
+        free(model);
+    }
+    model = NULL;
+    model_mapped = 0;
+}
+
+static int slot_of(time_t t, int *seconds_into_hour) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if (seconds_into_hour != NULL) {
+        *seconds_into_hour = tm.tm_min * 60 + tm.tm_sec;
+    }
+    return tm.tm_wday * 24 + tm.tm_hour;
+}
+
+static double predict(const usage_model_t *m, time_t now, int level) {
+    double total_drain = 0, total_hours = 0;
+    for (int i = 0; i < USAGE_MODEL_SLOTS; i++) {
+        total_drain += m->slots[i].drain;
+        total_hours += m->slots[i].battery_hours;
+    }
+    if (total_hours < MIN_MODEL_HOURS) {
+        return PREDICTION_UNKNOWN;
+    }
+    double average_rate = total_drain / total_hours;
+
+    // Walk the coming week hour by hour until a charger has become more likely than not
+    double projected = level;
+    double survival = 1.0;
+    time_t t = now;
+    for (int step = 0; step <= USAGE_MODEL_SLOTS; step++) {
+        int offset;
+        const usage_slot_t *slot = &m->slots[slot_of(t, &offset)];
+        double hours = (3600 - offset) / 3600.0;
+
+        // An hour usually spent on a charger means one is close at hand
+        int known = slot->battery_hours >= MIN_SLOT_HOURS;
+        double rate = known ? slot->drain / slot->battery_hours : average_rate;
+        double hazard = known ? slot->plug_ins / slot->battery_hours
+                              : (slot->charger_hours >= MIN_SLOT_HOURS ? CHARGER_HAZARD : 0);
+
+        double remaining = survival * exp(-hazard * hours);
+        if (remaining <= 0.5) {
+            projected -= rate * log(survival / 0.5) / hazard;
+            return projected;
+        }
+
+        survival = remaining;
+        projected -= rate * hours;
+        t += 3600 - offset;
+    }
+
+    return PREDICTION_UNKNOWN;  // No usual charge time within a week
+}
+
+int usage_model_update(time_t now, int level, int charging) {
+    if (model == NULL || level < 0) {
+        return 0;
+    }
+
+    // Credit the interval since the previous sample to the hour it started in
+    long gap = now - previous_time;
+    if (previous_time > 0 && gap > 0 && gap <= MAX_SAMPLE_GAP) {
+        usage_slot_t *slot = &model->slots[slot_of(previous_time, NULL)];
+        double hours = gap / 3600.0;
+        double decay = exp(-hours / DECAY_HOURS);
+
+        if (previous_charging) {
+            slot->charger_hours = slot->charger_hours * decay + hours;
+        } else {
+            int drop = previous_level - level;
+            slot->drain = slot->drain * decay + (drop > 0 ? drop : 0);
+            slot->battery_hours = slot->battery_hours * decay + hours;
+            slot->plug_ins = slot->plug_ins * decay + (charging ? 1 : 0);
+        }
+    }
+    previous_time = now;
+    previous_level = level;
+    previous_charging = charging != 0;
+
+    if (charging) {
+        shortfall = 0;
+        predicted_level = -1;
+        return 0;
+    }
+
+    // Predictions only change when the level or the hour does
+    int slot = slot_of(now, NULL);
+    if (level == predicted_level && slot == predicted_slot) {
+        return shortfall;
+    }
+    predicted_level = level;
+    predicted_slot = slot;
+
+    // Stage n engages once the prediction falls (n - 1) steps short of the
+    // critical reserve, and is released once it is HEADROOM better than that.
+    // One stage per new prediction, so measures build up as the level drops.
+    double projected = predict(model, now, level);
+    int stage = shortfall;
+    if (projected == PREDICTION_UNKNOWN) {
+        stage = 0;
+    } else {
+        double deficit = THRESHOLD_CRITICAL - projected;
+        if (stage < USAGE_MODEL_STAGES && (stage == 0 ? deficit > 0 : deficit >= stage * STAGE_STEP)) {
+            stage++;
+        } else if (stage > 0 && deficit < (stage - 1) * STAGE_STEP - HEADROOM) {
+            stage--;
+        }
+    }
+
+    if (stage != shortfall) {
+        char message[128];
+        snprintf(message, sizeof(message), "Usage model expects %.0f%% at the usual charge time, saving stage %d -> %d",
+                 projected == PREDICTION_UNKNOWN ? (double)level : projected, shortfall, stage);
+        log_message(message);
+        shortfall = stage;
+    }
+    return shortfall;
+}
+
+static const char *weekday_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+int usage_model_command(int argc, char *argv[]) {
+    char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            path = strdup(argv[++i]);
+        } else {
+            printf("Usage: battery_monitor model [--file PATH]\n"
+                   "  Print the learned drain rate and charger likelihood for every hour of the week\n");
+            free(path);
+            return 1;
+        }
+    }
+
+    if (path == NULL && (path = get_usage_model_path()) == NULL) {
+        return 1;
+    }
+
+    usage_model_t loaded;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+    free(path);
+
+    size_t read = fread(&loaded, sizeof(loaded), 1, file);
+    fclose(file);
+    if (read != 1 || !model_is_valid(&loaded)) {
+        fprintf(stderr, "Usage model has an unknown format\n");
+        return 1;
+    }
+
+    printf("weekday,hour,drain_percent_per_hour,battery_hours,plug_ins_per_hour,charger_hours\n");
+    for (int i = 0; i < USAGE_MODEL_SLOTS; i++) {
+        const usage_slot_t *slot = &loaded.slots[i];
+        if (slot->battery_hours <= 0) {
+            printf("%s,%d,,,,%.2f\n", weekday_names[i / 24], i % 24, slot->charger_hours);
+            continue;
+        }
+        printf("%s,%d,%.2f,%.2f,%.3f,%.2f\n", weekday_names[i / 24], i % 24,
+               slot->drain / slot->battery_hours, slot->battery_hours, slot->plug_ins / slot->battery_hours,
+               slot->charger_hours);
+    }
+    return 0;
+}
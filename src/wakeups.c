@@ -0,0 +1,532 @@
+// wakeups.c
+//
+// Idle drain is mostly wakeups: timers and interrupts that keep the
+// package out of its deep C-states while CPU usage looks negligible. This
+// takes snapshots of /proc/interrupts, the kernel wakeup sources, per-CPU
+// cpuidle residency and per-process context switches, and ranks the
+// differences between two snapshots per second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <glob.h>
+#include <limits.h>
+#include "wakeups.h"
+#include "metrics.h"
+#include "log_message.h"
+#include "paths.h"
+
+#define MAX_TRACKED 64     // Noisiest processes remembered for victim selection
+#define DEFAULT_TOP 10
+#define RATE_MAX_AGE 30    // Seconds a victim rate stays valid after its interval ended
+#define MIN_SECONDS 5      // Shortest interval worth taking early for a fresh rate
+
+typedef struct {
+    char name[32];        // Key: IRQ, pid, source or C-state name
+    char label[64];       // What to show next to it
+    unsigned long long value;
+} counter_t;
+
+typedef struct {
+    counter_t *items;
+    int count;
+    int capacity;
+} counter_set_t;
+
+typedef struct {
+    counter_set_t interrupts;  // Interrupts per line, summed over CPUs
+    counter_set_t sources;     // Events per wakeup source
+    counter_set_t cstates;     // Residency in microseconds per state, summed over CPUs
+    counter_set_t processes;   // Voluntary context switches per process, summed over threads
+    int cpu_count;
+    double time;
+} snapshot_t;
+
+typedef struct {
+    const counter_t *counter;
+    double rate;
+} ranked_t;
+
+typedef struct {
+    pid_t pid;
+    char comm[16];  // A reused pid must not inherit the rate
+    double rate;
+} tracked_t;
+
+static int interval = 0;
+static int victim_rate = 0;
+static snapshot_t snapshots[2];
+static int have_previous = 0;
+static tracked_t tracked[MAX_TRACKED];
+static int tracked_count = 0;
+static double tracked_time = 0;  // End of the interval the rates are from
+
+static counter_t *counter_add(counter_set_t *set, const char *name, const char *label) {
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 64;
+        counter_t *items = realloc(set->items, capacity * sizeof(*items));
+        if (items == NULL) {
+            return NULL;
+        }
+        set->items = items;
+        set->capacity = capacity;
+    }
+
+    counter_t *counter = &set->items[set->count++];
+    snprintf(counter->name, sizeof(counter->name), "%s", name);
+    snprintf(counter->label, sizeof(counter->label), "%s", label);
+    counter->value = 0;
+    return counter;
+}
+
+// Snapshots list things in nearly the same order, so try the same index first
+static const counter_t *counter_find(const counter_set_t *set, const char *name, int hint) {
+    if (hint < set->count && strcmp(set->items[hint].name, name) == 0) {
+        return &set->items[hint];
+    }
+    for (int i = 0; i < set->count; i++) {
+        if (strcmp(set->items[i].name, name) == 0) {
+            return &set->items[i];
+        }
+    }
+    return NULL;
+}
+
+static void read_interrupts(snapshot_t *snapshot) {
+    char path[PATH_MAX];
+    char line[1024];
+    snprintf(path, sizeof(path), "%s/proc/interrupts", procfs_root);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    // The header names one column per CPU
+    int columns = 0;
+    if (fgets(line, sizeof(line), file) != NULL) {
+        for (char *word = strtok(line, " \t\n"); word != NULL; word = strtok(NULL, " \t\n")) {
+            columns++;
+        }
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        char *colon = strchr(p, ':');
+        if (colon == NULL) {
+            continue;
+        }
+        *colon = '\0';
+
+        unsigned long long total = 0;
+        char *end = colon + 1;
+        for (int cpu = 0; cpu < columns; cpu++) {
+            char *next;
+            unsigned long long value = strtoull(end, &next, 10);
+            if (next == end) {
+                break;
+            }
+            total += value;
+            end = next;
+        }
+
+        while (isspace((unsigned char)*end)) end++;
+        end[strcspn(end, "\n")] = '\0';
+        counter_t *counter = counter_add(&snapshot->interrupts, p, end);
+        if (counter != NULL) {
+            counter->value = total;
+        }
+    }
+    fclose(file);
+}
+
+// debugfs has every source in one file; /sys/class/wakeup needs no debugfs
+static void read_wakeup_sources(snapshot_t *snapshot) {
+    char path[PATH_MAX];
+    char line[512];
+    snprintf(path, sizeof(path), "%s/sys/kernel/debug/wakeup_sources", sysfs_root);
+
+    FILE *file = fopen(path, "r");
+    if (file != NULL) {
+        if (fgets(line, sizeof(line), file) != NULL) {  // Header
+            while (fgets(line, sizeof(line), file) != NULL) {
+                char name[64];
+                unsigned long long active, events;
+                if (sscanf(line, "%63s %llu %llu", name, &active, &events) == 3) {
+                    counter_t *counter = counter_add(&snapshot->sources, name, name);
+                    if (counter != NULL) {
+                        counter->value = events;
+                    }
+                }
+            }
+        }
+        fclose(file);
+        return;
+    }
+
+    glob_t glob_result;
+    snprintf(path, sizeof(path), "%s/sys/class/wakeup/wakeup*", sysfs_root);
+    if (glob(path, 0, NULL, &glob_result) == 0) {
+        for (size_t i = 0; i < glob_result.gl_pathc; i++) {
+            char name[64] = "";
+            unsigned long long events = 0;
+
+            snprintf(path, sizeof(path), "%s/name", glob_result.gl_pathv[i]);
+            file = fopen(path, "r");
+            if (file == NULL) {
+                continue;
+            }
+            int ok = fscanf(file, "%63s", name) == 1;
+            fclose(file);
+
+            snprintf(path, sizeof(path), "%s/event_count", glob_result.gl_pathv[i]);
+            file = fopen(path, "r");
+            if (file == NULL) {
+                continue;
+            }
+            ok = ok && fscanf(file, "%llu", &events) == 1;
+            fclose(file);
+
+            counter_t *counter = ok ? counter_add(&snapshot->sources, name, name) : NULL;
+            if (counter != NULL) {
+                counter->value = events;
+            }
+        }
+    }
+    globfree(&glob_result);
+}
+
+static void read_cpuidle(snapshot_t *snapshot) {
+    char path[PATH_MAX];
+    glob_t glob_result;
+
+    snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu[0-9]*/cpuidle", sysfs_root);
+    if (glob(path, 0, NULL, &glob_result) == 0) {
+        snapshot->cpu_count = glob_result.gl_pathc;
+    }
+    globfree(&glob_result);
+
+    snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu[0-9]*/cpuidle/state[0-9]*", sysfs_root);
+    if (glob(path, 0, NULL, &glob_result) == 0) {
+        for (size_t i = 0; i < glob_result.gl_pathc; i++) {
+            char name[32] = "";
+            unsigned long long usec = 0;
+
+            snprintf(path, sizeof(path), "%s/name", glob_result.gl_pathv[i]);
+            FILE *file = fopen(path, "r");
+            if (file == NULL) {
+                continue;
+            }
+            int ok = fscanf(file, "%31s", name) == 1;
+            fclose(file);
+
+            snprintf(path, sizeof(path), "%s/time", glob_result.gl_pathv[i]);
+            file = fopen(path, "r");
+            if (file == NULL) {
+                continue;
+            }
+            ok = ok && fscanf(file, "%llu", &usec) == 1;
+            fclose(file);
+            if (!ok) {
+                continue;
+            }
+
+            // States share their names across CPUs
+            counter_t *counter = (counter_t *)counter_find(&snapshot->cstates, name, 0);
+            if (counter == NULL) {
+                counter = counter_add(&snapshot->cstates, name, name);
+            }
+            if (counter != NULL) {
+                counter->value += usec;
+            }
+        }
+    }
+    globfree(&glob_result);
+}
+
+// Voluntary context switches of every thread of a process, i.e. how often it went to sleep and woke
+static unsigned long long read_context_switches(const char *pid) {
+    char path[PATH_MAX];
+    char line[256];
+    unsigned long long total = 0;
+
+    snprintf(path, sizeof(path), "%s/proc/%s/task", procfs_root, pid);
+    DIR *task_dir = opendir(path);
+    if (task_dir == NULL) {
+        return 0;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(task_dir)) != NULL) {
+        if (!isdigit((unsigned char)entry->d_name[0])) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/proc/%s/task/%s/status", procfs_root, pid, entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        while (fgets(line, sizeof(line), file) != NULL) {
+            unsigned long long switches;
+            if (sscanf(line, "voluntary_ctxt_switches: %llu", &switches) == 1) {
+                total += switches;
+                break;
+            }
+        }
+        fclose(file);
+    }
+    closedir(task_dir);
+    return total;
+}
+
+static void read_processes(snapshot_t *snapshot) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/proc", procfs_root);
+
+    DIR *proc_dir = opendir(path);
+    if (proc_dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(proc_dir)) != NULL) {
+        if (!isdigit((unsigned char)entry->d_name[0])) {
+            continue;
+        }
+
+        char comm[64] = "";
+        snprintf(path, sizeof(path), "%s/proc/%s/comm", procfs_root, entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        if (fgets(comm, sizeof(comm), file) != NULL) {
+            comm[strcspn(comm, "\n")] = '\0';
+        }
+        fclose(file);
+
+        counter_t *counter = counter_add(&snapshot->processes, entry->d_name, comm);
+        if (counter != NULL) {
+            counter->value = read_context_switches(entry->d_name);
+        }
+    }
+    closedir(proc_dir);
+}
+
+static void take_snapshot(snapshot_t *snapshot) {
+    snapshot->interrupts.count = 0;
+    snapshot->sources.count = 0;
+    snapshot->cstates.count = 0;
+    snapshot->processes.count = 0;
+    snapshot->cpu_count = 0;
+
+    read_interrupts(snapshot);
+    read_wakeup_sources(snapshot);
+    read_cpuidle(snapshot);
+    read_processes(snapshot);
+    snapshot->time = metrics_now();
+}
+
+static int compare_ranked(const void *a, const void *b) {
+    double x = ((const ranked_t *)a)->rate, y = ((const ranked_t *)b)->rate;
+    return (x < y) - (x > y);
+}
+
+// Per-second increase of every counter, highest first. The caller frees the result.
+static ranked_t *rank(const counter_set_t *before, const counter_set_t *after, double seconds, int *count) {
+    *count = 0;
+    ranked_t *ranked = malloc((after->count ? after->count : 1) * sizeof(*ranked));
+    if (ranked == NULL || seconds <= 0) {
+        return ranked;
+    }
+
+    for (int i = 0; i < after->count; i++) {
+        const counter_t *old = counter_find(before, after->items[i].name, i);
+        // A reused pid is a different process
+        if (old == NULL || strcmp(old->label, after->items[i].label) != 0 || after->items[i].value < old->value) {
+            continue;
+        }
+        double rate = (after->items[i].value - old->value) / seconds;
+        if (rate > 0) {
+            ranked[*count].counter = &after->items[i];
+            ranked[*count].rate = rate;
+            (*count)++;
+        }
+    }
+    qsort(ranked, *count, sizeof(*ranked), compare_ranked);
+    return ranked;
+}
+
+void wakeups_init(int interval_seconds, int rate) {
+    interval = interval_seconds;
+    victim_rate = rate;
+}
+
+// End the current interval: rank it, remember the noisiest processes and
+// start the next one
+static void sample_interval() {
+    snapshot_t *previous = &snapshots[0];
+    snapshot_t *current = &snapshots[1];
+
+    take_snapshot(current);
+    double seconds = current->time - previous->time;
+
+    int process_count, interrupt_count;
+    ranked_t *processes = rank(&previous->processes, &current->processes, seconds, &process_count);
+    ranked_t *interrupts = rank(&previous->interrupts, &current->interrupts, seconds, &interrupt_count);
+
+    tracked_count = 0;
+    for (int i = 0; processes != NULL && i < process_count && i < MAX_TRACKED; i++) {
+        tracked[tracked_count].pid = atoi(processes[i].counter->name);
+        snprintf(tracked[tracked_count].comm, sizeof(tracked[tracked_count].comm), "%s", processes[i].counter->label);
+        tracked[tracked_count].rate = processes[i].rate;
+        tracked_count++;
+    }
+    tracked_time = current->time;
+
+    double interrupt_total = 0;
+    for (int i = 0; interrupts != NULL && i < interrupt_count; i++) {
+        interrupt_total += interrupts[i].rate;
+    }
+
+    char message[256];
+    if (process_count > 0) {
+        snprintf(message, sizeof(message), "Wakeups: %.0f interrupts/s, noisiest process %s (PID %s, %.1f/s)",
+                 interrupt_total, processes[0].counter->label, processes[0].counter->name, processes[0].rate);
+    } else {
+        snprintf(message, sizeof(message), "Wakeups: %.0f interrupts/s", interrupt_total);
+    }
+    log_message(message);
+
+    free(processes);
+    free(interrupts);
+
+    // The current snapshot becomes the baseline for the next interval
+    snapshot_t swap = *previous;
+    *previous = *current;
+    *current = swap;
+}
+
+void wakeups_update(int charging) {
+    if (interval <= 0 || charging == -1) {
+        return;
+    }
+    // Only battery time matters, and a charger gap must not become one long interval
+    if (charging) {
+        have_previous = 0;
+        tracked_count = 0;
+        return;
+    }
+
+    if (have_previous && metrics_now() - snapshots[0].time < interval) {
+        return;
+    }
+
+    if (!have_previous) {
+        take_snapshot(&snapshots[0]);
+        have_previous = 1;
+        return;
+    }
+
+    sample_interval();
+}
+
+double wakeups_process_rate(pid_t pid, const char *comm) {
+    for (int i = 0; i < tracked_count; i++) {
+        // comm holds at most 15 characters of the name
+        if (tracked[i].pid == pid && strncmp(tracked[i].comm, comm, 15) == 0) {
+            return tracked[i].rate;
+        }
+    }
+    return 0;
+}
+
+int wakeups_is_victim(pid_t pid, const char *comm) {
+    if (victim_rate <= 0) {
+        return 0;
+    }
+    // A rate from minutes ago may belong to a process that has calmed down
+    // since, so end the interval early. Right after a sample nobody is judged.
+    if (metrics_now() - tracked_time > RATE_MAX_AGE) {
+        if (!have_previous || metrics_now() - snapshots[0].time < MIN_SECONDS) {
+            return 0;
+        }
+        sample_interval();
+    }
+    return wakeups_process_rate(pid, comm) >= victim_rate;
+}
+
+static void print_ranked(const char *title, const counter_set_t *before, const counter_set_t *after,
+                         double seconds, int top, int show_name) {
+    int count;
+    ranked_t *ranked = rank(before, after, seconds, &count);
+    if (ranked == NULL) {
+        return;
+    }
+
+    printf("%s\n", title);
+    if (count == 0) {
+        printf("  none\n");
+    }
+    for (int i = 0; i < count && i < top; i++) {
+        if (show_name) {
+            printf("  %10.1f  %-8s %s\n", ranked[i].rate, ranked[i].counter->name, ranked[i].counter->label);
+        } else {
+            printf("  %10.1f  %s\n", ranked[i].rate, ranked[i].counter->label);
+        }
+    }
+    printf("\n");
+    free(ranked);
+}
+
+int wakeups_command(int argc, char *argv[]) {
+    double seconds = 5;
+    int top = DEFAULT_TOP;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else {
+            printf("Usage: battery_monitor wakeups [--interval SECONDS] [--top N]\n"
+                   "  Rank interrupts, wakeup sources and processes by wakeups per second,\n"
+                   "  and show where the CPUs spent their idle time\n");
+            return 1;
+        }
+    }
+    if (seconds <= 0 || top <= 0) {
+        fprintf(stderr, "Interval and top must be positive\n");
+        return 1;
+    }
+
+    snapshot_t before = { 0 }, after = { 0 };
+    take_snapshot(&before);
+    usleep((useconds_t)(seconds * 1e6));
+    take_snapshot(&after);
+    double elapsed = after.time - before.time;
+
+    printf("Over %.1f s on %d CPUs with cpuidle\n\n", elapsed, after.cpu_count);
+    print_ranked("Interrupts per second", &before.interrupts, &after.interrupts, elapsed, top, 1);
+    print_ranked("Wakeup source events per second", &before.sources, &after.sources, elapsed, top, 0);
+    print_ranked("Process wakeups (voluntary context switches) per second", &before.processes, &after.processes,
+                 elapsed, top, 1);
+
+    printf("Idle state residency\n");
+    if (after.cstates.count == 0 || after.cpu_count == 0) {
+        printf("  cpuidle not available\n");
+    }
+    for (int i = 0; i < after.cstates.count; i++) {
+        const counter_t *old = counter_find(&before.cstates, after.cstates.items[i].name, i);
+        if (old == NULL || elapsed <= 0) {
+            continue;
+        }
+        double share = (after.cstates.items[i].value - old->value) / (elapsed * 1e6 * after.cpu_count);
+        printf("  %6.1f%%  %s\n", share * 100, after.cstates.items[i].name);
+    }
+    return 0;
+}